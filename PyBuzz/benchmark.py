@@ -0,0 +1,303 @@
+'''
+Benchmarks of the hot paths of pybuzz, and a load generator for the CommHub.
+
+Build the extension and run all of them with
+    python setup.py bench
+or, once the extension is built in place,
+    python benchmark.py --output results.json
+
+The results are written as JSON. Each micro-benchmark gives the operations per second and the
+percentiles of the time per operation in microseconds, over batches of operations. The load gives
+the throughput of the CommHub, its own counters (see CommHub.stats), and the delays seen by the clients.
+The Buzz scripts of the micro-benchmarks are compiled with bzzc, which must be on the PATH.
+'''
+
+import argparse
+import json
+import math
+import os
+import resource
+import selectors
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+import pybuzz
+from pybuzz import buzzhook, BuzzVM, CommHub, Inbox, PacketReader, Simulation
+
+
+HOOK_CALLS = 100  # Calls of bench_hook by each step of the hook benchmark
+
+SCRIPT = '''
+function init() {{
+    n = 0
+}}
+
+function step() {{
+    var i = 0
+    while(i < {calls}) {{
+        bench_hook(i, 2.5)
+        i = i + 1
+    }}
+    i = 0
+    while(i < {messages}) {{
+        neighbors.broadcast("m", n)
+        i = i + 1
+    }}
+    n = n + 1
+}}
+'''
+
+
+@buzzhook
+def bench_hook(i, x):
+    return 0
+
+
+'''
+Compile a Buzz script of the benchmarks with bzzc
+:param directory: string. Where the files are written
+:param name: string. Name of the script
+:return: (string, string). The *.bo and *.bdb filenames
+'''
+def compile_script(directory, name, bzzc, calls=0, messages=0):
+    bzz = os.path.join(directory, name + ".bzz")
+    bo = os.path.join(directory, name + ".bo")
+    bdb = os.path.join(directory, name + ".bdb")
+    with open(bzz, "w") as f:
+        f.write(SCRIPT.format(calls=calls, messages=messages))
+    subprocess.check_call([bzzc, "-b", bo, "-d", bdb, bzz], stdout=subprocess.DEVNULL)
+    return bo, bdb
+
+
+'''
+Time an operation in batches
+:param name: string. Name of the benchmark in the results
+:param op: function without arguments
+:param count: int. Number of operations
+:param batch: int. Operations timed together
+:return: dict. 'name', 'ops', 'seconds', 'ops_per_s', and the 'p50_us', 'p99_us' and 'max_us' of the batches,
+    per operation
+'''
+def measure(name, op, count, batch=100):
+    times = []
+    done = 0
+    start = time.perf_counter()
+    while done < count:
+        t = time.perf_counter()
+        for _ in range(batch):
+            op()
+        times.append((time.perf_counter() - t) / batch)
+        done += batch
+    elapsed = time.perf_counter() - start
+    times = np.array(times) * 1e6
+    return {'name': name, 'ops': done, 'seconds': elapsed, 'ops_per_s': done / elapsed,
+            'p50_us': float(np.percentile(times, 50)), 'p99_us': float(np.percentile(times, 99)),
+            'max_us': float(times.max())}
+
+
+class FrameSocket:
+    '''
+    Socket replaying the same bytes at each recv_into, for decoding them over and over
+    :param data: bytes. Whole frames
+    '''
+    def __init__(self, data):
+        self.data = data
+
+    def recv_into(self, buf):
+        buf[:len(self.data)] = self.data
+        return len(self.data)
+
+
+'''
+Frame sent by a CommHub to a robot, holding the messages of one neighbor
+:param port: int. Port of the CommHub, free
+:param msgs: list of bytes. The messages of the neighbor
+:return: bytes
+'''
+def capture_frame(port, msgs):
+    hub = CommHub(2, port=port)
+    clients = []
+    for robot_id in (1, 2):
+        s = socket.create_connection(("localhost", port))
+        s.sendall(pybuzz.handshake(robot_id))
+        clients.append(s)
+    hub.update_position(1, (0, 0, 0))
+    hub.update_position(2, (0.5, 0, 0))
+    clients[1].sendall(pybuzz.uplink_frame(0, 2, msgs))
+    time.sleep(0.1)
+    hub.forward_packets()
+    time.sleep(0.1)
+    frame = clients[0].recv(1 << 20)
+    for s in clients:
+        s.close()
+    hub.destroy()
+    return frame
+
+
+'''
+Micro-benchmarks of the step, the hooks, the feeding of messages, alone and in batches, the positions, the bearings
+and the frames
+:return: list of dict. The results of measure
+'''
+def micro(args):
+    results = []
+    directory = tempfile.mkdtemp(prefix="pybuzz_bench")
+    try:
+        plain = Simulation(*compile_script(directory, "plain", args.bzzc), 1)
+        hooked = Simulation(*compile_script(directory, "hooked", args.bzzc, calls=HOOK_CALLS), 1)
+        sender = Simulation(*compile_script(directory, "sender", args.bzzc, messages=1), [2])
+        for sim in (plain, hooked, sender):
+            sim.step(np.zeros((1, 3)))  # The global part of the script and init()
+        vmid = plain.vmids[0]
+        hooked_vmid = hooked.vmids[0]
+
+        step = measure("buzz_script_step", lambda: pybuzz.step_vm(vmid), args.count // 10)
+        results.append(step)
+        with_hooks = measure("buzz_script_step_{}_hooks".format(HOOK_CALLS), lambda: pybuzz.step_vm(hooked_vmid),
+                             args.count // HOOK_CALLS, batch=10)
+        results.append(with_hooks)
+        per_call = max((1 / with_hooks['ops_per_s'] - 1 / step['ops_per_s']) / HOOK_CALLS, 1e-12)
+        calls = BuzzVM.hook_stats().get("bench_hook", {})
+        results.append({'name': "python_callback", 'ops': with_hooks['ops'] * HOOK_CALLS,
+                        'seconds': with_hooks['seconds'], 'ops_per_s': 1 / per_call,
+                        'p50_us': calls.get('p50', 0.0), 'p99_us': calls.get('p99', 0.0),
+                        'max_us': calls.get('max', 0.0)})
+
+        sender.step(np.zeros((1, 3)))
+        blob, sizes, _ = sender.messages()
+        msg = blob[:sizes[0]]
+        results.append(measure("feed_buzz_message", lambda: pybuzz.feed_message(vmid, 2, msg), args.count))
+        packed = bytes(msg) * args.messages
+        senders = np.full(args.messages, 2, dtype=np.uint16)
+        offsets = np.arange(args.messages + 1, dtype=np.intc) * len(msg)
+        results.append(measure("feed_buzz_messages_{}".format(args.messages),
+                               lambda: pybuzz.feed_messages(vmid, senders, packed, offsets),
+                               args.count // args.messages))
+        pybuzz.step_vm(vmid)  # Let the VM take the messages
+        results.append(measure("set_abs_pos", lambda: pybuzz.set_position(vmid, 1.0, 2.0, 0.0), args.count))
+        for sim in (plain, hooked, sender):
+            sim.close()
+    finally:
+        shutil.rmtree(directory)
+
+    origin = np.zeros(3)
+    positions = np.random.default_rng(0).uniform(-5, 5, (args.neighbors_batch, 3))
+    results.append(measure("neighbor_bearings_{}_{}".format(args.neighbors_batch, pybuzz.geometry_kernel()),
+                           lambda: pybuzz.polar(origin, positions), args.count // 10))
+
+    msgs = [os.urandom(args.message_size) for _ in range(args.messages)]
+    results.append(measure("frame_encode_{}x{}B".format(args.messages, args.message_size),
+                           lambda: pybuzz.uplink_frame(0, 1, msgs), args.count))
+    reader = PacketReader(FrameSocket(capture_frame(args.port, msgs)), 1, Inbox(1 << 20, "drop_oldest"))
+    results.append(measure("frame_decode_{}x{}B".format(args.messages, args.message_size), reader.read, args.count))
+    return results
+
+
+'''
+Serve fake robots to a CommHub, from one thread, each sending frames of messages at a rate
+:return: dict. The throughput, the counters of the CommHub, and the delays seen by the clients
+'''
+def load(args):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < 2 * args.clients + 64:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, 2 * args.clients + 64), hard))
+    hub = CommHub(args.clients, forward_freq=args.forward_freq, neighbor_distance=args.neighbor_distance,
+                  port=args.port + 1)
+    sel = selectors.DefaultSelector()
+    clients = []
+    for robot_id in range(args.clients):
+        s = socket.create_connection(("localhost", args.port + 1))
+        s.sendall(pybuzz.handshake(robot_id))
+        reader = PacketReader(s, robot_id, Inbox(1 << 16, "drop_oldest"))
+        sel.register(s, selectors.EVENT_READ, reader)
+        clients.append((s, reader))
+
+    # As many robots in range of each robot as asked, on average
+    side = math.sqrt(args.clients * math.pi * args.neighbor_distance ** 2 / max(args.neighbors, 1e-9))
+    rng = np.random.default_rng(0)
+    for robot_id, (x, y) in enumerate(rng.uniform(0, side, (args.clients, 2))):
+        hub.update_position(robot_id, (x, y, 0))
+
+    msgs = [os.urandom(args.message_size) for _ in range(args.messages)]
+    period = 1 / args.rate
+    next_send = time.monotonic() + np.arange(args.clients) * period / args.clients
+    seq = 0
+    sent = 0
+    sent_bytes = 0
+    received = 0
+    start = time.monotonic()
+    end = start + args.duration
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+        for robot_id in np.flatnonzero(next_send <= now):
+            frame = pybuzz.uplink_frame(seq, robot_id, msgs)
+            clients[robot_id][0].sendall(frame)
+            next_send[robot_id] += period
+            sent += 1
+            sent_bytes += len(frame)
+        seq += 1
+        timeout = max(0.0, min(float(next_send.min()), end) - time.monotonic())
+        for key, _ in sel.select(timeout):
+            status = key.data.read()
+            if status is False:
+                sel.unregister(key.fileobj)
+            else:
+                received += status
+    elapsed = time.monotonic() - start
+
+    delays = [reader.delay_stats() for _, reader in clients]
+    delays = [d for d in delays if d['count']]
+    result = {'clients': args.clients, 'seconds': elapsed, 'frames_sent': sent, 'frames_sent_per_s': sent / elapsed,
+              'bytes_sent_per_s': sent_bytes / elapsed, 'records_received': received,
+              'records_received_per_s': received / elapsed,
+              'receive_delay_us': {'clients': len(delays),
+                                   'p50_median': float(np.median([d['p50'] for d in delays])) if delays else 0.0,
+                                   'p99_max': float(max(d['p99'] for d in delays)) if delays else 0.0},
+              'hub': hub.stats(), 'ticks': hub.tick_stats()}
+    for s, _ in clients:
+        s.close()
+    hub.destroy()
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmarks of pybuzz")
+    parser.add_argument("--only", choices=("micro", "load"), help="Run only one part")
+    parser.add_argument("--output", help="JSON file of the results. Printed if left out")
+    parser.add_argument("--count", type=int, default=100000, help="Operations per micro-benchmark")
+    parser.add_argument("--bzzc", default="bzzc", help="Buzz compiler")
+    parser.add_argument("--port", type=int, default=8090, help="Ports of the CommHub objects: this one and the next")
+    parser.add_argument("--message-size", type=int, default=64, help="Bytes of each message")
+    parser.add_argument("--messages", type=int, default=4, help="Messages in each frame")
+    parser.add_argument("--neighbors-batch", type=int, default=64, help="Positions of each batch of bearings")
+    parser.add_argument("--clients", type=int, default=1000, help="Fake robots of the load")
+    parser.add_argument("--rate", type=float, default=10, help="Frames sent per second by each fake robot")
+    parser.add_argument("--forward-freq", type=float, default=50, help="Forward frequency of the CommHub")
+    parser.add_argument("--neighbor-distance", type=float, default=1, help="Range of the robots")
+    parser.add_argument("--neighbors", type=float, default=10, help="Robots in range of each robot, on average")
+    parser.add_argument("--duration", type=float, default=10, help="Seconds of load")
+    args = parser.parse_args()
+
+    results = {}
+    if args.only in (None, "micro"):
+        results['micro'] = micro(args)
+    if args.only in (None, "load"):
+        results['load'] = load(args)
+    text = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -2,7 +2,9 @@
 #include <stdio.h>
 
 #include "buzz_utility.h"
+#include "geometry_utility.h"
 #include <buzz/buzzdebug.h>
+#include <buzz/buzzvstig.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -10,41 +12,367 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 /****************************************/
 /****************************************/
 
-static char*       BO_FNAME       = 0;
-static uint8_t*    BO_BUF         = 0;
-static buzzdebug_t DBG_INFO       = 0;
+/*
+A compiled script loaded once and shared by every VM running it.
+The bytecode is mapped read-only straight from the .bo file. The debug
+information is only parsed from the .bdb file for the first error of a VM
+running the script.
+*/
+typedef struct file_id_s {
+   dev_t           dev;
+   ino_t           ino;
+   off_t           size;
+   struct timespec mtime;
+} file_id_t;
+
+typedef struct bcode_image_s {
+   char*                 bo_fname;
+   char*                 bdbg_fname;
+   file_id_t             bo_id;       // So that a recompiled script gets a new image
+   file_id_t             bdbg_id;     // So that the debug information parsed later matches the bytecode
+   const uint8_t*        bcode;
+   size_t                bcode_size;
+   buzzdebug_t           dbg;         // NULL until parsed
+   int                   dbg_tried;
+   int                   refcount;    // Number of VMs using this image
+   struct bcode_image_s* next;
+} *bcode_image_t;
+
+static bcode_image_t bcode_images = NULL;
+static pthread_mutex_t bcode_debug_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Calls of a batched hook, queued until they are delivered to Python all at once.
+Each call takes one row of HOOK_BATCH_MAX_ARGS numeric arguments, padded with NaN.
+*/
+typedef struct hook_batch_s {
+   int     size;
+   int     capacity;
+   int     width;     // Largest number of arguments of a call in the batch
+   int*    vmids;
+   int*    entries;   // Closure table entry of the call in its VM
+   int*    robots;
+   double* args;
+} hook_batch_t;
+
+/*
+A Python function callable from Buzz, shared by every VM that registered it.
+The function is only looked up in its module by the first call of the hook.
+*/
+typedef struct python_hook_s {
+   int          id;       // Index in python_hooks
+   char*        module;
+   char*        name;
+   PyObject*    func;     // NULL until the first call
+   int          missing;  // The module has no such function
+   PyObject*    args;     // Argument tuple, reused when Python kept no reference to it
+   hook_batch_t pending;  // Batched calls since the last delivery
+   hook_batch_t taken;    // Calls being delivered by hook_batch_take/hook_batch_give
+   uint64_t     taken_at; // stats_now_ns of the last hook_batch_take
+   hist_t       time;     // Nanoseconds per call, or per batch, written with the GIL held
+} *python_hook_t;
+
+/*
+Entry of the closure table of a VM. The closure registered in Buzz for a hook
+carries the index of its entry as bound data, so a single dispatcher serves
+every hook of every VM.
+*/
+typedef struct vm_hook_s {
+   python_hook_t hook;
+   int           batched;           // As registered by this VM
+   double        batch_result;      // Result of the last delivered batch, for this VM
+   int           has_batch_result;
+} vm_hook_t;
+
+/* A C function callable from Buzz, made available by add_native_hook */
+typedef struct native_hook_s {
+   char*                 name;
+   buzzvm_funp           fun;
+   struct native_hook_s* next;
+} *native_hook_t;
 
-/* For sending and receiving buzz messages */
-static int message_size = 0;
+/* A neighbor of a VM, as last given to its neighbors table */
+typedef struct neighbor_s {
+   uint16_t id;
+   uint8_t  moved;     // Position changed since the last commit
+   uint8_t  in_vm;     // Has an entry in the neighbors table of the VM
+   float    xyz[3];    // Absolute position
+   float    polar[3];  // Distance, azimuth and elevation in the VM
+   uint64_t seen;      // Time of the last upsert
+} neighbor_t;
+
+/*
+Neighbors of a VM, kept from one step to the next so that the neighbors table of
+the VM is only written for the neighbors that moved, came or left. The entries
+are dense, and found by id with an open addressing index.
+*/
+typedef struct neighbor_table_s {
+   neighbor_t* entries;
+   int         size;
+   int         capacity;
+   int*        index;           // Entry + 1 of each id, 0 for none
+   int         index_mask;      // Index size - 1, a power of two at least twice capacity
+   float       origin[3];       // Position of the VM at the last commit
+   int         synced;          // The neighbors table of the VM holds the entries in_vm
+   int*        moved;           // Entries whose bearings a commit computes, capacity of them
+   float*      geometry;        // x, y, z, distance, azimuth and elevation of those, capacity each
+} neighbor_table_t;
+
+/*
+Every virtual machine lives in a slot of the VM table, together with the state
+that belongs to it. The table grows one chunk at a time and chunks never move,
+so a slot pointer stays valid while other VMs are created.
+A vmid packs the slot index in its low VM_SLOT_BITS bits and the generation of
+the slot above them. The generation changes each time the slot is reused, so the
+id of a destroyed VM never refers to the VM that later takes its slot.
+*/
+typedef struct vm_slot_s {
+   buzzvm_t      vm;            // NULL while the slot is free
+   int           vmid;
+   int           generation;
+   int           stepped;       // 1 once the global part of the script ran
+   int           initialized;   // 1 once init() ran
+   bcode_image_t image;
+   buzzmsg_payload_t outgoing;  // Message taken out of the queue that did not fit in the last drain
+   int           next_free;     // Next free slot index, when the slot is free
+   uint32_t      dispatch_fid;  // python_dispatch, registered in this VM
+   vm_hook_t*    hooks;         // Closure table
+   int           num_hooks;
+   int           hooks_capacity;
+   /* Symbols of the pose injected at every step, registered once */
+   uint16_t      sym_absolute_position;
+   uint16_t      sym_xyz[3];
+   float         position[3];     // Last position given to set_abs_pos
+   uint16_t      sym_neighbors;
+   uint16_t      sym_data;
+   neighbor_table_t neighbors;
+   hist_t        step_time;       // Nanoseconds per step, written by the thread stepping the VM
+} *vm_slot_t;
+
+#define VM_SLOTS_PER_CHUNK 64
+#define VM_MAX_CHUNKS      ((1 << VM_SLOT_BITS) / VM_SLOTS_PER_CHUNK)
+#define VM_GENERATION_MASK 0x7fff
+
+static vm_slot_t vm_chunks[VM_MAX_CHUNKS];
+static int num_slots = 0;        // Slots allocated so far, free or not
+static int free_slot = -1;       // Head of the list of free slots
+static int num_virtual_machines = 0;
+
+/* The VM stepped by the current thread, so that hooks know which VM called them */
+static __thread vm_slot_t stepping_slot = NULL;
 
 /* For calling python hooks */
 static int python_initialized = 0;
-static int vm_stepped[MAX_NUM_VIRTUAL_MACHINES];  // initialized to all 0's (False)
-static PyObject* python_funcs[20];
-static PyObject* python_module = NULL;
+static python_hook_t* python_hooks = NULL;
+static int num_python_hooks = 0;
+static int python_hooks_capacity = 0;
+static native_hook_t native_hooks = NULL;
+static pthread_mutex_t hook_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char* python_module = NULL;      // Name of the last imported module
 static PyObject* init_func = NULL;
 
-/* Buzz Virtual Machine */
-static buzzvm_t all_virtual_machines[MAX_NUM_VIRTUAL_MACHINES];
-static buzzvm_t vm = NULL;
-static int num_virtual_machines = 0;
+/****************************************/
+/****************************************/
+
+/*
+Return the cached image of a script, loading it if it is not in the cache yet.
+The .bo path is resolved so that the same file reached through different paths
+maps to a single image.
+*/
+static void file_id_set(file_id_t* id, const struct stat* st) {
+   id->dev   = st->st_dev;
+   id->ino   = st->st_ino;
+   id->size  = st->st_size;
+   id->mtime = st->st_mtim;
+}
+
+static int file_id_equal(const file_id_t* a, const file_id_t* b) {
+   return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+      a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static bcode_image_t bcode_image_acquire(const char* bo_filename,
+                                         const char* bdbg_filename) {
+   char path[PATH_MAX];
+   struct stat st, dbg_st;
+   file_id_t bo_id;
+   bcode_image_t img;
+   if(!realpath(bo_filename, path) || stat(path, &st)) {
+      perror(bo_filename);
+      return NULL;
+   }
+   /* The debug information is parsed later, but a missing file is reported now */
+   if(stat(bdbg_filename, &dbg_st)) {
+      perror(bdbg_filename);
+      return NULL;
+   }
+   file_id_set(&bo_id, &st);
+   for(img = bcode_images; img; img = img->next) {
+      if(file_id_equal(&img->bo_id, &bo_id) && !strcmp(img->bdbg_fname, bdbg_filename)) {
+         img->refcount++;
+         return img;
+      }
+   }
+   /* Map the bytecode */
+   int fd = open(path, O_RDONLY);
+   if(fd < 0) {
+      perror(bo_filename);
+      return NULL;
+   }
+   if(st.st_size == 0) {
+      fprintf(stdout, "%s: Empty bytecode file\n\n", bo_filename);
+      close(fd);
+      return NULL;
+   }
+   void* bcode = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(bcode == MAP_FAILED) {
+      perror(bo_filename);
+      return NULL;
+   }
+   img = (bcode_image_t)malloc(sizeof(struct bcode_image_s));
+   img->bo_fname   = strdup(bo_filename);
+   img->bdbg_fname = strdup(bdbg_filename);
+   img->bo_id      = bo_id;
+   file_id_set(&img->bdbg_id, &dbg_st);
+   img->bcode      = (const uint8_t*)bcode;
+   img->bcode_size = st.st_size;
+   img->dbg        = NULL;
+   img->dbg_tried  = 0;
+   img->refcount   = 1;
+   img->next       = bcode_images;
+   bcode_images    = img;
+   return img;
+}
+
+/* Drop one reference to an image, and unmap it once no VM uses it */
+static void bcode_image_release(bcode_image_t img) {
+   bcode_image_t* p;
+   if(--img->refcount > 0) return;
+   for(p = &bcode_images; *p != img; p = &(*p)->next);
+   *p = img->next;
+   munmap((void*)img->bcode, img->bcode_size);
+   if(img->dbg) buzzdebug_destroy(&img->dbg);
+   free(img->bo_fname);
+   free(img->bdbg_fname);
+   free(img);
+}
+
+/* Parse the .bdb file of an image, unless it changed since the image was loaded */
+static void bcode_image_load_debug(bcode_image_t img) {
+   struct stat st;
+   file_id_t id;
+   if(stat(img->bdbg_fname, &st)) {
+      perror(img->bdbg_fname);
+      return;
+   }
+   file_id_set(&id, &st);
+   if(!file_id_equal(&id, &img->bdbg_id)) {
+      fprintf(stderr, "%s: Changed since %s was loaded, ignored\n\n", img->bdbg_fname, img->bo_fname);
+      return;
+   }
+   buzzdebug_t dbg = buzzdebug_new();
+   if(!buzzdebug_fromfile(dbg, img->bdbg_fname)) {
+      perror(img->bdbg_fname);
+      buzzdebug_destroy(&dbg);
+      return;
+   }
+   img->dbg = dbg;
+}
+
+/*
+Return the debug information of an image, parsed the first time it is needed,
+or NULL if there is none. Called by the threads stepping the VMs.
+*/
+static buzzdebug_t bcode_image_debug(bcode_image_t img) {
+   pthread_mutex_lock(&bcode_debug_mutex);
+   if(!img->dbg_tried) {
+      img->dbg_tried = 1;
+      bcode_image_load_debug(img);
+   }
+   pthread_mutex_unlock(&bcode_debug_mutex);
+   return img->dbg;
+}
+
+/****************************************/
+/****************************************/
+
+static vm_slot_t vm_slot_at(int index) {
+   return &vm_chunks[index / VM_SLOTS_PER_CHUNK][index % VM_SLOTS_PER_CHUNK];
+}
+
+/* Return the slot of a live VM, or NULL if vmid does not name one */
+static vm_slot_t vm_slot(int vmid) {
+   int index = vmid & ((1 << VM_SLOT_BITS) - 1);
+   if(vmid < 0 || index >= num_slots) return NULL;
+   vm_slot_t slot = vm_slot_at(index);
+   if(!slot->vm || slot->generation != (vmid >> VM_SLOT_BITS)) return NULL;
+   return slot;
+}
+
+/* Take a free slot, growing the table if needed. Return its index, or -1 if the table is full or out of memory */
+static int vm_slot_alloc(void) {
+   int index;
+   if(free_slot >= 0) {
+      index = free_slot;
+      free_slot = vm_slot_at(index)->next_free;
+      return index;
+   }
+   if(num_slots == VM_MAX_CHUNKS * VM_SLOTS_PER_CHUNK) return -1;
+   if(num_slots % VM_SLOTS_PER_CHUNK == 0) {
+      vm_slot_t chunk = (vm_slot_t)calloc(VM_SLOTS_PER_CHUNK, sizeof(struct vm_slot_s));
+      if(!chunk) return -1;
+      vm_chunks[num_slots / VM_SLOTS_PER_CHUNK] = chunk;
+   }
+   return num_slots++;
+}
+
+static void vm_slot_free(int index) {
+   vm_slot_t slot = vm_slot_at(index);
+   slot->vm = NULL;
+   slot->image = NULL;
+   free(slot->hooks);
+   slot->hooks = NULL;
+   if(slot->outgoing) buzzmsg_payload_destroy(&slot->outgoing);
+   slot->outgoing = NULL;
+   free(slot->neighbors.entries);
+   free(slot->neighbors.index);
+   free(slot->neighbors.moved);
+   free(slot->neighbors.geometry);
+   memset(&slot->neighbors, 0, sizeof(slot->neighbors));
+   slot->num_hooks = 0;
+   slot->hooks_capacity = 0;
+   memset(&slot->step_time, 0, sizeof(slot->step_time));
+   slot->generation = (slot->generation + 1) & VM_GENERATION_MASK;
+   slot->next_free = free_slot;
+   free_slot = index;
+}
 
 /****************************************/
 /****************************************/
 
-static const char* buzz_error_info(buzzvm_t vm) {
-   buzzdebug_entry_t dbg = *buzzdebug_info_get_fromoffset(DBG_INFO, &vm->pc);
+static const char* buzz_error_info(buzzvm_t vm, bcode_image_t img) {
+   buzzdebug_t info = bcode_image_debug(img);
+   buzzdebug_entry_t* entry = info ? buzzdebug_info_get_fromoffset(info, &vm->pc) : NULL;
+   buzzdebug_entry_t dbg = entry ? *entry : NULL;
    char* msg;
    if(dbg != NULL) {
       asprintf(&msg,
                "%s: execution terminated abnormally at %s:%" PRIu64 ":%" PRIu64 " : %s\n\n",
-               BO_FNAME,
+               img->bo_fname,
                dbg->fname,
                dbg->line,
                dbg->col,
@@ -53,7 +381,7 @@ static const char* buzz_error_info(buzzvm_t vm) {
    else {
       asprintf(&msg,
                "%s: execution terminated abnormally at bytecode offset %d: %s\n\n",
-               BO_FNAME,
+               img->bo_fname,
                vm->pc,
                vm->errormsg);
    }
@@ -114,34 +442,90 @@ static int buzz_print(buzzvm_t vm) {
    return buzzvm_ret0(vm);
 }
 
+/* Convert a buzz object to a new Python reference */
+static PyObject* python_value(buzzobj_t o) {
+   switch(o->o.type) {
+      case BUZZTYPE_INT:
+         return PyLong_FromLong(o->i.value);
+      case BUZZTYPE_FLOAT:
+         return PyFloat_FromDouble(o->f.value);
+      case BUZZTYPE_STRING:
+         return PyBytes_FromString(o->s.value.str);
+      default:
+         Py_INCREF(Py_None);
+         return Py_None;
+   }
+}
+
+/*
+Look up the function of a hook in its module, the first time the hook is called.
+The GIL must be held. Return 0 if there is no such function.
+*/
+static int python_hook_resolve(python_hook_t hook) {
+   if(hook->func) return 1;
+   if(hook->missing) return 0;
+   PyObject* module = PyImport_ImportModule(hook->module);
+   PyObject* func = module ? PyObject_GetAttrString(module, hook->name) : NULL;
+   Py_XDECREF(module);
+   if(!func || !PyCallable_Check(func)) {
+      PyErr_Clear();
+      Py_XDECREF(func);
+      printf("ERROR: Function '%s' not defined in module '%s'\n", hook->name, hook->module);
+      hook->missing = 1;
+      return 0;
+   }
+   /* The import lets other threads run, which might have resolved the hook meanwhile */
+   if(hook->func) Py_DECREF(func);
+   else hook->func = func;
+   return 1;
+}
+
+/* Local symbol of the first argument of a hook. Symbol 1 holds the closure table entry */
+#define HOOK_FIRST_ARG 2
+
 /* Takes values from the virtual machine and fills the callback arrays */
-static int python_callback(buzzvm_t vm, int hook_id) {
+static int python_callback(buzzvm_t vm, python_hook_t hook) {
    int i;
    int size = buzzdarray_size(vm->lsyms->syms);
+   int nargs = size - HOOK_FIRST_ARG;
    PyObject *pArgs, *pValue;
 
-   pArgs = PyTuple_New(size-1);
-   for(i = 1; i < size; ++i) {
-      buzzvm_lload(vm, i);
+   /* The VM might be stepped by a thread of the stepping pool, which does not hold the GIL */
+   int has_gil = PyGILState_Check();
+   PyGILState_STATE gil = PyGILState_UNLOCKED;
+   if(!has_gil) gil = PyGILState_Ensure();
+
+   if(!python_hook_resolve(hook)) {
+      if(!has_gil) PyGILState_Release(gil);
+      buzzvm_pushnil(vm);
+      return buzzvm_ret1(vm);
+   }
+
+   /* Reuse the tuple of the last call unless the hook kept a reference to it */
+   pArgs = hook->args;
+   if(pArgs && (Py_REFCNT(pArgs) != 1 || PyTuple_GET_SIZE(pArgs) != nargs)) {
+      Py_DECREF(pArgs);
+      pArgs = NULL;
+   }
+   if(!pArgs) pArgs = PyTuple_New(nargs);
+   hook->args = NULL;
+   for(i = 0; i < nargs; ++i) {
+      buzzvm_lload(vm, i + HOOK_FIRST_ARG);
       buzzobj_t o = buzzvm_stack_at(vm, 1);
       buzzvm_pop(vm);
-      switch(o->o.type) {
-         case BUZZTYPE_INT:
-            PyTuple_SetItem(pArgs, i-1, PyLong_FromLong(o->i.value));
-            break;
-         case BUZZTYPE_FLOAT:
-            PyTuple_SetItem(pArgs, i-1, PyFloat_FromDouble(o->f.value));
-            break;
-         case BUZZTYPE_STRING:
-            PyTuple_SetItem(pArgs, i-1, PyBytes_FromString(o->s.value.str));
-            break;
-         default:
-            PyTuple_SetItem(pArgs, i-1, Py_None);
-            break;
-      }
+      PyObject* old = PyTuple_GET_ITEM(pArgs, i);
+      PyTuple_SET_ITEM(pArgs, i, python_value(o));
+      Py_XDECREF(old);
    }
-   pValue = PyObject_CallObject(python_funcs[hook_id], pArgs);
-   if(PyLong_Check(pValue))
+   uint64_t start = stats_now_ns();
+   pValue = PyObject_CallObject(hook->func, pArgs);
+   hist_record(&hook->time, stats_now_ns() - start);
+   hook->args = pArgs;
+   if(!pValue) {
+      PyErr_Print();
+      buzzvm_pushnil(vm);
+   }
+   else if(PyLong_Check(pValue))
       buzzvm_pushi(vm, PyLong_AsLong(pValue));
 
    else if(PyFloat_Check(pValue))
@@ -153,76 +537,84 @@ static int python_callback(buzzvm_t vm, int hook_id) {
    else
       buzzvm_pushnil(vm);
 
+   Py_XDECREF(pValue);
+   if(!has_gil) PyGILState_Release(gil);
    return buzzvm_ret1(vm);
 }
 
 /*
-The buzz functions must be registered to unique C functions that take a buzzvm_t object. 
-They are defined here.
-To change the number of allowable python hooks, one must also change the size of python_funcs
+Queue the call of a batched hook, without taking the GIL.
+The hook answers with the result computed for this VM in the last delivered batch,
+or nil if there is none yet.
 */
-static int h0(buzzvm_t vm) {
-  return python_callback(vm, 0);
-};
-static int h1(buzzvm_t vm) {
-  return python_callback(vm, 1);
-};
-static int h2(buzzvm_t vm) {
-  return python_callback(vm, 2);
-};
-static int h3(buzzvm_t vm) {
-  return python_callback(vm, 3);
-};
-static int h4(buzzvm_t vm) {
-  return python_callback(vm, 4);
-};
-static int h5(buzzvm_t vm) {
-  return python_callback(vm, 5);
-};
-static int h6(buzzvm_t vm) {
-  return python_callback(vm, 6);
-};
-static int h7(buzzvm_t vm) {
-  return python_callback(vm, 7);
-};
-static int h8(buzzvm_t vm) {
-  return python_callback(vm, 8);
-};
-static int h9(buzzvm_t vm) {
-  return python_callback(vm, 9);
-};
-static int h10(buzzvm_t vm) {
-  return python_callback(vm, 10);
-};
-static int h11(buzzvm_t vm) {
-  return python_callback(vm, 11);
-};
-static int h12(buzzvm_t vm) {
-  return python_callback(vm, 12);
-};
-static int h13(buzzvm_t vm) {
-  return python_callback(vm, 13);
-};
-static int h14(buzzvm_t vm) {
-  return python_callback(vm, 14);
-};
-static int h15(buzzvm_t vm) {
-  return python_callback(vm, 15);
-};
-static int h16(buzzvm_t vm) {
-  return python_callback(vm, 16);
-};
-static int h17(buzzvm_t vm) {
-  return python_callback(vm, 17);
-};
-static int h18(buzzvm_t vm) {
-  return python_callback(vm, 18);
-};
-static int h19(buzzvm_t vm) {
-  return python_callback(vm, 19);
-};
-/* The C hooks are stored in this array in the correct order, so that hooks[n](vm) == python_callback(vm, n) */
-static int (*hooks[])(buzzvm_t vm) = {h0, h1, h2, h3, h4, h5, h6, h7, h8, h9, h10, h11, h12, h13, h14, h15, h16, h17, h18, h19};
+static int python_batch_callback(buzzvm_t vm, vm_slot_t slot, int entry) {
+   int i;
+   int nargs = (int)buzzdarray_size(vm->lsyms->syms) - HOOK_FIRST_ARG;
+   vm_hook_t* h = &slot->hooks[entry];
+   hook_batch_t* b = &h->hook->pending;
+   double result = NAN;
+
+   pthread_mutex_lock(&hook_batch_mutex);
+   if(b->size == b->capacity) {
+      b->capacity = b->capacity ? 2 * b->capacity : 64;
+      b->vmids = (int*)realloc(b->vmids, b->capacity * sizeof(int));
+      b->entries = (int*)realloc(b->entries, b->capacity * sizeof(int));
+      b->robots = (int*)realloc(b->robots, b->capacity * sizeof(int));
+      b->args = (double*)realloc(b->args, b->capacity * HOOK_BATCH_MAX_ARGS * sizeof(double));
+   }
+   double* row = b->args + b->size * HOOK_BATCH_MAX_ARGS;
+   for(i = 0; i < HOOK_BATCH_MAX_ARGS; ++i) {
+      row[i] = NAN;
+      if(i >= nargs) continue;
+      buzzvm_lload(vm, i + HOOK_FIRST_ARG);
+      buzzobj_t o = buzzvm_stack_at(vm, 1);
+      buzzvm_pop(vm);
+      if(o->o.type == BUZZTYPE_INT) row[i] = o->i.value;
+      else if(o->o.type == BUZZTYPE_FLOAT) row[i] = o->f.value;
+   }
+   if(nargs > b->width) b->width = nargs < HOOK_BATCH_MAX_ARGS ? nargs : HOOK_BATCH_MAX_ARGS;
+   b->vmids[b->size] = slot->vmid;
+   b->entries[b->size] = entry;
+   b->robots[b->size] = vm->robot;
+   b->size++;
+   if(h->has_batch_result) result = h->batch_result;
+   pthread_mutex_unlock(&hook_batch_mutex);
+
+   if(isnan(result)) buzzvm_pushnil(vm);
+   else buzzvm_pushf(vm, result);
+   return buzzvm_ret1(vm);
+}
+
+/*
+The native function behind every Python hook.
+The entry of the hook in the closure table of the VM is bound to its closure.
+*/
+static int python_dispatch(buzzvm_t vm) {
+   vm_slot_t slot = stepping_slot;
+   buzzvm_lload(vm, 1);
+   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   buzzvm_pop(vm);
+   if(!slot || o->o.type != BUZZTYPE_INT || o->i.value < 0 || o->i.value >= slot->num_hooks) {
+      buzzvm_pushnil(vm);
+      return buzzvm_ret1(vm);
+   }
+   int entry = o->i.value;
+   if(slot->hooks[entry].batched)
+      return python_batch_callback(vm, slot, entry);
+   return python_callback(vm, slot->hooks[entry].hook);
+}
+
+/* Bind an int to the closure on top of the stack. It becomes the local symbol after self */
+static void closure_bind_int(buzzvm_t vm, int32_t value) {
+   buzzobj_t c = buzzvm_stack_at(vm, 1);
+   if(!buzzdarray_size(c->c.value.actrec)) {
+      buzzobj_t self = buzzheap_newobj(vm, BUZZTYPE_NIL);
+      buzzdarray_push(c->c.value.actrec, &self);
+   }
+   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_INT);
+   o->i.value = value;
+   buzzdarray_push(c->c.value.actrec, &o);
+}
 
 /****************************************/
 /****************************************/
@@ -232,45 +624,46 @@ int buzz_script_set(const char* bo_filename,
                     const char* bdbg_filename,
                     int comm_id) {
 
-   vm = buzzvm_new(comm_id);
-   all_virtual_machines[num_virtual_machines] = vm;
-   num_virtual_machines++;
+   /* Get the shared bytecode and debug information */
+   bcode_image_t img = bcode_image_acquire(bo_filename, bdbg_filename);
+   if(!img) return -1;
 
-   /* Get rid of debug info */
-   if(DBG_INFO) buzzdebug_destroy(&DBG_INFO);
-   DBG_INFO = buzzdebug_new();
-   /* Read bytecode and fill in data structure */
-   FILE* fd = fopen(bo_filename, "rb");
-   if(!fd) {
-      perror(bo_filename);
-      return 1;
-   }
-   fseek(fd, 0, SEEK_END);
-   size_t bcode_size = ftell(fd);
-   rewind(fd);
-   BO_BUF = (uint8_t*)malloc(bcode_size);
-   if(fread(BO_BUF, 1, bcode_size, fd) < bcode_size) {
-      perror(bo_filename);
-      buzzvm_destroy(&vm);
-      buzzdebug_destroy(&DBG_INFO);
-      fclose(fd);
-      return 1;
-   }
-   fclose(fd);
-   /* Read debug information */
-   if(!buzzdebug_fromfile(DBG_INFO, bdbg_filename)) {
-      buzzvm_destroy(&vm);
-      buzzdebug_destroy(&DBG_INFO);
-      perror(bdbg_filename);
-      return 1;
-   }
+   buzzvm_t vm = buzzvm_new(comm_id);
    /* Set byte code */
-   if(buzzvm_set_bcode(vm, BO_BUF, bcode_size) != BUZZVM_STATE_READY) {
+   if(buzzvm_set_bcode(vm, img->bcode, img->bcode_size) != BUZZVM_STATE_READY) {
       buzzvm_destroy(&vm);
-      buzzdebug_destroy(&DBG_INFO);
+      bcode_image_release(img);
       fprintf(stdout, "%s: Error loading Buzz script\n\n", bo_filename);
-      return 1;
+      return -1;
    }
+   int index = vm_slot_alloc();
+   if(index < 0) {
+      buzzvm_destroy(&vm);
+      bcode_image_release(img);
+      fprintf(stdout, "%s: Too many virtual machines\n\n", bo_filename);
+      return -1;
+   }
+   vm_slot_t slot = vm_slot_at(index);
+   slot->vm = vm;
+   slot->vmid = (slot->generation << VM_SLOT_BITS) | index;
+   slot->stepped = 0;
+   slot->initialized = 0;
+   slot->image = img;
+   slot->outgoing = NULL;
+   memset(slot->position, 0, sizeof(slot->position));
+   num_virtual_machines++;
+
+   /* Intern the symbols of the pose */
+   slot->sym_absolute_position = buzzvm_string_register(vm, "absolute_position", 1);
+   slot->sym_xyz[0] = buzzvm_string_register(vm, "x", 1);
+   slot->sym_xyz[1] = buzzvm_string_register(vm, "y", 1);
+   slot->sym_xyz[2] = buzzvm_string_register(vm, "z", 1);
+   slot->sym_neighbors = buzzvm_string_register(vm, "neighbors", 1);
+   slot->sym_data = buzzvm_string_register(vm, "data", 1);
+
+   /* All the Python hooks of this VM go through one native function */
+   slot->dispatch_fid = buzzvm_function_register(vm, python_dispatch);
+
    /* Register print hook */
    buzzvm_pushs(vm,  buzzvm_string_register(vm, "print", 1));
    buzzvm_pushcc(vm, buzzvm_function_register(vm, buzz_print));
@@ -297,36 +690,273 @@ int buzz_script_set(const char* bo_filename,
       python_initialized = 1;
    }
 
-   /* Save bytecode file name */
-   BO_FNAME = strdup(bo_filename);
+   return slot->vmid;
+}
+
+/* Forget a closure of the bytecode being replaced. The native ones, such as the hooks, are kept */
+static void closure_forget(const void* key, void* data, void* params) {
+   buzzobj_t* o = (buzzobj_t*)data;
+   if((*o)->o.type == BUZZTYPE_CLOSURE && !(*o)->c.value.isnative)
+      *o = buzzheap_newobj((buzzvm_t)params, BUZZTYPE_NIL);
+}
+
+/* The conflict handlers of a stigmergy are closures of the bytecode being replaced */
+static void vstig_handlers_forget(const void* key, void* data, void* params) {
+   buzzvstig_t vs = *(buzzvstig_t*)data;
+   vs->onconflict = NULL;
+   vs->onconflictlost = NULL;
+}
+
+/* Topics of the listeners the bytecode being replaced set with neighbors.listen */
+typedef struct listener_topics_s {
+   uint16_t* topics;
+   int       size;
+} listener_topics_t;
 
+static void listener_collect(const void* key, void* data, void* params) {
+   buzzobj_t o = *(buzzobj_t*)data;
+   listener_topics_t* t = (listener_topics_t*)params;
+   if(o->o.type == BUZZTYPE_CLOSURE && !o->c.value.isnative)
+      t->topics[t->size++] = *(const uint16_t*)key;
+}
+
+/* Drop the listeners of the old script, which would jump into the new bytecode */
+static void listeners_forget(buzzvm_t vm) {
+   int i;
+   listener_topics_t t;
+   if(!buzzdict_size(vm->listeners)) return;
+   t.topics = (uint16_t*)malloc(buzzdict_size(vm->listeners) * sizeof(uint16_t));
+   t.size = 0;
+   buzzdict_foreach(vm->listeners, listener_collect, &t);
+   for(i = 0; i < t.size; ++i)
+      buzzdict_remove(vm->listeners, &t.topics[i]);
+   free(t.topics);
+}
+
+/*
+Check that every string of a bytecode already has, in the VM, the id of its
+index in the string table of the bytecode, which is how the bytecode refers to
+it. buzzvm_set_bcode gives the strings the VM does not know the next free ids,
+and the ids after those of the running script belong to the strings of the
+host, so the new script must have the same string table as the running one.
+Return 0 if the table matches.
+*/
+static int bcode_strings_match(buzzvm_t vm, const uint8_t* bcode, size_t size) {
+   uint16_t count, i;
+   size_t pos = sizeof(uint16_t);
+   if(size < pos) return -1;
+   memcpy(&count, bcode, sizeof(uint16_t));
+   for(i = 0; i < count; ++i) {
+      const uint8_t* end = (const uint8_t*)memchr(bcode + pos, 0, size - pos);
+      if(!end) return -1;
+      const char* str = buzzvm_string_get(vm, i);
+      if(!str || strcmp(str, (const char*)bcode + pos)) return -1;
+      pos = end - bcode + 1;
+   }
+   return 0;
+}
+
+/*
+Swap the bytecode of a VM between two steps. Its swarms, stigmergies, queued
+messages and neighbors are kept, as are its hooks and the global variables the
+new script does not assign. The closures of the old script held by global
+variables, by stigmergies and by neighbors.listen are dropped, and the next step
+runs the global part of the new script, which assigns its global variables
+again, then its init() if init is set. The closures the old script stored in
+tables are not: with init unset, the new script must not call them.
+The new script must have the same string table as the running one, as when
+only constants and function bodies changed.
+Nothing changes in the VM if the new script cannot be loaded.
+*/
+int buzz_script_reload(int vmid,
+                       const char* bo_filename,
+                       const char* bdbg_filename,
+                       int init) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return -1;
+   bcode_image_t img = bcode_image_acquire(bo_filename, bdbg_filename);
+   if(!img) return -1;
+   buzzvm_t vm = slot->vm;
+   if(bcode_strings_match(vm, img->bcode, img->bcode_size)) {
+      fprintf(stdout, "%s: Strings differ from those of %s, cannot reload\n\n", bo_filename, slot->image->bo_fname);
+      bcode_image_release(img);
+      errno = EINVAL;
+      return -1;
+   }
+   if(buzzvm_set_bcode(vm, img->bcode, img->bcode_size) != BUZZVM_STATE_READY) {
+      fprintf(stdout, "%s: Error loading Buzz script\n\n", bo_filename);
+      bcode_image_release(img);
+      buzzvm_set_bcode(vm, slot->image->bcode, slot->image->bcode_size);
+      return -1;
+   }
+   buzzdict_foreach(vm->gsyms, closure_forget, vm);
+   buzzdict_foreach(vm->vstigs, vstig_handlers_forget, NULL);
+   listeners_forget(vm);
+   /* The next step runs the global part of the script, which defines its functions again */
+   slot->stepped = 0;
+   slot->neighbors.synced = 0;
+   bcode_image_release(slot->image);
+   slot->image = img;
+   if(init) slot->initialized = 0;
    return 0;
 }
 
+/* Only the name is kept: the module is imported by the first call of one of its hooks */
 void import_module(const char* module_name) {
-  python_module = PyImport_ImportModule(module_name);
+  if(python_module && !strcmp(python_module, module_name)) return;
+  free(python_module);
+  python_module = strdup(module_name);
 }
 
 /*
-In the list or tuple of BuzzHook objects passed to the BuzzVM during initialization in the .pyx file,
-the <n>th element is registered to the C function h<n>.
+Return the hook of a function of the imported module, made the first time the
+function is registered, or NULL if no module was imported or out of memory.
 */
-int register_hook(int vmid, int hook_number, const char* function_name) {
-   vm = all_virtual_machines[vmid];
-   python_funcs[hook_number] = PyObject_GetAttrString(python_module, function_name);
-   if(!PyCallable_Check(python_funcs[hook_number])) {
-     printf("ERROR: Function '%s' not defined\n", function_name);
-     return 1;
+static python_hook_t python_hook_get(const char* function_name) {
+   int i;
+   if(!python_module) return NULL;
+   for(i = 0; i < num_python_hooks; ++i) {
+      if(!strcmp(python_hooks[i]->module, python_module) && !strcmp(python_hooks[i]->name, function_name))
+         return python_hooks[i];
+   }
+   if(num_python_hooks == python_hooks_capacity) {
+      int capacity = python_hooks_capacity ? 2 * python_hooks_capacity : 16;
+      python_hook_t* hooks = (python_hook_t*)realloc(python_hooks, capacity * sizeof(python_hook_t));
+      if(!hooks) return NULL;
+      python_hooks = hooks;
+      python_hooks_capacity = capacity;
    }
+   python_hook_t hook = (python_hook_t)calloc(1, sizeof(struct python_hook_s));
+   if(!hook) return NULL;
+   hook->module = strdup(python_module);
+   hook->name = strdup(function_name);
+   if(!hook->module || !hook->name) {
+      free(hook->module);
+      free(hook->name);
+      free(hook);
+      return NULL;
+   }
+   hook->id = num_python_hooks;
+   python_hooks[num_python_hooks++] = hook;
+   return hook;
+}
+
+/*
+Register a function of the last imported module as a Buzz function of a VM.
+Return the id of the hook, which is shared by all the VMs that registered this
+function, or -1 on error. Python is not called: a missing function is reported
+by the first call of the hook.
+*/
+int register_hook(int vmid, const char* function_name, int batched) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return -1;
+   buzzvm_t vm = slot->vm;
+   if(!python_module) {
+     printf("ERROR: No module imported for function '%s'\n", function_name);
+     return -1;
+   }
+   python_hook_t hook = python_hook_get(function_name);
+   if(!hook) {
+     printf("ERROR: Out of memory for function '%s'\n", function_name);
+     return -1;
+   }
+   /* Add the hook to the closure table of the VM */
+   if(slot->num_hooks == slot->hooks_capacity) {
+      int capacity = slot->hooks_capacity ? 2 * slot->hooks_capacity : 8;
+      vm_hook_t* hooks = (vm_hook_t*)realloc(slot->hooks, capacity * sizeof(vm_hook_t));
+      if(!hooks) {
+        printf("ERROR: Out of memory for function '%s'\n", function_name);
+        return -1;
+      }
+      slot->hooks = hooks;
+      slot->hooks_capacity = capacity;
+   }
+   int entry = slot->num_hooks++;
+   slot->hooks[entry].hook = hook;
+   slot->hooks[entry].batched = batched;
+   slot->hooks[entry].has_batch_result = 0;
    buzzvm_pushs(vm,  buzzvm_string_register(vm, function_name, 1));
-   buzzvm_pushcc(vm, buzzvm_function_register(vm, hooks[hook_number]));
+   buzzvm_pushcc(vm, slot->dispatch_fid);
+   closure_bind_int(vm, entry);
    buzzvm_gstore(vm);
+   return hook->id;
+}
+
+int add_native_hook(const char* name, buzzvm_funp fun) {
+   native_hook_t h;
+   for(h = native_hooks; h; h = h->next) {
+      if(!strcmp(h->name, name)) {
+         h->fun = fun;
+         return 0;
+      }
+   }
+   h = (native_hook_t)malloc(sizeof(struct native_hook_s));
+   h->name = strdup(name);
+   h->fun = fun;
+   h->next = native_hooks;
+   native_hooks = h;
    return 0;
 }
 
+int register_native_hook(int vmid, const char* name) {
+   native_hook_t h;
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return 1;
+   for(h = native_hooks; h && strcmp(h->name, name); h = h->next);
+   if(!h) {
+     printf("ERROR: Native hook '%s' not defined\n", name);
+     return 1;
+   }
+   buzzvm_pushs(slot->vm,  buzzvm_string_register(slot->vm, name, 1));
+   buzzvm_pushcc(slot->vm, buzzvm_function_register(slot->vm, h->fun));
+   buzzvm_gstore(slot->vm);
+   return 0;
+}
+
+/*
+Batched hooks are delivered in two steps, so that the VMs can keep queueing calls
+while Python computes the results of a batch.
+*/
+int hook_batch_take(int hook_id, int** robots, double** args, int* width) {
+   if(hook_id < 0 || hook_id >= num_python_hooks) return 0;
+   python_hook_t hook = python_hooks[hook_id];
+   pthread_mutex_lock(&hook_batch_mutex);
+   hook_batch_t b = hook->taken;
+   b.size = 0;
+   b.width = 0;
+   hook->taken = hook->pending;
+   hook->pending = b;
+   pthread_mutex_unlock(&hook_batch_mutex);
+   *robots = hook->taken.robots;
+   *args = hook->taken.args;
+   *width = hook->taken.width;
+   hook->taken_at = stats_now_ns();
+   return hook->taken.size;
+}
+
+void hook_batch_give(int hook_id, const double* results, int n) {
+   int i;
+   if(hook_id < 0 || hook_id >= num_python_hooks) return;
+   hook_batch_t* b = &python_hooks[hook_id]->taken;
+   if(b->size) hist_record(&python_hooks[hook_id]->time, stats_now_ns() - python_hooks[hook_id]->taken_at);
+   pthread_mutex_lock(&hook_batch_mutex);
+   for(i = 0; i < n && i < b->size; ++i) {
+      vm_slot_t slot = vm_slot(b->vmids[i]);
+      if(!slot || b->entries[i] >= slot->num_hooks) continue;
+      slot->hooks[b->entries[i]].batch_result = results[i];
+      slot->hooks[b->entries[i]].has_batch_result = !isnan(results[i]);
+   }
+   b->size = 0;
+   pthread_mutex_unlock(&hook_batch_mutex);
+}
+
 int register_init() {
-  init_func = PyObject_GetAttrString(python_module, "pyinit");
-  if(!PyCallable_Check(init_func)) {
+  PyObject* module = python_module ? PyImport_ImportModule(python_module) : NULL;
+  Py_XDECREF(init_func);
+  init_func = module ? PyObject_GetAttrString(module, "pyinit") : NULL;
+  Py_XDECREF(module);
+  if(!init_func || !PyCallable_Check(init_func)) {
+     PyErr_Clear();
      printf("ERROR: Function 'init' not defined\n");
      return 1;
   }
@@ -340,52 +970,264 @@ int register_init() {
 /* Used to update neighbor and message information in the buzz script before the step */
 
 void reset_neighbors(int vmid) {
-  vm = all_virtual_machines[vmid];
-  buzzneighbors_reset(vm);
+  vm_slot_t slot = vm_slot(vmid);
+  if(!slot) return;
+  buzzneighbors_reset(slot->vm);
+  slot->neighbors.size = 0;
+  if(slot->neighbors.index)
+    memset(slot->neighbors.index, 0, (slot->neighbors.index_mask + 1) * sizeof(int));
 }
 
 void add_neighbor(int vmid, int neighbour_id, float x, float y, float z) {
-  vm = all_virtual_machines[vmid];
-  buzzneighbors_add(vm, (uint16_t)neighbour_id, x, y, z);
+  vm_slot_t slot = vm_slot(vmid);
+  if(!slot) return;
+  buzzneighbors_add(slot->vm, (uint16_t)neighbour_id, x, y, z);
 }
 
 void feed_buzz_message(int vmid, int sender_id, char* message, int size) {
-  vm = all_virtual_machines[vmid];
+  vm_slot_t slot = vm_slot(vmid);
+  if(!slot) return;
   buzzinmsg_queue_append(
-    vm,
+    slot->vm,
     (uint16_t)sender_id,
     buzzmsg_payload_frombuffer((void*)message, size));
 }
 
+void feed_buzz_messages(int vmid, const uint16_t* sender_ids, const uint8_t* buf, const int* offsets, int n) {
+  int i;
+  vm_slot_t slot = vm_slot(vmid);
+  if(!slot) return;
+  for(i = 0; i < n; ++i) {
+    int size = offsets[i + 1] - offsets[i];
+    if(size <= 0) continue;
+    buzzinmsg_queue_append(
+      slot->vm,
+      sender_ids[i],
+      buzzmsg_payload_frombuffer((void*)(buf + offsets[i]), size));
+  }
+}
+
+/*
+Set float fields of the table held by a global variable.
+The fields of the table are rewritten in place; a new table is only made when
+the variable does not hold a table yet.
+*/
+static void global_table_set_floats(buzzvm_t vm,
+                                    uint16_t table,
+                                    const uint16_t* fields,
+                                    const float* values,
+                                    int n) {
+  int i;
+  buzzvm_pushs(vm, table);
+  buzzvm_gload(vm);
+  if(buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_TABLE) {
+    buzzvm_pop(vm);
+    buzzvm_pushs(vm, table);
+    buzzvm_pusht(vm);
+    buzzvm_gstore(vm);
+    buzzvm_pushs(vm, table);
+    buzzvm_gload(vm);
+  }
+  for(i = 0; i < n; ++i) {
+    buzzvm_dup(vm);
+    buzzvm_pushs(vm, fields[i]);
+    buzzvm_pushf(vm, values[i]);
+    buzzvm_tput(vm);
+  }
+  buzzvm_pop(vm);
+}
+
 void set_abs_pos(int vmid, float x, float y, float z) {
-  vm = all_virtual_machines[vmid];
-  buzzvm_pushs(vm, buzzvm_string_register(vm, "absolute_position", 1));
-  buzzvm_pusht(vm);
-  buzzvm_dup(vm);
-  buzzvm_pushs(vm, buzzvm_string_register(vm, "x", 1));
-  buzzvm_pushf(vm, x);
-  buzzvm_tput(vm);
-  buzzvm_dup(vm);
-  buzzvm_pushs(vm, buzzvm_string_register(vm, "y", 1));
-  buzzvm_pushf(vm, y);
-  buzzvm_tput(vm);
-  buzzvm_dup(vm);
-  buzzvm_pushs(vm, buzzvm_string_register(vm, "z", 1));
-  buzzvm_pushf(vm, z);
-  buzzvm_tput(vm);
-  buzzvm_gstore(vm);
+  vm_slot_t slot = vm_slot(vmid);
+  if(!slot) return;
+  slot->position[0] = x;
+  slot->position[1] = y;
+  slot->position[2] = z;
+  global_table_set_floats(slot->vm, slot->sym_absolute_position, slot->sym_xyz, slot->position, 3);
+}
+
+static unsigned neighbor_hash(uint16_t id, int mask) {
+   return (id * 40503u) & mask;
+}
+
+/* Position in the index of an id, or of the free place where it goes */
+static int neighbor_find(const neighbor_table_t* t, uint16_t id) {
+   int i = neighbor_hash(id, t->index_mask);
+   while(t->index[i] && t->entries[t->index[i] - 1].id != id)
+      i = (i + 1) & t->index_mask;
+   return i;
+}
+
+static int neighbor_reserve(neighbor_table_t* t) {
+   int i;
+   if(t->size < t->capacity) return 0;
+   int capacity = t->capacity ? 2 * t->capacity : 16;
+   neighbor_t* entries = (neighbor_t*)realloc(t->entries, capacity * sizeof(neighbor_t));
+   if(!entries) return -1;
+   t->entries = entries;
+   int* moved = (int*)realloc(t->moved, capacity * sizeof(int));
+   if(!moved) return -1;
+   t->moved = moved;
+   float* geometry = (float*)realloc(t->geometry, 6 * capacity * sizeof(float));
+   if(!geometry) return -1;
+   t->geometry = geometry;
+   int* index = (int*)calloc(2 * capacity, sizeof(int));
+   if(!index) return -1;
+   free(t->index);
+   t->index = index;
+   t->index_mask = 2 * capacity - 1;
+   t->capacity = capacity;
+   for(i = 0; i < t->size; ++i)
+      t->index[neighbor_find(t, t->entries[i].id)] = i + 1;
+   return 0;
+}
+
+/* Remove entry e. The last entry takes its place */
+static void neighbor_remove(neighbor_table_t* t, int e) {
+   int i = neighbor_find(t, t->entries[e].id);
+   /* Move back the ids that follow in the same run, so that neighbor_find still reaches them */
+   int j = i;
+   t->index[i] = 0;
+   while(1) {
+      j = (j + 1) & t->index_mask;
+      if(!t->index[j]) break;
+      int home = neighbor_hash(t->entries[t->index[j] - 1].id, t->index_mask);
+      if(((j - home) & t->index_mask) >= ((j - i) & t->index_mask)) {
+         t->index[i] = t->index[j];
+         t->index[j] = 0;
+         i = j;
+      }
+   }
+   if(e != --t->size) {
+      t->entries[e] = t->entries[t->size];
+      t->index[neighbor_find(t, t->entries[e].id)] = e + 1;
+   }
+}
+
+/* Push the data table of the neighbors of the VM, or nil */
+static void neighbors_data_load(vm_slot_t slot) {
+   buzzvm_pushs(slot->vm, slot->sym_neighbors);
+   buzzvm_gload(slot->vm);
+   if(buzzvm_stack_at(slot->vm, 1)->o.type != BUZZTYPE_TABLE) return;
+   buzzvm_pushs(slot->vm, slot->sym_data);
+   buzzvm_tget(slot->vm);
+}
+
+void upsert_neighbor(int vmid, uint16_t id, const float* xyz, uint64_t now) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return;
+   neighbor_table_t* t = &slot->neighbors;
+   if(neighbor_reserve(t)) return;
+   int i = neighbor_find(t, id);
+   neighbor_t* e;
+   if(t->index[i]) {
+      e = &t->entries[t->index[i] - 1];
+      if(memcmp(e->xyz, xyz, sizeof(e->xyz))) e->moved = 1;
+   }
+   else {
+      t->index[i] = ++t->size;
+      e = &t->entries[t->size - 1];
+      e->id = id;
+      e->moved = 1;
+      e->in_vm = 0;
+   }
+   memcpy(e->xyz, xyz, sizeof(e->xyz));
+   e->seen = now;
+}
+
+void commit_neighbors(int vmid, uint64_t oldest) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return;
+   neighbor_table_t* t = &slot->neighbors;
+   int i = 0;
+   /* Until the global part of the script ran, it may still make a new neighbors table */
+   int full = !t->synced;
+   if(full) {
+      buzzneighbors_reset(slot->vm);
+      t->synced = slot->stepped;
+   }
+   int moved = full || memcmp(t->origin, slot->position, sizeof(t->origin));
+   int data_loaded = 0, count = 0, k;
+   while(i < t->size) {
+      neighbor_t* e = &t->entries[i];
+      if(e->seen < oldest) {
+         if(e->in_vm && !full) {
+            if(!data_loaded) {
+               neighbors_data_load(slot);
+               data_loaded = 1;
+            }
+            if(buzzvm_stack_at(slot->vm, 1)->o.type == BUZZTYPE_TABLE) {
+               buzzvm_dup(slot->vm);
+               buzzvm_pushi(slot->vm, e->id);
+               buzzvm_pushnil(slot->vm);
+               buzzvm_tput(slot->vm);
+            }
+         }
+         neighbor_remove(t, i);
+         continue;
+      }
+      if(moved || e->moved) t->moved[count++] = i;
+      ++i;
+   }
+   if(data_loaded) buzzvm_pop(slot->vm);
+   /* The bearings of all the neighbors that moved at once, in degrees for the VM */
+   float* g = t->geometry;
+   int c = t->capacity;
+   for(k = 0; k < count; ++k) {
+      neighbor_t* e = &t->entries[t->moved[k]];
+      g[k] = e->xyz[0];
+      g[c + k] = e->xyz[1];
+      g[2*c + k] = e->xyz[2];
+   }
+   geo_polar(slot->position, g, g + c, g + 2*c, count, g + 3*c, g + 4*c, g + 5*c);
+   const float deg = (float)(180.0 / M_PI);
+   for(k = 0; k < count; ++k) {
+      neighbor_t* e = &t->entries[t->moved[k]];
+      float polar[3] = { g[3*c + k], g[4*c + k] * deg, g[5*c + k] * deg };
+      if(full || !e->in_vm || memcmp(polar, e->polar, sizeof(polar))) {
+         buzzneighbors_add(slot->vm, e->id, polar[0], polar[1], polar[2]);
+         memcpy(e->polar, polar, sizeof(polar));
+         e->in_vm = 1;
+      }
+      e->moved = 0;
+   }
+   memcpy(t->origin, slot->position, sizeof(t->origin));
+}
+
+void set_neighbors(int vmid, const uint16_t* ids, const float* xyz, int n) {
+  int i;
+  uint64_t now = stats_now_ns();
+  for(i = 0; i < n; ++i)
+    upsert_neighbor(vmid, ids[i], &xyz[3*i], now);
+  commit_neighbors(vmid, now);
+}
+
+void set_neighbors_csr(const int* vmids, int n, const int* offsets, const int* neighbors,
+                       const uint16_t* ids, const float* xyz) {
+  int i, k;
+  uint64_t now = stats_now_ns();
+  for(i = 0; i < n; ++i) {
+    for(k = offsets[i]; k < offsets[i + 1]; ++k)
+      upsert_neighbor(vmids[i], ids[neighbors[k]], &xyz[3*neighbors[k]], now);
+    commit_neighbors(vmids[i], now);
+  }
 }
 
 /* Take one step through the buzz script */
 void buzz_script_step(int vmid) {
-   vm = all_virtual_machines[vmid];
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return;
+   buzzvm_t vm = slot->vm;
+   uint64_t start = stats_now_ns();
+   stepping_slot = slot;
 
-   if(!vm_stepped[vmid]){
+   if(!slot->stepped){
      /* Execute the global part of the script */
      buzzvm_execute_script(vm);
      /* Call the Init() function */
-     buzzvm_function_call(vm, "init", 0);
-     vm_stepped[vmid] = 1;
+     if(!slot->initialized) buzzvm_function_call(vm, "init", 0);
+     slot->stepped = 1;
+     slot->initialized = 1;
    }
 
    /* Process packets */
@@ -396,52 +1238,241 @@ void buzz_script_step(int vmid) {
     */
    if(buzzvm_function_call(vm, "step", 0) != BUZZVM_STATE_READY) {
       fprintf(stderr, "%s: execution terminated abnormally: %s\n\n",
-              BO_FNAME,
-              buzz_error_info(vm));
+              slot->image->bo_fname,
+              buzz_error_info(vm, slot->image));
       buzzvm_dump(vm);
    }
+   stepping_slot = NULL;
+   hist_record(&slot->step_time, stats_now_ns() - start);
 }
 
-/* Extract the messages sent from the buzz script */
+int buzz_step_stats(int vmid, hist_summary_t* s) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return -1;
+   hist_summarize(&slot->step_time, s);
+   return 0;
+}
+
+int get_num_python_hooks(void) {
+   return num_python_hooks;
+}
+
+const char* python_hook_stats(int hook_id, hist_summary_t* s) {
+   if(hook_id < 0 || hook_id >= num_python_hooks) return NULL;
+   hist_summarize(&python_hooks[hook_id]->time, s);
+   return python_hooks[hook_id]->name;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+Stepping pool.
+A fixed set of worker threads, one per core counting the calling thread, steps
+a batch of VMs for buzz_step_all. The batch is split in one contiguous range
+per thread. A thread steps its own range first, then steals the remaining VMs
+of the other ranges, so a slow VM does not hold back a whole range.
+*/
+typedef struct step_range_s {
+   atomic_int next;   // Next index of the batch to step in this range
+   int        end;
+   char       pad[64 - sizeof(atomic_int) - sizeof(int)];  // One cache line per range
+} *step_range_t;
+
+static pthread_mutex_t step_call_mutex = PTHREAD_MUTEX_INITIALIZER;  // One buzz_step_all at a time
+static pthread_mutex_t step_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  step_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  step_done = PTHREAD_COND_INITIALIZER;
+static pthread_t*      step_workers = NULL;
+static int             num_step_workers = 0;
+static step_range_t    step_ranges = NULL;     // num_step_workers + 1 ranges
+static const int*      step_vmids = NULL;      // Current batch
+static unsigned        step_batch = 0;         // Incremented for each batch
+static int             step_pending = 0;       // Workers still busy with the current batch
+static int             step_quit = 0;
+
+/* Step every VM of the range of thread self, then help the other threads */
+static void step_participate(int self) {
+   int num_ranges = num_step_workers + 1;
+   int i, r;
+   for(r = 0; r < num_ranges; ++r) {
+      step_range_t range = &step_ranges[(self + r) % num_ranges];
+      while((i = atomic_fetch_add(&range->next, 1)) < range->end)
+         buzz_script_step(step_vmids[i]);
+   }
+}
 
-int are_more_messages(int vmid) {
-  vm = all_virtual_machines[vmid];
-  return !buzzoutmsg_queue_isempty(vm);
+static void* step_worker(void* arg) {
+   int self = (int)(intptr_t)arg;
+   unsigned batch = 0;
+   pthread_mutex_lock(&step_mutex);
+   while(1) {
+      while(batch == step_batch && !step_quit)
+         pthread_cond_wait(&step_start, &step_mutex);
+      if(step_quit) break;
+      batch = step_batch;
+      pthread_mutex_unlock(&step_mutex);
+      step_participate(self);
+      pthread_mutex_lock(&step_mutex);
+      if(--step_pending == 0) pthread_cond_signal(&step_done);
+   }
+   pthread_mutex_unlock(&step_mutex);
+   return NULL;
+}
+
+/*
+The workers are not copied into a child process: forget them there, so that its
+first buzz_step_all starts a new pool, as the shards of a ShardedSimulation do.
+*/
+static void step_pool_forget(void) {
+   free(step_workers);
+   free(step_ranges);
+   step_workers = NULL;
+   step_ranges = NULL;
+   num_step_workers = 0;
+   step_batch = 0;
+   step_pending = 0;
+   pthread_mutex_init(&step_call_mutex, NULL);
+   pthread_mutex_init(&step_mutex, NULL);
+   pthread_cond_init(&step_start, NULL);
+   pthread_cond_init(&step_done, NULL);
 }
 
-char* get_next_message(int vmid) {
-  vm = all_virtual_machines[vmid];
-  buzzmsg_payload_t m = buzzoutmsg_queue_first(vm);
-  message_size = buzzmsg_payload_size(m);
-  buzzoutmsg_queue_next(vm);
-  return (char*)m->data;
+static void step_pool_start(void) {
+   int i;
+   static int forget_registered = 0;
+   if(!forget_registered) {
+      pthread_atfork(NULL, NULL, step_pool_forget);
+      forget_registered = 1;
+   }
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   num_step_workers = cores > 1 ? (int)cores - 1 : 0;
+   step_ranges = (step_range_t)calloc(num_step_workers + 1, sizeof(struct step_range_s));
+   step_workers = (pthread_t*)malloc(num_step_workers * sizeof(pthread_t));
+   for(i = 0; i < num_step_workers; ++i) {
+      if(pthread_create(&step_workers[i], NULL, step_worker, (void*)(intptr_t)i)) {
+         perror("buzz_step_all");
+         num_step_workers = i;
+         break;
+      }
+   }
+}
+
+static void step_pool_stop(void) {
+   int i;
+   pthread_mutex_lock(&step_call_mutex);
+   if(!step_ranges) {
+      pthread_mutex_unlock(&step_call_mutex);
+      return;
+   }
+   pthread_mutex_lock(&step_mutex);
+   step_quit = 1;
+   pthread_cond_broadcast(&step_start);
+   pthread_mutex_unlock(&step_mutex);
+   for(i = 0; i < num_step_workers; ++i)
+      pthread_join(step_workers[i], NULL);
+   free(step_workers);
+   free(step_ranges);
+   step_workers = NULL;
+   step_ranges = NULL;
+   num_step_workers = 0;
+   step_quit = 0;
+   pthread_mutex_unlock(&step_call_mutex);
+}
+
+void buzz_step_all(const int* vmids, int n) {
+   int i;
+   if(n <= 0) return;
+   pthread_mutex_lock(&step_call_mutex);
+   if(!step_ranges) step_pool_start();
+   int num_ranges = num_step_workers + 1;
+   for(i = 0; i < num_ranges; ++i) {
+      atomic_store(&step_ranges[i].next, (int)((long)n * i / num_ranges));
+      step_ranges[i].end = (int)((long)n * (i + 1) / num_ranges);
+   }
+   pthread_mutex_lock(&step_mutex);
+   step_vmids = vmids;
+   step_pending = num_step_workers;
+   step_batch++;
+   pthread_cond_broadcast(&step_start);
+   pthread_mutex_unlock(&step_mutex);
+   /* The calling thread takes the last range */
+   step_participate(num_step_workers);
+   pthread_mutex_lock(&step_mutex);
+   while(step_pending > 0)
+      pthread_cond_wait(&step_done, &step_mutex);
+   step_vmids = NULL;
+   pthread_mutex_unlock(&step_mutex);
+   pthread_mutex_unlock(&step_call_mutex);
 }
 
-int get_message_size() {
-  return message_size;
+/****************************************/
+/****************************************/
+
+/* Extract the messages sent from the buzz script */
+
+int drain_messages(int vmid, uint8_t* buf, int cap, int* sizes, int max) {
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return 0;
+   int n = 0, used = 0;
+   while(n < max) {
+      if(!slot->outgoing) {
+         if(buzzoutmsg_queue_isempty(slot->vm)) break;
+         /* Serialized for this call, the payload belongs to us */
+         slot->outgoing = buzzoutmsg_queue_first(slot->vm);
+         buzzoutmsg_queue_next(slot->vm);
+      }
+      int size = (int)buzzmsg_payload_size(slot->outgoing);
+      if(size > cap - used) {
+         if(n > 0) break;
+         sizes[0] = size;
+         return -1;
+      }
+      memcpy(buf + used, slot->outgoing->data, size);
+      buzzmsg_payload_destroy(&slot->outgoing);
+      slot->outgoing = NULL;
+      sizes[n++] = size;
+      used += size;
+   }
+   return n;
 }
 
 /****************************************/
 /****************************************/
 
+/* Run the destroy() function of a VM and release everything it holds */
+static void vm_teardown(int index) {
+   vm_slot_t slot = vm_slot_at(index);
+   buzzvm_t vm = slot->vm;
+   if(vm->state != BUZZVM_STATE_READY) {
+      fprintf(stderr, "%s: execution terminated abnormally: %s\n\n",
+              slot->image->bo_fname,
+              buzz_error_info(vm, slot->image));
+      buzzvm_dump(vm);
+   }
+   stepping_slot = slot;
+   buzzvm_function_call(vm, "destroy", 0);
+   stepping_slot = NULL;
+   buzzvm_destroy(&vm);
+   bcode_image_release(slot->image);
+   vm_slot_free(index);
+   num_virtual_machines--;
+}
+
+/* destroy one virtual machine. Its vmid becomes invalid */
+void buzz_vm_destroy(int vmid) {
+   if(!vm_slot(vmid)) return;
+   vm_teardown(vmid & ((1 << VM_SLOT_BITS) - 1));
+}
+
 /* destroy all virtual machines */
 void buzz_script_destroy(void) {
    int i;
+   step_pool_stop();
    /* Get rid of virtual machines */
-   for (i = 0; i < num_virtual_machines; ++i) {
-      vm = all_virtual_machines[i];
-      if(vm->state != BUZZVM_STATE_READY) {
-         fprintf(stderr, "%s: execution terminated abnormally: %s\n\n",
-                 BO_FNAME,
-                 buzz_error_info(vm));
-         buzzvm_dump(vm);
-      }
-      buzzvm_function_call(vm, "destroy", 0);
-      buzzvm_destroy(&vm);
+   for (i = 0; i < num_slots; ++i) {
+      if(vm_slot_at(i)->vm) vm_teardown(i);
    }
-   free(BO_FNAME);
-   buzzdebug_destroy(&DBG_INFO);
-   num_virtual_machines = 0;  // I don't think this is necessary
    fprintf(stdout, "Script execution stopped.\n");
 }
 
@@ -449,5 +1480,7 @@ void buzz_script_destroy(void) {
 /****************************************/
 
 int buzz_script_done(int vmid) {
-   return vm->state != BUZZVM_STATE_READY;
+   vm_slot_t slot = vm_slot(vmid);
+   if(!slot) return 1;
+   return slot->vm->state != BUZZVM_STATE_READY;
 }
@@ -1,30 +1,76 @@
 #include <buzz/buzzneighbors.h>
 #include "Python.h"
+#include "stats_utility.h"
 
 #ifndef BUZZ_UTILITY_H
 #define BUZZ_UTILITY_H
 
-#define MAX_NUM_VIRTUAL_MACHINES 15
 #define MAX_MESSAGE_SIZE 1024
 
+/* Number of low bits of a vmid that hold its slot in the VM table */
+#define VM_SLOT_BITS 16
+
+/* Numeric arguments of a batched hook call beyond this one are dropped */
+#define HOOK_BATCH_MAX_ARGS 8
+
 extern int buzz_listen(const char* type,
                        int msg_size);
 
+/*
+Create a virtual machine running the given script.
+Return the vmid of the new virtual machine, or -1 on error.
+*/
 extern int buzz_script_set(const char* bo_filename,
                            const char* bdbg_filename,
                            int comm_id);
 
+/*
+Run another script in a VM, from its next step. The VM must not be stepping.
+The new script must have the same string table as the running one.
+Return 0, or -1 on error, with the VM still running its script. errno is EINVAL
+when the string tables do not match.
+*/
+extern int buzz_script_reload(int vmid,
+                              const char* bo_filename,
+                              const char* bdbg_filename,
+                              int init);
+
 extern void import_module(const char* module_name);
+extern void buzz_vm_destroy(int vmid);
 extern void buzz_script_destroy(void);
 
 /*
-In the following functions, vmid is the id of the buzzvm_t object,
-which is the index of the buzzvm_t object in the array all_virtual_machines
+In the following functions, vmid is the id returned by buzz_script_set.
+The id of a destroyed virtual machine is ignored.
 */
 
+/*
+Register a function of the last imported module as a Buzz function of a VM.
+Return the id of the hook, shared by every VM that registered the function, or -1.
+The function is looked up by the first call of the hook.
+A batched hook does not call Python during the step. Its calls are queued, and
+the hook returns the result computed for this VM in the last delivered batch.
+batched only applies to this VM: the other VMs call the function as they registered it.
+*/
 extern int register_hook(int vmid,
-                          int hook_number,
-                          const char* function_name);
+                          const char* function_name,
+                          int batched);
+
+/*
+Make a C function available to Buzz scripts under the given name, without any
+Python in between. register_native_hook binds it in one VM.
+*/
+extern int add_native_hook(const char* name, buzzvm_funp fun);
+extern int register_native_hook(int vmid, const char* name);
+
+/*
+Take the calls queued for a batched hook since the last call to hook_batch_take.
+Return the number n of calls. robots holds the robot id of each call, and args
+holds n rows of HOOK_BATCH_MAX_ARGS arguments, of which the first width are set.
+The arrays stay valid until hook_batch_give stores the n results of the batch.
+*/
+extern int hook_batch_take(int hook_id, int** robots, double** args, int* width);
+extern void hook_batch_give(int hook_id, const double* results, int n);
 
 extern int register_init(void);
 
@@ -35,6 +81,14 @@ extern void set_abs_pos(int vmid,
 
 extern void buzz_script_step(int vmid);
 
+/*
+Step n virtual machines in parallel on the stepping pool, and return once all
+of them are done. Does not need the GIL: it is only taken while a Python hook
+runs. A vmid must not appear twice in vmids, no other thread may step these
+VMs, and no VM may be created or destroyed during the call.
+*/
+extern void buzz_step_all(const int* vmids, int n);
+
 extern int buzz_script_done(int vmid);
 
 extern int get_num_virtual_machines(void);
@@ -43,8 +97,57 @@ extern void reset_neighbors(int vmid);
 extern void add_neighbor(int vmid, int neighbour_id, float x, float y, float z);
 extern void feed_buzz_message(int vmid, int sender_id, char* message, int size);
 
-extern int are_more_messages(int vmid);
-extern char* get_next_message(int vmid);
-extern int get_message_size(void);
+/*
+Feed n messages to a VM at once. Message i was sent by sender_ids[i], and is
+made of the bytes buf[offsets[i]] to buf[offsets[i + 1] - 1], so offsets holds
+n + 1 entries. Empty messages are skipped.
+*/
+extern void feed_buzz_messages(int vmid, const uint16_t* sender_ids, const uint8_t* buf, const int* offsets, int n);
+
+/*
+Replace the neighbors of a VM. xyz holds the absolute position of each of the
+n neighbors, as x, y, z triplets. The relative positions are computed from the
+position last given to set_abs_pos.
+*/
+extern void set_neighbors(int vmid, const uint16_t* ids, const float* xyz, int n);
+
+/*
+set_neighbors for n VMs at once. The neighbors of vmids[i] are the robots
+neighbors[offsets[i]] to neighbors[offsets[i + 1] - 1], which index ids and the
+x, y, z triplets of xyz, so offsets holds n + 1 entries.
+*/
+extern void set_neighbors_csr(const int* vmids, int n, const int* offsets, const int* neighbors,
+                              const uint16_t* ids, const float* xyz);
+
+/*
+Neighbor table of a VM, kept across steps. upsert_neighbor records the absolute
+position of a neighbor seen at time now, on any clock that only goes forward.
+commit_neighbors forgets the neighbors not seen since oldest, and writes in the
+neighbors table of the VM only the neighbors that came, left, or whose
+position relative to the VM changed.
+*/
+extern void upsert_neighbor(int vmid, uint16_t id, const float* xyz, uint64_t now);
+extern void commit_neighbors(int vmid, uint64_t oldest);
+
+/*
+Move the messages sent by the VM out of its queue, one after the other into
+buf, which holds cap bytes, and set the size of each one in sizes.
+Stop after max messages, or before the first message that does not fit,
+which is kept for the next call. Return the number of messages written, 0
+once the queue is empty, or -1 if the next message alone is larger than cap,
+with its size in sizes[0].
+*/
+extern int drain_messages(int vmid, uint8_t* buf, int cap, int* sizes, int max);
+
+/* Nanoseconds per step of a VM, since it was created. Return 0, or -1 if there is no such VM */
+extern int buzz_step_stats(int vmid, hist_summary_t* s);
+
+/*
+Nanoseconds per call of a Python hook, or per batch for a batched hook, from
+hook_batch_take to hook_batch_give. Hook ids go from 0 to get_num_python_hooks.
+Return the name of the hook, or NULL if there is no such hook.
+*/
+extern int get_num_python_hooks(void);
+extern const char* python_hook_stats(int hook_id, hist_summary_t* s);
 
 #endif
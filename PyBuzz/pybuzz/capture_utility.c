@@ -0,0 +1,568 @@
+#define _GNU_SOURCE
+#include "capture_utility.h"
+#include "packet_utility.h"
+#include "stats_utility.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CAPTURE_RING_DEFAULT (1 << 22)   // A few ticks of a busy swarm
+#define CAPTURE_RING_MIN     (1 << 16)
+#define CAPTURE_POSE_SLOTS   4096        // A power of two
+#define CAPTURE_LOG_CHUNK    (1 << 24)   // The log grows by 16 MiB at a time
+#define CAPTURE_INDEX_CHUNK  (1 << 20)
+#define CAPTURE_IDLE_MS      10          // Longest the writer sleeps with poses waiting
+#define CAPTURE_ALIGN(n)     (((size_t)(n) + 7) & ~(size_t)7)
+
+/*
+File appended to through a shared mapping. The room is allocated on the disk
+before it is mapped, so that a full disk fails the write instead of raising
+SIGBUS when the mapping is touched.
+*/
+typedef struct capture_map_s {
+   int      fd;
+   uint8_t* data;
+   size_t   size;     // Written so far
+   size_t   mapped;   // Of the file and of the mapping
+   size_t   chunk;    // Bytes added at a time
+} capture_map_t;
+
+/*
+Slot of the queue of the poses, with many producers and one consumer (the
+bounded queue of D. Vyukov). seq is the position in the queue the slot is free
+for, and that position + 1 once a producer wrote its pose. The producers only
+race for the position, with a compare-and-swap, never for a lock.
+*/
+typedef struct capture_slot_s {
+   atomic_uint_fast64_t seq;
+   uint64_t             time_ns;
+   capture_pose_t       pose;
+} capture_slot_t;
+
+/*
+The ring of the hub thread holds whole records, their header first, each
+padded to 8 bytes, as in the log. head and tail count the bytes written and
+taken since the start: only the hub thread moves head, and only the writer
+moves tail.
+*/
+struct capture_s {
+   atomic_uint_fast64_t head;
+   char                 pad1[64 - sizeof(atomic_uint_fast64_t)];
+   atomic_uint_fast64_t tail;
+   char                 pad2[64 - sizeof(atomic_uint_fast64_t)];
+   atomic_uint_fast64_t pose_head;      // Next position of the queue of the poses
+   char                 pad3[64 - sizeof(atomic_uint_fast64_t)];
+   uint64_t             pose_tail;      // Writer only
+   capture_slot_t*      slots;
+   size_t               capacity;       // Of the ring, a power of two
+   uint8_t*             ring;
+   capture_map_t        log;
+   capture_map_t        index;
+   int                  wake_fd;
+   pthread_t            thread;
+   int                  running;
+   atomic_int           stop;
+   atomic_int           closed;
+   int                  error;          // errno of the first failed write, writer only until joined
+   atomic_uint_fast64_t records;        // Writer only
+   atomic_uint_fast64_t bytes;
+   atomic_uint_fast64_t ticks;
+   atomic_uint_fast64_t dropped_ring;   // Hub thread only
+   atomic_uint_fast64_t dropped_poses;  // Any thread
+   atomic_uint_fast64_t dropped_writer; // Writer only
+};
+
+/****************************************/
+/****************************************/
+
+static int map_create(capture_map_t* m, const char* path, size_t chunk) {
+   m->data = NULL;
+   m->size = m->mapped = 0;
+   m->chunk = chunk;
+   m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   return m->fd < 0 ? -1 : 0;
+}
+
+/* Room for n more bytes. Return where they go, or NULL and set errno */
+static uint8_t* map_reserve(capture_map_t* m, size_t n) {
+   if(m->size + n > m->mapped) {
+      size_t mapped = m->mapped;
+      while(m->size + n > mapped) mapped += m->chunk;
+      int error = posix_fallocate(m->fd, (off_t)m->mapped, (off_t)(mapped - m->mapped));
+      if(error) {
+         errno = error;
+         return NULL;
+      }
+      void* data = m->data ? mremap(m->data, m->mapped, mapped, MREMAP_MAYMOVE)
+                           : mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+      if(data == MAP_FAILED) return NULL;
+      m->data = (uint8_t*)data;
+      m->mapped = mapped;
+   }
+   return m->data + m->size;
+}
+
+/* Unmap the file, and cut it to what was written. Return 0, or -1 and set errno */
+static int map_close(capture_map_t* m) {
+   int status = 0;
+   if(m->fd < 0) return 0;
+   if(m->data) munmap(m->data, m->mapped);
+   if(ftruncate(m->fd, (off_t)m->size)) status = -1;
+   if(close(m->fd)) status = -1;
+   m->fd = -1;
+   m->data = NULL;
+   return status;
+}
+
+/****************************************/
+/****************************************/
+
+static void ring_put(capture_t c, uint64_t at, const void* src, size_t n) {
+   size_t i = at & (c->capacity - 1);
+   size_t first = n < c->capacity - i ? n : c->capacity - i;
+   memcpy(c->ring + i, src, first);
+   memcpy(c->ring, (const uint8_t*)src + first, n - first);
+}
+
+static void ring_get(capture_t c, uint64_t at, void* dst, size_t n) {
+   size_t i = at & (c->capacity - 1);
+   size_t first = n < c->capacity - i ? n : c->capacity - i;
+   memcpy(dst, c->ring + i, first);
+   memcpy((uint8_t*)dst + first, c->ring, n - first);
+}
+
+/*
+Start a record of size bytes of payload in the ring, from the hub thread.
+Return the position of its payload, or 0 if it was dropped.
+*/
+static uint64_t ring_begin(capture_t c, int type, size_t size) {
+   uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+   uint64_t tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+   if(atomic_load_explicit(&c->closed, memory_order_relaxed) ||
+      sizeof(capture_header_t) + CAPTURE_ALIGN(size) > c->capacity - (head - tail)) {
+      counter_add(&c->dropped_ring, 1);
+      return 0;
+   }
+   capture_header_t h;
+   h.type = (uint32_t)type;
+   h.size = (uint32_t)size;
+   h.time_ns = stats_now_ns();
+   ring_put(c, head, &h, sizeof(h));
+   return head + sizeof(h);
+}
+
+/* Hand the record to the writer */
+static void ring_end(capture_t c, size_t size) {
+   uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+   atomic_store_explicit(&c->head, head + sizeof(capture_header_t) + CAPTURE_ALIGN(size), memory_order_release);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+Room for a record in the log. Return where its payload goes, or NULL once
+writing failed. The header is only written by log_end, after the payload, so
+that a record cut short by a crash reads as the end of the log.
+*/
+static uint8_t* log_begin(capture_t c, const capture_header_t* h) {
+   if(c->error) return NULL;
+   uint8_t* p = map_reserve(&c->log, sizeof(*h) + CAPTURE_ALIGN(h->size));
+   if(!p) {
+      c->error = errno;
+      return NULL;
+   }
+   return p + sizeof(*h);
+}
+
+static void log_end(capture_t c, const capture_header_t* h) {
+   uint8_t* p = c->log.data + c->log.size;
+   size_t n = sizeof(*h) + CAPTURE_ALIGN(h->size);
+   if(h->type == CAPTURE_TICK) {
+      capture_index_t* e = (capture_index_t*)map_reserve(&c->index, sizeof(capture_index_t));
+      if(!e) {
+         c->error = errno;
+         counter_add(&c->dropped_writer, 1);
+         return;
+      }
+      memcpy(&e->tick, p + sizeof(*h), sizeof(e->tick));
+      e->time_ns = h->time_ns;
+      e->offset = c->log.size;
+      c->index.size += sizeof(*e);
+      counter_add(&c->ticks, 1);
+   }
+   memcpy(p, h, sizeof(*h));
+   c->log.size += n;
+   counter_add(&c->records, 1);
+   counter_add(&c->bytes, n);
+}
+
+/* Write the oldest record of the ring or of the poses. Return 1, or 0 if there is none */
+static int capture_write_next(capture_t c) {
+   capture_header_t h;
+   uint64_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+   int from_ring = atomic_load_explicit(&c->head, memory_order_acquire) != tail;
+   capture_slot_t* s = &c->slots[c->pose_tail & (CAPTURE_POSE_SLOTS - 1)];
+   int from_poses = atomic_load_explicit(&s->seq, memory_order_acquire) == c->pose_tail + 1;
+   if(from_ring) ring_get(c, tail, &h, sizeof(h));
+   if(from_ring && (!from_poses || h.time_ns <= s->time_ns)) {
+      uint8_t* p = log_begin(c, &h);
+      if(p) {
+         ring_get(c, tail + sizeof(h), p, h.size);
+         log_end(c, &h);
+      }
+      else {
+         counter_add(&c->dropped_writer, 1);
+      }
+      atomic_store_explicit(&c->tail, tail + sizeof(h) + CAPTURE_ALIGN(h.size), memory_order_release);
+      return 1;
+   }
+   if(from_poses) {
+      h.type = CAPTURE_POSE;
+      h.size = sizeof(capture_pose_t);
+      h.time_ns = s->time_ns;
+      uint8_t* p = log_begin(c, &h);
+      if(p) {
+         memcpy(p, &s->pose, sizeof(s->pose));
+         log_end(c, &h);
+      }
+      else {
+         counter_add(&c->dropped_writer, 1);
+      }
+      atomic_store_explicit(&s->seq, c->pose_tail + CAPTURE_POSE_SLOTS, memory_order_release);
+      ++c->pose_tail;
+      return 1;
+   }
+   return 0;
+}
+
+static void* capture_loop(void* arg) {
+   capture_t c = (capture_t)arg;
+   for(;;) {
+      /* Read before draining, so that the records added before the stop are all written */
+      int stop = atomic_load(&c->stop);
+      while(capture_write_next(c));
+      if(stop) break;
+      struct pollfd p = { c->wake_fd, POLLIN, 0 };
+      uint64_t value;
+      if(poll(&p, 1, CAPTURE_IDLE_MS) > 0 && read(c->wake_fd, &value, sizeof(value)) < 0) continue;
+   }
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+capture_t capture_open(const char* path, size_t ring_size) {
+   capture_t c = (capture_t)calloc(1, sizeof(struct capture_s));
+   if(!c) return NULL;
+   c->log.fd = c->index.fd = c->wake_fd = -1;
+   if(!ring_size) ring_size = CAPTURE_RING_DEFAULT;
+   c->capacity = CAPTURE_RING_MIN;
+   while(c->capacity < ring_size) c->capacity <<= 1;
+   c->ring = (uint8_t*)malloc(c->capacity);
+   c->slots = (capture_slot_t*)malloc(CAPTURE_POSE_SLOTS * sizeof(capture_slot_t));
+   if(!c->ring || !c->slots) {
+      capture_destroy(c);
+      errno = ENOMEM;
+      return NULL;
+   }
+   for(int i = 0; i < CAPTURE_POSE_SLOTS; ++i)
+      atomic_init(&c->slots[i].seq, (uint64_t)i);
+
+   size_t length = strlen(path);
+   char* index_path = (char*)malloc(length + sizeof(CAPTURE_INDEX_EXT));
+   if(!index_path) {
+      capture_destroy(c);
+      errno = ENOMEM;
+      return NULL;
+   }
+   memcpy(index_path, path, length);
+   memcpy(index_path + length, CAPTURE_INDEX_EXT, sizeof(CAPTURE_INDEX_EXT));
+   capture_file_t* file = NULL;
+   int status = map_create(&c->log, path, CAPTURE_LOG_CHUNK) ||
+                map_create(&c->index, index_path, CAPTURE_INDEX_CHUNK) ||
+                !(file = (capture_file_t*)map_reserve(&c->log, sizeof(capture_file_t))) ||
+                (c->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0;
+   free(index_path);
+   if(status) {
+      int error = errno;
+      capture_destroy(c);
+      errno = error;
+      return NULL;
+   }
+   memcpy(file->magic, CAPTURE_MAGIC, sizeof(file->magic));
+   file->version = CAPTURE_VERSION;
+   file->wire_version = WIRE_VERSION;
+   file->start_ns = stats_now_ns();
+   file->start_us = stats_realtime_us();
+   c->log.size = sizeof(capture_file_t);
+   if((errno = pthread_create(&c->thread, NULL, capture_loop, c))) {
+      int error = errno;
+      capture_destroy(c);
+      errno = error;
+      return NULL;
+   }
+   c->running = 1;
+   return c;
+}
+
+int capture_tick(capture_t c, uint64_t tick, uint64_t timestamp, const uint32_t* ids, const float* xyz, int n) {
+   size_t size = sizeof(capture_tick_t) + (size_t)n * sizeof(capture_position_t);
+   uint64_t at = ring_begin(c, CAPTURE_TICK, size);
+   if(!at) return -1;
+   capture_tick_t t;
+   memset(&t, 0, sizeof(t));
+   t.tick = tick;
+   t.timestamp = timestamp;
+   t.n = (uint32_t)n;
+   ring_put(c, at, &t, sizeof(t));
+   at += sizeof(t);
+   for(int i = 0; i < n; ++i, at += sizeof(capture_position_t)) {
+      capture_position_t p;
+      p.robot_id = ids[i];
+      memcpy(p.xyz, xyz + 3*i, sizeof(p.xyz));
+      ring_put(c, at, &p, sizeof(p));
+   }
+   ring_end(c, size);
+   return 0;
+}
+
+int capture_frame(capture_t c, uint32_t receiver, const struct iovec* iov, int count) {
+   size_t size = sizeof(receiver);
+   int i;
+   for(i = 0; i < count; ++i)
+      size += iov[i].iov_len;
+   uint64_t at = ring_begin(c, CAPTURE_FRAME, size);
+   if(!at) return -1;
+   ring_put(c, at, &receiver, sizeof(receiver));
+   at += sizeof(receiver);
+   for(i = 0; i < count; ++i) {
+      ring_put(c, at, iov[i].iov_base, iov[i].iov_len);
+      at += iov[i].iov_len;
+   }
+   ring_end(c, size);
+   return 0;
+}
+
+int capture_pose(capture_t c, uint32_t robot_id, const float* xyz, const float* yaw) {
+   uint64_t pos = atomic_load_explicit(&c->pose_head, memory_order_relaxed);
+   capture_slot_t* s;
+   if(atomic_load_explicit(&c->closed, memory_order_relaxed)) {
+      atomic_fetch_add_explicit(&c->dropped_poses, 1, memory_order_relaxed);
+      return -1;
+   }
+   for(;;) {
+      s = &c->slots[pos & (CAPTURE_POSE_SLOTS - 1)];
+      uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+      int64_t diff = (int64_t)(seq - pos);
+      if(diff == 0) {
+         if(atomic_compare_exchange_weak_explicit(&c->pose_head, &pos, pos + 1,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            break;
+      }
+      else if(diff < 0) {
+         /* The writer did not take the pose of this slot yet: the queue is full */
+         atomic_fetch_add_explicit(&c->dropped_poses, 1, memory_order_relaxed);
+         return -1;
+      }
+      else {
+         pos = atomic_load_explicit(&c->pose_head, memory_order_relaxed);
+      }
+   }
+   s->time_ns = stats_now_ns();
+   s->pose.robot_id = robot_id;
+   s->pose.has_yaw = yaw != NULL;
+   memcpy(s->pose.pose, xyz, 3 * sizeof(float));
+   s->pose.pose[3] = yaw ? *yaw : 0;
+   atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+   return 0;
+}
+
+void capture_kick(capture_t c) {
+   uint64_t one = 1;
+   if(write(c->wake_fd, &one, sizeof(one)) < 0) return;  // Only fails when the counter is already high
+}
+
+int capture_close(capture_t c) {
+   if(atomic_exchange(&c->closed, 1)) return 0;
+   if(c->running) {
+      atomic_store(&c->stop, 1);
+      capture_kick(c);
+      pthread_join(c->thread, NULL);
+      c->running = 0;
+   }
+   int error = c->error;
+   if(map_close(&c->log) && !error) error = errno;
+   if(map_close(&c->index) && !error) error = errno;
+   if(error) {
+      errno = error;
+      return -1;
+   }
+   return 0;
+}
+
+void capture_destroy(capture_t c) {
+   if(!c) return;
+   capture_close(c);
+   if(c->wake_fd >= 0) close(c->wake_fd);
+   free(c->ring);
+   free(c->slots);
+   free(c);
+}
+
+static uint64_t capture_counter(const atomic_uint_fast64_t* counter) {
+   return atomic_load_explicit((atomic_uint_fast64_t*)counter, memory_order_relaxed);
+}
+
+void capture_stats(capture_t c, capture_stats_t* stats) {
+   stats->records = capture_counter(&c->records);
+   stats->bytes = capture_counter(&c->bytes);
+   stats->ticks = capture_counter(&c->ticks);
+   stats->dropped = capture_counter(&c->dropped_ring) + capture_counter(&c->dropped_poses) +
+                    capture_counter(&c->dropped_writer);
+}
+
+/****************************************/
+/****************************************/
+
+/* Header of the record at pos. Return 0, or -1 if there is no whole record there */
+static int reader_header(const capture_reader_t* r, size_t pos, capture_header_t* h) {
+   if(pos + sizeof(*h) > r->size) return -1;
+   memcpy(h, r->data + pos, sizeof(*h));
+   if(h->type == CAPTURE_END || h->size > r->size - pos - sizeof(*h)) return -1;
+   return 0;
+}
+
+static int reader_index_valid(const capture_reader_t* r, const capture_index_t* e) {
+   capture_header_t h;
+   return e->offset >= sizeof(capture_file_t) && (e->offset & 7) == 0 &&
+          !reader_header(r, e->offset, &h) && h.type == CAPTURE_TICK;
+}
+
+/* Index of the ticks from the log itself, for a log without one */
+static int reader_build_index(capture_reader_t* r) {
+   size_t capacity = 0, pos = sizeof(capture_file_t);
+   capture_header_t h;
+   while(!reader_header(r, pos, &h)) {
+      if(h.type == CAPTURE_TICK && h.size >= sizeof(capture_tick_t)) {
+         if(r->n_ticks == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            capture_index_t* index = (capture_index_t*)realloc(r->own_index, capacity * sizeof(capture_index_t));
+            if(!index) {
+               errno = ENOMEM;
+               return -1;
+            }
+            r->own_index = index;
+         }
+         capture_index_t* e = &r->own_index[r->n_ticks++];
+         memcpy(&e->tick, r->data + pos + sizeof(h), sizeof(e->tick));
+         e->time_ns = h.time_ns;
+         e->offset = pos;
+      }
+      pos += sizeof(h) + CAPTURE_ALIGN(h.size);
+   }
+   r->index = r->own_index;
+   return 0;
+}
+
+int capture_reader_open(capture_reader_t* r, const char* path) {
+   struct stat st;
+   memset(r, 0, sizeof(*r));
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0) return -1;
+   if(fstat(fd, &st)) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+   }
+   if((size_t)st.st_size < sizeof(capture_file_t)) {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+   }
+   void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED) return -1;
+   r->data = (const uint8_t*)data;
+   r->size = (size_t)st.st_size;
+   r->file = (const capture_file_t*)data;
+   if(memcmp(r->file->magic, CAPTURE_MAGIC, sizeof(r->file->magic)) || r->file->version != CAPTURE_VERSION) {
+      capture_reader_close(r);
+      errno = EINVAL;
+      return -1;
+   }
+   r->pos = sizeof(capture_file_t);
+
+   /* The index, without the entries a crash left behind */
+   size_t length = strlen(path);
+   char* index_path = (char*)malloc(length + sizeof(CAPTURE_INDEX_EXT));
+   if(index_path) {
+      memcpy(index_path, path, length);
+      memcpy(index_path + length, CAPTURE_INDEX_EXT, sizeof(CAPTURE_INDEX_EXT));
+      fd = open(index_path, O_RDONLY | O_CLOEXEC);
+      free(index_path);
+   }
+   else {
+      fd = -1;
+   }
+   if(fd >= 0) {
+      if(!fstat(fd, &st) && (size_t)st.st_size >= sizeof(capture_index_t)) {
+         data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+         if(data != MAP_FAILED) {
+            r->index_map = data;
+            r->index_size = (size_t)st.st_size;
+            r->index = (const capture_index_t*)data;
+            r->n_ticks = r->index_size / sizeof(capture_index_t);
+            while(r->n_ticks && !reader_index_valid(r, &r->index[r->n_ticks - 1])) --r->n_ticks;
+         }
+      }
+      close(fd);
+   }
+   if(!r->n_ticks && reader_build_index(r)) {
+      int error = errno;
+      capture_reader_close(r);
+      errno = error;
+      return -1;
+   }
+   return 0;
+}
+
+int capture_reader_next(capture_reader_t* r, capture_record_t* rec) {
+   capture_header_t h;
+   if(reader_header(r, r->pos, &h)) return 0;
+   rec->type = (int)h.type;
+   rec->time_ns = h.time_ns;
+   rec->payload = r->data + r->pos + sizeof(h);
+   rec->size = h.size;
+   r->pos += sizeof(h) + CAPTURE_ALIGN(h.size);
+   return 1;
+}
+
+int capture_reader_seek(capture_reader_t* r, uint64_t tick) {
+   size_t lo = 0, hi = r->n_ticks;
+   while(lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if(r->index[mid].tick < tick) lo = mid + 1;
+      else hi = mid;
+   }
+   if(lo == r->n_ticks) return -1;
+   r->pos = r->index[lo].offset;
+   return 0;
+}
+
+void capture_reader_close(capture_reader_t* r) {
+   if(r->data) munmap((void*)r->data, r->size);
+   if(r->index_map) munmap(r->index_map, r->index_size);
+   free(r->own_index);
+   memset(r, 0, sizeof(*r));
+}
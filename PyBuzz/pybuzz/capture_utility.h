@@ -0,0 +1,172 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifndef CAPTURE_UTILITY_H
+#define CAPTURE_UTILITY_H
+
+/*
+Capture of the traffic of a CommHub, for replaying it later.
+
+The log is an append-only file, mapped in memory, of the frames the hub sent
+to each robot and of the pose updates it got, in the order they happened. It
+starts with a capture_file_t, followed by records of a capture_header_t and
+its payload, each padded to 8 bytes. The numbers are in the byte order of the
+host. The record after the last one is all zeros, even if the process died
+in the middle of a capture.
+
+   CAPTURE_TICK   capture_tick_t, then n capture_position_t: the positions
+                  used by the tick, before its frames
+   CAPTURE_FRAME  uint32 receiver, then the frame as sent (see
+                  packet_utility.h). CAPTURE_MULTICAST for the multicast group
+   CAPTURE_POSE   capture_pose_t
+
+A second file, path + ".idx", holds a capture_index_t per tick, for seeking
+to a tick without reading the log up to it.
+
+The hub thread and the threads updating the poses never wait for the disk:
+their records go through rings without locks to a writer thread, which
+appends them to the log. When a ring is full, its records are dropped and
+counted.
+*/
+#define CAPTURE_MAGIC     "PYBZCAP"   // With its terminator, 8 bytes
+#define CAPTURE_VERSION   1
+#define CAPTURE_MULTICAST UINT32_MAX
+#define CAPTURE_INDEX_EXT ".idx"
+
+typedef enum {
+   CAPTURE_END = 0,
+   CAPTURE_TICK,
+   CAPTURE_FRAME,
+   CAPTURE_POSE
+} capture_type_e;
+
+typedef struct capture_file_s {
+   char     magic[8];
+   uint32_t version;
+   uint32_t wire_version;   // Of the frames, WIRE_VERSION
+   uint64_t start_ns;       // CLOCK_MONOTONIC, the clock of the records
+   uint64_t start_us;       // CLOCK_REALTIME, the clock of the timestamps of the frames
+} capture_file_t;
+
+typedef struct capture_header_s {
+   uint32_t type;
+   uint32_t size;      // Of the payload, without the padding
+   uint64_t time_ns;   // CLOCK_MONOTONIC
+} capture_header_t;
+
+typedef struct capture_tick_s {
+   uint64_t tick;        // Counted from 0 for each capture
+   uint64_t timestamp;   // Of the frames of the tick
+   uint32_t n;
+   uint32_t pad;
+} capture_tick_t;
+
+typedef struct capture_position_s {
+   uint32_t robot_id;
+   float    xyz[3];
+} capture_position_t;
+
+typedef struct capture_pose_s {
+   uint32_t robot_id;
+   uint32_t has_yaw;   // 0 for commhub_update_position, which keeps the last yaw
+   float    pose[4];   // x, y, z, yaw in radians
+} capture_pose_t;
+
+typedef struct capture_index_s {
+   uint64_t tick;
+   uint64_t time_ns;
+   uint64_t offset;    // Of the CAPTURE_TICK record in the log
+} capture_index_t;
+
+typedef struct capture_s* capture_t;
+
+/*
+Create the log at path (and its index), replacing any file there, and start
+its writer thread. ring_size is the bytes of the ring of the hub thread, 0 for
+the default.
+Return NULL and set errno on error.
+*/
+extern capture_t capture_open(const char* path, size_t ring_size);
+
+/*
+Add the start of a tick, and the frame sent to a robot. Only one thread may
+call them, the hub thread.
+Return 0, or -1 if the record was dropped.
+*/
+extern int capture_tick(capture_t c,
+                        uint64_t tick,
+                        uint64_t timestamp,
+                        const uint32_t* ids,
+                        const float* xyz,
+                        int n);
+
+extern int capture_frame(capture_t c, uint32_t receiver, const struct iovec* iov, int count);
+
+/*
+Add a pose update. From any thread, without waiting for the others.
+yaw is NULL to keep the last one.
+Return 0, or -1 if the record was dropped.
+*/
+extern int capture_pose(capture_t c, uint32_t robot_id, const float* xyz, const float* yaw);
+
+/* Have the writer thread take the records added so far, from the hub thread at the end of a tick */
+extern void capture_kick(capture_t c);
+
+/*
+Write the records left, stop the writer thread and cut the files to their size.
+The records added after are dropped.
+Return 0, or -1 and set errno if the log could not be written entirely. Return
+0 when the capture was already closed.
+*/
+extern int capture_close(capture_t c);
+
+/* Close the capture if needed, and free it. No thread may add records anymore */
+extern void capture_destroy(capture_t c);
+
+typedef struct capture_stats_s {
+   uint64_t records;   // Written to the log
+   uint64_t bytes;
+   uint64_t ticks;
+   uint64_t dropped;   // By a full ring, or once writing the log failed
+} capture_stats_t;
+
+extern void capture_stats(capture_t c, capture_stats_t* stats);
+
+/*
+Reader of a log, mapped in memory. The records point into the mapping, and
+stay valid until capture_reader_close. Without a usable index, the reader
+builds its own from the log.
+*/
+typedef struct capture_reader_s {
+   const uint8_t*         data;
+   size_t                 size;
+   size_t                 pos;       // Of the next record
+   const capture_file_t*  file;
+   const capture_index_t* index;
+   size_t                 n_ticks;
+   void*                  index_map; // Mapping of the index file, or NULL
+   size_t                 index_size;
+   capture_index_t*       own_index; // Built by the reader, or NULL
+} capture_reader_t;
+
+typedef struct capture_record_s {
+   int            type;
+   uint64_t       time_ns;
+   const uint8_t* payload;
+   size_t         size;
+} capture_record_t;
+
+/* Return 0, or -1 and set errno, EINVAL if the file is not a log of this version */
+extern int capture_reader_open(capture_reader_t* r, const char* path);
+
+/* Take the next record. Return 1, or 0 after the last one */
+extern int capture_reader_next(capture_reader_t* r, capture_record_t* rec);
+
+/* Go to the first tick numbered tick or later. Return 0, or -1 if there is none */
+extern int capture_reader_seek(capture_reader_t* r, uint64_t tick);
+
+extern void capture_reader_close(capture_reader_t* r);
+
+#endif
@@ -0,0 +1,1929 @@
+#define _GNU_SOURCE
+#include "commhub_utility.h"
+#include "capture_utility.h"
+#include "geometry_utility.h"
+#include "packet_utility.h"
+#include "transport_utility.h"
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/****************************************/
+/****************************************/
+
+struct hub_grid_s {
+   int      capacity;        // Positions the buffers can hold
+   int64_t* cells;           // Cell coordinates of each position, 3 per position
+   int*     buckets;         // Start of each hash bucket in order, num_buckets + 1 entries
+   int      num_buckets;
+   int*     order;           // Positions sorted by bucket
+   float*   sorted;          // x, then y, then z of the positions in order, capacity each
+   uint8_t* mask;            // Positions of a bucket in range, capacity entries
+   int*     neighbors;
+   int      neighbors_capacity;
+};
+
+/****************************************/
+/****************************************/
+
+static unsigned cell_hash(int64_t x, int64_t y, int64_t z, int num_buckets) {
+   uint64_t h = (uint64_t)x * 73856093u ^ (uint64_t)y * 19349663u ^ (uint64_t)z * 83492791u;
+   return (unsigned)(h ^ (h >> 29)) & (num_buckets - 1);
+}
+
+hub_grid_t hub_grid_new(void) {
+   return (hub_grid_t)calloc(1, sizeof(struct hub_grid_s));
+}
+
+void hub_grid_destroy(hub_grid_t grid) {
+   if(!grid) return;
+   free(grid->cells);
+   free(grid->buckets);
+   free(grid->order);
+   free(grid->sorted);
+   free(grid->mask);
+   free(grid->neighbors);
+   free(grid);
+}
+
+static int grid_reserve(hub_grid_t grid, int n) {
+   if(n <= grid->capacity) return 0;
+   int num_buckets = 1;
+   while(num_buckets < 2 * n) num_buckets <<= 1;
+   int64_t* cells = (int64_t*)realloc(grid->cells, 3 * n * sizeof(int64_t));
+   if(cells) grid->cells = cells;
+   int* buckets = (int*)realloc(grid->buckets, (num_buckets + 1) * sizeof(int));
+   if(buckets) grid->buckets = buckets;
+   int* order = (int*)realloc(grid->order, n * sizeof(int));
+   if(order) grid->order = order;
+   float* sorted = (float*)realloc(grid->sorted, 3 * n * sizeof(float));
+   if(sorted) grid->sorted = sorted;
+   uint8_t* mask = (uint8_t*)realloc(grid->mask, n);
+   if(mask) grid->mask = mask;
+   if(!cells || !buckets || !order || !sorted || !mask) return -1;
+   grid->capacity = n;
+   grid->num_buckets = num_buckets;
+   return 0;
+}
+
+/* Append a neighbor, growing the output buffer if needed */
+static int push_neighbor(hub_grid_t grid, int count, int j) {
+   if(count == grid->neighbors_capacity) {
+      int capacity = grid->neighbors_capacity ? 2 * grid->neighbors_capacity : 256;
+      int* neighbors = (int*)realloc(grid->neighbors, capacity * sizeof(int));
+      if(!neighbors) return -1;
+      grid->neighbors = neighbors;
+      grid->neighbors_capacity = capacity;
+   }
+   grid->neighbors[count] = j;
+   return count + 1;
+}
+
+/* Lay out the positions given by order, or all of them in their order without, as structure of arrays */
+static void sort_positions(hub_grid_t grid, const float* xyz, int n, const int* order) {
+   int k;
+   for(k = 0; k < n; ++k) {
+      int i = order ? order[k] : k;
+      grid->sorted[k] = xyz[3*i];
+      grid->sorted[grid->capacity + k] = xyz[3*i+1];
+      grid->sorted[2 * grid->capacity + k] = xyz[3*i+2];
+   }
+}
+
+/* Set grid->mask for the positions first to first + count of grid->sorted in range of p */
+static void range_mask(hub_grid_t grid, const float* p, int first, int count, float radius) {
+   const float* x = grid->sorted + first;
+   geo_in_range(p, x, x + grid->capacity, x + 2 * grid->capacity, count, radius, grid->mask);
+}
+
+/* Compare every pair. For an infinite range, where the grid has a single cell */
+static int all_pairs(hub_grid_t grid, const float* xyz, int n, float radius, int* offsets) {
+   int i, j, count = 0;
+   if(grid_reserve(grid, n)) return -1;
+   sort_positions(grid, xyz, n, NULL);
+   for(i = 0; i < n; ++i) {
+      offsets[i] = count;
+      range_mask(grid, &xyz[3*i], 0, n, radius);
+      for(j = 0; j < n; ++j) {
+         if(j != i && grid->mask[j]) {
+            count = push_neighbor(grid, count, j);
+            if(count < 0) return -1;
+         }
+      }
+   }
+   offsets[n] = count;
+   return count;
+}
+
+int hub_grid_neighbors(hub_grid_t grid,
+                       const float* xyz,
+                       int n,
+                       float radius,
+                       int* offsets,
+                       int** neighbors) {
+   int i, j, k, count = 0;
+   *neighbors = grid->neighbors;
+   if(n <= 0) {
+      if(n == 0) offsets[0] = 0;
+      return 0;
+   }
+   if(!(radius > 0)) {
+      memset(offsets, 0, (n + 1) * sizeof(int));
+      return 0;
+   }
+   if(isinf(radius)) {
+      count = all_pairs(grid, xyz, n, radius, offsets);
+      *neighbors = grid->neighbors;
+      return count;
+   }
+   if(grid_reserve(grid, n)) return -1;
+   int64_t* cells = grid->cells;
+   int* buckets = grid->buckets;
+   int* order = grid->order;
+   int num_buckets = grid->num_buckets;
+
+   /* Sort the positions by the hash bucket of their cell (counting sort) */
+   memset(buckets, 0, (num_buckets + 1) * sizeof(int));
+   for(i = 0; i < n; ++i) {
+      for(k = 0; k < 3; ++k)
+         cells[3*i+k] = (int64_t)floorf(xyz[3*i+k] / radius);
+      buckets[cell_hash(cells[3*i], cells[3*i+1], cells[3*i+2], num_buckets) + 1]++;
+   }
+   for(i = 0; i < num_buckets; ++i)
+      buckets[i+1] += buckets[i];
+   for(i = 0; i < n; ++i) {
+      unsigned b = cell_hash(cells[3*i], cells[3*i+1], cells[3*i+2], num_buckets);
+      order[buckets[b]++] = i;
+   }
+   /* buckets[b] now holds the end of bucket b. Shift back to get starts */
+   for(i = num_buckets; i > 0; --i)
+      buckets[i] = buckets[i-1];
+   buckets[0] = 0;
+   sort_positions(grid, xyz, n, order);
+
+   /* Look for neighbors in the 27 cells around the cell of each position */
+   for(i = 0; i < n; ++i) {
+      offsets[i] = count;
+      int64_t dx, dy, dz;
+      for(dx = -1; dx <= 1; ++dx)
+      for(dy = -1; dy <= 1; ++dy)
+      for(dz = -1; dz <= 1; ++dz) {
+         int64_t cx = cells[3*i] + dx, cy = cells[3*i+1] + dy, cz = cells[3*i+2] + dz;
+         unsigned b = cell_hash(cx, cy, cz, num_buckets);
+         if(buckets[b] == buckets[b+1]) continue;
+         range_mask(grid, &xyz[3*i], buckets[b], buckets[b+1] - buckets[b], radius);
+         for(k = buckets[b]; k < buckets[b+1]; ++k) {
+            j = order[k];
+            /* Buckets can be shared by several cells. Only take the positions of this cell */
+            if(!grid->mask[k - buckets[b]] || j == i ||
+               cells[3*j] != cx || cells[3*j+1] != cy || cells[3*j+2] != cz)
+               continue;
+            count = push_neighbor(grid, count, j);
+            if(count < 0) return -1;
+         }
+      }
+   }
+   offsets[n] = count;
+   *neighbors = grid->neighbors;
+   return count;
+}
+
+/****************************************/
+/****************************************/
+
+#define HUB_READ_CHUNK  65536   // Free space made in a receive buffer before each recv
+#define HUB_MAX_EVENTS  64      // Events taken by one epoll_wait
+#define HUB_IOV_MAX     1024    // Most buffers passed to one sendmsg
+#define HUB_MAX_DATAGRAMS 64    // Most datagrams read for one epoll event
+#define HUB_UDP_RECORDS ((HUB_IOV_MAX - 2) / 2)   // Most records in one datagram, two buffers each
+/* Most bytes of messages of a robot that fit in a datagram, in a record of its own */
+#define HUB_UDP_MESSAGES (UDP_MAX_DATAGRAM - FRAME_PREFIX_MAX - FRAME_HEADER_MAX - FRAME_RECORD_MAX)
+
+typedef struct hub_buffer_s {
+   uint8_t* data;
+   size_t   size;
+   size_t   capacity;
+} hub_buffer_t;
+
+/* First byte of a Buzz message, buzzmsg_payload_type_e of buzzmsg.h */
+enum {
+   BUZZ_MSG_BROADCAST = 0,
+   BUZZ_MSG_SWARM_LIST,
+   BUZZ_MSG_SWARM_JOIN,
+   BUZZ_MSG_SWARM_LEAVE,
+   BUZZ_MSG_VSTIG_PUT,
+   BUZZ_MSG_VSTIG_QUERY
+};
+
+/* A message of a robot for the current tick, while it is shaped (hub_shape) */
+typedef struct hub_message_s {
+   const uint8_t* data;      // Size varint included
+   size_t         size;
+   const uint8_t* key;       // Bytes the messages that supersede each other share, in the Buzz message
+   size_t         key_size;  // 0 for a message nothing supersedes
+   uint32_t       hash;      // Of the key
+   int            lane;
+   int            superseded;
+} hub_message_t;
+
+/* What an epoll event is about */
+typedef enum {
+   TAG_LISTEN = 0,   // TCP connections
+   TAG_UNIX,         // shm connections
+   TAG_UDP,          // Datagrams of all the udp clients
+   TAG_WAKE,
+   TAG_TIMER,
+   TAG_CLIENT,       // Socket of a tcp or shm client
+   TAG_DOORBELL      // Bytes in the ring of a shm client
+} hub_tag_kind_e;
+
+typedef struct hub_tag_s {
+   int                  kind;
+   struct hub_client_s* client;
+} hub_tag_t;
+
+/* A frame in the out buffer of a client */
+#define HUB_FRAME_STARTED   1   // The socket or the ring took a part of it already
+#define HUB_FRAME_POSE_ONLY 2   // Its records have no messages: any later frame supersedes it
+#define HUB_FRAME_KEY       4   // It has the keyframe of the position of the receiver
+
+typedef struct hub_queued_s {
+   size_t size;   // Bytes of the frame still in out
+   int    flags;
+} hub_queued_t;
+
+typedef struct hub_client_s {
+   int                     transport;   // TRANSPORT_TCP, TRANSPORT_SHM or TRANSPORT_UDP
+   int                     fd;          // -1 for udp
+   int                     row;         // Row of the robot, -1 until the handshake
+   int                     closed;
+   int                     want_write;  // out is not empty, and waits for the socket or the ring
+   char                    address[64];
+   hub_tag_t               tag;
+   hub_tag_t               doorbell;
+   shm_channel_t           ch;          // shm only
+   struct sockaddr_storage peer;        // udp only
+   socklen_t               peer_len;
+   hub_buffer_t            in;          // Received bytes, not decoded yet
+   hub_buffer_t            frame;       // Messages of the frames received since the last tick
+   hub_buffer_t            tick_frame;  // Messages forwarded by the current tick
+   int                     frame_msgs;  // Messages in frame
+   uint64_t                frame_since; // stats_now_ns of the first frame of frame
+   hub_buffer_t            out;         // Bytes the socket did not accept yet
+   hub_queued_t*           queued;      // Frames of out, oldest first
+   int                     queued_count;
+   int                     queued_capacity;
+   pose_codec_t            pose;        // Keyframe of the position sent to this robot
+   uint64_t                seq;         // Of the next frame sent to this robot
+   struct hub_client_s*    next;
+} hub_client_t;
+
+/*
+Latest pose of a robot, written by any thread and read by the ticks without
+locks (seqlock). seq is odd while a writer is in the middle of an update, and
+0 until the first one. One cache line per pose, so that the writers of
+different robots do not share one.
+*/
+typedef struct hub_pose_s {
+   atomic_uint   seq;
+   _Atomic float value[4];   // x, y, z, and the yaw in radians
+   char          pad[64 - sizeof(atomic_uint) - 4 * sizeof(_Atomic float)];
+} hub_pose_t;
+
+typedef struct hub_robot_s {
+   uint32_t      id;
+   hub_client_t* client;             // NULL while disconnected
+} hub_robot_t;
+
+/* Queue of the frames of a robot, written by the hub thread only, read by commhub_queue_stats */
+typedef struct hub_queue_counters_s {
+   atomic_uint_fast64_t queued_bytes;
+   atomic_uint_fast64_t max_queued_bytes;
+   atomic_uint_fast64_t frames_queued;
+   atomic_uint_fast64_t frames_shed;
+   atomic_uint_fast64_t bytes_shed;
+} hub_queue_counters_t;
+
+struct commhub_s {
+   int               listen_fd;
+   int               unix_fd;        // shm connections, -1 without
+   int               udp_fd;         // -1 without
+   int               epoll_fd;
+   int               wake_fd;        // eventfd, written for forward requests and stops
+   int               timer_fd;       // timerfd of the deadline of the next automatic tick, -1 without
+   hub_tag_t         listen_tag, unix_tag, udp_tag, wake_tag, timer_tag;
+   int               n_clients;
+   float             neighbor_distance;
+   float             resolution;     // Of the positions in the frames
+   double            period;
+   int               cpu;            // Of the hub thread, -1 for any
+   int               multicast_fd;   // Not bound, so the group is reached whatever host is, -1 without
+   struct sockaddr_in multicast;
+   pthread_t         thread;
+   int               started;
+   /* Only touched by the hub thread once it is started */
+   hub_client_t*     clients;        // All the connections, handshakes included
+   hub_robot_t*      robots;         // One per row, in connection order
+   hub_queue_counters_t* queues;     // One per row
+   size_t            high_water;     // Most bytes waiting for a client before frames are shed, 0 for no limit
+   int               num_robots;
+   int               all_connected;
+   int               shm_backlog;    // shm clients with bytes their ring could not take
+   float*            tick_positions; // Positions used by the current tick
+   struct iovec*     messages;       // Messages of each row for the current tick, terminator included
+   int*              rows;           // Rows of the records of a frame
+   int*              offsets;
+   hub_grid_t        grid;
+   struct iovec*     iov;            // 2 * n_clients + 2 entries, enough for any frame
+   uint8_t*          scratch;        // Prefix, header and records of a frame
+   uint8_t*          datagram;       // UDP_MAX_DATAGRAM bytes
+   uint64_t          multicast_seq;
+   /* Tick scheduling */
+   int64_t           period_ns;
+   int64_t           deadline_ns;    // CLOCK_MONOTONIC deadline of the next automatic tick
+   int64_t           tick_start_ns;
+   int               tick_open;      // The current tick gave way to the next deadline
+   int               tick_next;      // Next row served by the current tick
+   int*              tick_neighbors;
+   uint64_t          tick_timestamp;
+   int               tick_listening;
+   int               tick_multicast; // Some robots of the current tick listen to the multicast group
+   int64_t           report_ns;      // Last COMMHUB_EVENT_OVERRUN
+   /* Read by the callers without locks */
+   hub_pose_t*       poses;          // One per row
+   atomic_int*       id_table;       // Open addressing table of robot id -> row + 1, filled by the hub thread
+   int               id_table_mask;
+   /* Shared with the callers, under mutex */
+   pthread_mutex_t   mutex;
+   pthread_cond_t    cond;
+   int               stop;
+   int               alive;
+   uint64_t          forward_requested;
+   uint64_t          forward_served;
+   commhub_event_t*  events;         // Ring of the events not taken yet
+   int               events_head;
+   int               events_count;
+   int               events_capacity;
+   int               events_closed;  // COMMHUB_EVENT_STOPPED was taken
+   commhub_tick_stats_t stats;
+   /* Written by the hub thread only, read by commhub_stats without locks */
+   struct {
+      atomic_uint_fast64_t frames_in;
+      atomic_uint_fast64_t messages_in;
+      atomic_uint_fast64_t bytes_in;
+      atomic_uint_fast64_t bytes_out;
+      atomic_uint_fast64_t datagrams_dropped;
+      atomic_uint_fast64_t records_dropped;
+      atomic_uint_fast64_t disconnects;
+      atomic_uint_fast64_t messages_coalesced;
+      atomic_uint_fast64_t messages_deferred;
+      atomic_uint_fast64_t messages_shed;
+      atomic_uint_fast64_t frames_shed;
+      atomic_uint_fast64_t slow_clients;
+      hist_t               forward_delay;
+      hist_t               tick_time;
+      hist_t               tick_bytes;
+      hist_t               tick_messages;
+   } counters;
+   uint64_t          tick_bytes;     // Sent by the current tick so far
+   /* Shaping of the messages, set before the hub thread starts */
+   int               coalesce;
+   int               n_lanes;
+   int               lane_of_class[COMMHUB_NUM_CLASSES];
+   size_t            lane_budget[COMMHUB_NUM_CLASSES];
+   hub_message_t*    shape;          // Messages of the robot being shaped
+   int               shape_capacity;
+   int*              shape_table;    // Open addressing table of the keys, shape + 1, 2 * shape_capacity entries
+   hub_buffer_t      deferred;       // Messages over budget, for the next tick
+   /* Capture of the traffic, set before the hub thread starts */
+   capture_t         capture;        // NULL without
+   uint32_t*         capture_ids;    // Id of each row, for the ticks
+   uint64_t          capture_ticks;
+};
+
+/****************************************/
+/****************************************/
+
+static int buffer_reserve(hub_buffer_t* b, size_t extra) {
+   if(b->size + extra <= b->capacity) return 0;
+   size_t capacity = b->capacity ? 2 * b->capacity : 256;
+   while(capacity < b->size + extra) capacity *= 2;
+   uint8_t* data = (uint8_t*)realloc(b->data, capacity);
+   if(!data) return -1;
+   b->data = data;
+   b->capacity = capacity;
+   return 0;
+}
+
+static int buffer_append(hub_buffer_t* b, const void* data, size_t n) {
+   if(buffer_reserve(b, n)) return -1;
+   memcpy(b->data + b->size, data, n);
+   b->size += n;
+   return 0;
+}
+
+/* Drop the first n bytes */
+static void buffer_consume(hub_buffer_t* b, size_t n) {
+   if(!n) return;
+   memmove(b->data, b->data + n, b->size - n);
+   b->size -= n;
+}
+
+static void buffer_free(hub_buffer_t* b) {
+   free(b->data);
+   b->data = NULL;
+   b->size = b->capacity = 0;
+}
+
+/****************************************/
+/****************************************/
+
+/* Add an event for commhub_next_event. Call with hub->mutex held */
+static void hub_push_event_locked(commhub_t hub, int type, uint32_t robot_id, const char* address) {
+   if(hub->events_count == hub->events_capacity) {
+      int capacity = hub->events_capacity ? 2 * hub->events_capacity : 16;
+      commhub_event_t* events = (commhub_event_t*)malloc(capacity * sizeof(commhub_event_t));
+      if(!events) return;
+      int i;
+      for(i = 0; i < hub->events_count; ++i)
+         events[i] = hub->events[(hub->events_head + i) % hub->events_capacity];
+      free(hub->events);
+      hub->events = events;
+      hub->events_head = 0;
+      hub->events_capacity = capacity;
+   }
+   commhub_event_t* ev = &hub->events[(hub->events_head + hub->events_count) % hub->events_capacity];
+   ev->type = type;
+   ev->robot_id = robot_id;
+   snprintf(ev->address, sizeof(ev->address), "%s", address ? address : "");
+   ++hub->events_count;
+   pthread_cond_broadcast(&hub->cond);
+}
+
+static void hub_push_event(commhub_t hub, int type, uint32_t robot_id, const char* address) {
+   pthread_mutex_lock(&hub->mutex);
+   hub_push_event_locked(hub, type, robot_id, address);
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+/*
+Row of a robot, or -1. Safe from any thread: rows are only inserted by the hub
+thread, and never removed
+*/
+static int hub_find_row(commhub_t hub, uint32_t robot_id) {
+   unsigned h = (robot_id * 2654435761u) & hub->id_table_mask;
+   int entry;
+   while((entry = atomic_load_explicit(&hub->id_table[h], memory_order_acquire))) {
+      if(hub->robots[entry - 1].id == robot_id) return entry - 1;
+      h = (h + 1) & hub->id_table_mask;
+   }
+   return -1;
+}
+
+/* Publish the row of a robot, once its id is set */
+static void hub_insert_row(commhub_t hub, uint32_t robot_id, int row) {
+   unsigned h = (robot_id * 2654435761u) & hub->id_table_mask;
+   while(atomic_load_explicit(&hub->id_table[h], memory_order_relaxed))
+      h = (h + 1) & hub->id_table_mask;
+   atomic_store_explicit(&hub->id_table[h], row + 1, memory_order_release);
+}
+
+/****************************************/
+/****************************************/
+
+/* Write the position of a pose, and its yaw unless yaw is NULL. Writers of the same pose take turns */
+static void hub_pose_write(hub_pose_t* pose, const float* xyz, const float* yaw) {
+   unsigned seq = atomic_load_explicit(&pose->seq, memory_order_relaxed);
+   while((seq & 1) || !atomic_compare_exchange_weak_explicit(&pose->seq, &seq, seq + 1,
+                                                             memory_order_acquire, memory_order_relaxed))
+      seq = atomic_load_explicit(&pose->seq, memory_order_relaxed);
+   for(int k = 0; k < 3; ++k)
+      atomic_store_explicit(&pose->value[k], xyz[k], memory_order_relaxed);
+   if(yaw) atomic_store_explicit(&pose->value[3], *yaw, memory_order_relaxed);
+   atomic_store_explicit(&pose->seq, seq + 2, memory_order_release);
+}
+
+/* Read a consistent pose into value. Return 0, or -1 if it was never written */
+static int hub_pose_read(hub_pose_t* pose, float* value) {
+   unsigned seq;
+   do {
+      seq = atomic_load_explicit(&pose->seq, memory_order_acquire);
+      if(!seq) return -1;
+      for(int k = 0; k < 4; ++k)
+         value[k] = atomic_load_explicit(&pose->value[k], memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+   } while((seq & 1) || atomic_load_explicit(&pose->seq, memory_order_relaxed) != seq);
+   return 0;
+}
+
+/* Yaw about the z axis, in radians, of the rotation by the quaternion (x, y, z, w) */
+static float quaternion_yaw(const float* q) {
+   return atan2f(2.0f * (q[3] * q[2] + q[0] * q[1]), 1.0f - 2.0f * (q[1] * q[1] + q[2] * q[2]));
+}
+
+/****************************************/
+/****************************************/
+
+static hub_client_t* hub_new_client(commhub_t hub, int transport, int fd) {
+   hub_client_t* c = (hub_client_t*)calloc(1, sizeof(hub_client_t));
+   if(!c) return NULL;
+   c->transport = transport;
+   c->fd = fd;
+   c->row = -1;
+   c->tag.kind = TAG_CLIENT;
+   c->tag.client = c;
+   c->doorbell.kind = TAG_DOORBELL;
+   c->doorbell.client = c;
+   c->ch.mem_fd = c->ch.hub_fd = c->ch.vm_fd = -1;
+   c->next = hub->clients;
+   hub->clients = c;
+   return c;
+}
+
+/*
+Release the sockets of a connection. The client is only freed by hub_reap,
+once nothing refers to it anymore.
+*/
+static void hub_close_client(commhub_t hub, hub_client_t* c, int report) {
+   if(c->closed) return;
+   if(c->fd >= 0) {
+      epoll_ctl(hub->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+      close(c->fd);
+   }
+   if(c->transport == TRANSPORT_SHM) {
+      if(c->ch.hub_fd >= 0) epoll_ctl(hub->epoll_fd, EPOLL_CTL_DEL, c->ch.hub_fd, NULL);
+      shm_channel_destroy(&c->ch);
+      if(c->want_write) --hub->shm_backlog;
+   }
+   c->closed = 1;
+   if(c->row >= 0) atomic_store_explicit(&hub->queues[c->row].queued_bytes, 0, memory_order_relaxed);
+   if(c->row >= 0 && hub->robots[c->row].client == c) {
+      hub->robots[c->row].client = NULL;
+      if(report) {
+         counter_add(&hub->counters.disconnects, 1);
+         hub_push_event(hub, COMMHUB_EVENT_DISCONNECTED, hub->robots[c->row].id, c->address);
+      }
+   }
+}
+
+static void hub_reap(commhub_t hub) {
+   hub_client_t** link = &hub->clients;
+   while(*link) {
+      hub_client_t* c = *link;
+      if(c->closed) {
+         *link = c->next;
+         buffer_free(&c->in);
+         buffer_free(&c->frame);
+         buffer_free(&c->tick_frame);
+         buffer_free(&c->out);
+         free(c->queued);
+         free(c);
+      }
+      else {
+         link = &c->next;
+      }
+   }
+}
+
+static void hub_format_address(char* address, size_t size, const struct sockaddr* addr, socklen_t addr_len) {
+   char host[INET6_ADDRSTRLEN], port[8];   // Numeric, so as much as they can hold
+   if(getnameinfo(addr, addr_len, host, sizeof(host), port, sizeof(port),
+                  NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+      snprintf(address, size, "('%s', %s)", host, port);
+   else
+      address[0] = 0;
+}
+
+static int hub_watch(commhub_t hub, int fd, hub_tag_t* tag) {
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = tag;
+   return epoll_ctl(hub->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Take the pending connections of a tcp or a unix listening socket */
+static void hub_accept(commhub_t hub, int listen_fd, int transport) {
+   while(1) {
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      int fd = accept4(listen_fd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(fd < 0) return;  // No more pending connections
+      hub_client_t* c = hub_new_client(hub, transport, fd);
+      if(!c) {
+         close(fd);
+         continue;
+      }
+      if(transport == TRANSPORT_TCP) {
+         int one = 1;
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+         hub_format_address(c->address, sizeof(c->address), (struct sockaddr*)&addr, addr_len);
+      }
+      else {
+         snprintf(c->address, sizeof(c->address), "shared memory");
+      }
+      if(hub_watch(hub, fd, &c->tag)) {
+         c->fd = -1;
+         close(fd);
+         c->closed = 1;
+      }
+   }
+}
+
+/* Give a shm client its rings, once it has a row */
+static int hub_open_channel(commhub_t hub, hub_client_t* c) {
+   if(shm_channel_create(&c->ch)) return -1;
+   if(shm_channel_send(c->fd, &c->ch)) return -1;
+   return hub_watch(hub, c->ch.hub_fd, &c->doorbell);
+}
+
+/*
+Give a row to the robot that sent its handshake. A robot that connects again gets its
+row back. Connections for other robots than the n_clients expected are closed.
+*/
+static void hub_handshake(commhub_t hub, hub_client_t* c, uint32_t robot_id) {
+   int row = hub_find_row(hub, robot_id);
+   if(row < 0 && hub->num_robots < hub->n_clients) {
+      row = hub->num_robots++;
+      hub->robots[row].id = robot_id;
+      hub_insert_row(hub, robot_id, row);
+   }
+   if(row < 0 || hub->robots[row].client ||
+      (c->transport == TRANSPORT_SHM && hub_open_channel(hub, c))) {
+      hub_close_client(hub, c, 0);
+      return;
+   }
+   c->row = row;
+   hub->robots[row].client = c;
+   hub_push_event(hub, COMMHUB_EVENT_CONNECTED, robot_id, c->address);
+   if(!hub->all_connected && hub->num_robots == hub->n_clients) {
+      hub->all_connected = 1;
+      hub_push_event(hub, COMMHUB_EVENT_ALL_CONNECTED, 0, NULL);
+   }
+}
+
+/* Decode a frame from a BuzzVM, with num_msgs messages. Return 0, or -1 if it is not one or is corrupted */
+static int hub_open_uplink(const uint8_t* data, size_t length, frame_view_t* v, int* num_msgs) {
+   size_t size;
+   if(frame_open(data, length, NULL, v) || !(v->flags & FRAME_UPLINK) ||
+      messages_scan(v->next, v->end, &size, num_msgs) || v->next + size != v->end)
+      return -1;
+   return 0;
+}
+
+/* Keep the messages of a frame for the next tick, without their terminator */
+static int hub_keep_messages(commhub_t hub, hub_client_t* c, const frame_view_t* v, int num_msgs) {
+   size_t size = (size_t)(v->end - v->next) - 1;
+   if(!num_msgs) return 0;
+   if(!c->frame_msgs) c->frame_since = stats_now_ns();
+   c->frame_msgs += num_msgs;
+   counter_add(&hub->counters.frames_in, 1);
+   counter_add(&hub->counters.messages_in, num_msgs);
+   counter_add(&hub->counters.bytes_in, size);
+   return buffer_append(&c->frame, v->next, size);
+}
+
+/* Keep the messages of the complete frames at the start of c->in for the next tick */
+static void hub_frame(commhub_t hub, hub_client_t* c, size_t start) {
+   frame_view_t v;
+   size_t length;
+   int status, num_msgs;
+   while((status = frame_scan(c->in.data + start, c->in.size - start, &length)) > 0) {
+      if(hub_open_uplink(c->in.data + start, length, &v, &num_msgs) ||
+         v.sender != hub->robots[c->row].id ||
+         hub_keep_messages(hub, c, &v, num_msgs)) {
+         status = -1;
+         break;
+      }
+      start += length;
+   }
+   if(status < 0) {
+      hub_close_client(hub, c, 1);
+      return;
+   }
+   buffer_consume(&c->in, start);
+}
+
+/* Take the bytes available on the socket of a tcp or shm client */
+static void hub_read(commhub_t hub, hub_client_t* c) {
+   if(buffer_reserve(&c->in, HUB_READ_CHUNK)) {
+      hub_close_client(hub, c, 1);
+      return;
+   }
+   ssize_t n = recv(c->fd, c->in.data + c->in.size, c->in.capacity - c->in.size, 0);
+   if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+   if(n <= 0) {
+      hub_close_client(hub, c, 1);
+      return;
+   }
+   c->in.size += n;
+   size_t start = 0;
+   if(c->row < 0) {
+      if(c->in.size < HANDSHAKE_SIZE) return;
+      uint32_t robot_id;
+      if(handshake_get(c->in.data, &robot_id)) {
+         hub_close_client(hub, c, 0);  // Another version of the wire format
+         return;
+      }
+      hub_handshake(hub, c, robot_id);
+      if(c->closed) return;
+      start = HANDSHAKE_SIZE;
+   }
+   hub_frame(hub, c, start);
+}
+
+/* Take the bytes in the ring of a shm client */
+static void hub_read_ring(commhub_t hub, hub_client_t* c) {
+   uint64_t value;
+   if(read(c->ch.hub_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) return;
+   size_t n;
+   do {
+      if(buffer_reserve(&c->in, HUB_READ_CHUNK)) {
+         hub_close_client(hub, c, 1);
+         return;
+      }
+      n = shm_ring_read(c->ch.to_hub, c->in.data + c->in.size, c->in.capacity - c->in.size);
+      c->in.size += n;
+   } while(n);
+   hub_frame(hub, c, 0);
+}
+
+/*
+A datagram with a handshake registers a udp client. A robot registering again
+from another address (after a restart) replaces its old address. It gets a
+keyframe next, as it may have missed or lost the last one.
+*/
+static void hub_udp_register(commhub_t hub, uint32_t robot_id, const struct sockaddr_storage* addr, socklen_t addr_len) {
+   int row = hub_find_row(hub, robot_id);
+   if(row >= 0) {
+      hub_client_t* old = hub->robots[row].client;
+      if(old && old->transport == TRANSPORT_UDP) {
+         old->peer = *addr;
+         old->peer_len = addr_len;
+         memset(&old->pose, 0, sizeof(old->pose));
+         return;
+      }
+   }
+   hub_client_t* c = hub_new_client(hub, TRANSPORT_UDP, -1);
+   if(!c) return;
+   c->peer = *addr;
+   c->peer_len = addr_len;
+   hub_format_address(c->address, sizeof(c->address), (const struct sockaddr*)addr, addr_len);
+   hub_handshake(hub, c, robot_id);
+}
+
+/* Keep the messages of a datagram that comes from a udp client at the right address */
+static void hub_udp_frame(commhub_t hub, const uint8_t* data, size_t len,
+                          const struct sockaddr_storage* addr, socklen_t addr_len) {
+   frame_view_t v;
+   size_t length;
+   int num_msgs;
+   if(frame_scan(data, len, &length) <= 0 || length != len || hub_open_uplink(data, len, &v, &num_msgs)) return;
+   int row = hub_find_row(hub, v.sender);
+   hub_client_t* c = row >= 0 ? hub->robots[row].client : NULL;
+   if(c && c->transport == TRANSPORT_UDP && c->peer_len == addr_len && !memcmp(&c->peer, addr, addr_len))
+      hub_keep_messages(hub, c, &v, num_msgs);
+}
+
+static void hub_udp_read(commhub_t hub) {
+   int i;
+   for(i = 0; i < HUB_MAX_DATAGRAMS; ++i) {
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      ssize_t n = recvfrom(hub->udp_fd, hub->datagram, UDP_MAX_DATAGRAM, 0, (struct sockaddr*)&addr, &addr_len);
+      if(n < 0) return;
+      uint32_t robot_id;
+      if(n == HANDSHAKE_SIZE) {
+         if(!handshake_get(hub->datagram, &robot_id)) hub_udp_register(hub, robot_id, &addr, addr_len);
+      }
+      else {
+         hub_udp_frame(hub, hub->datagram, n, &addr, addr_len);
+      }
+   }
+}
+
+/* Publish the bytes waiting in out */
+static void hub_queue_report(commhub_t hub, hub_client_t* c) {
+   hub_queue_counters_t* q = &hub->queues[c->row];
+   atomic_store_explicit(&q->queued_bytes, c->out.size, memory_order_relaxed);
+   if(c->out.size > atomic_load_explicit(&q->max_queued_bytes, memory_order_relaxed))
+      atomic_store_explicit(&q->max_queued_bytes, c->out.size, memory_order_relaxed);
+}
+
+/* Note a frame appended to out */
+static int hub_queue_push(commhub_t hub, hub_client_t* c, size_t size, int flags) {
+   if(c->queued_count == c->queued_capacity) {
+      int capacity = c->queued_capacity ? 2 * c->queued_capacity : 16;
+      hub_queued_t* queued = (hub_queued_t*)realloc(c->queued, capacity * sizeof(hub_queued_t));
+      if(!queued) return -1;
+      c->queued = queued;
+      c->queued_capacity = capacity;
+   }
+   c->queued[c->queued_count].size = size;
+   c->queued[c->queued_count++].flags = flags;
+   counter_add(&hub->queues[c->row].frames_queued, 1);
+   return 0;
+}
+
+/* Drop the first n bytes of out, written by the socket or the ring */
+static void hub_queue_consume(hub_client_t* c, size_t n) {
+   int done = 0;
+   buffer_consume(&c->out, n);
+   while(n && done < c->queued_count) {
+      hub_queued_t* f = &c->queued[done];
+      if(n < f->size) {
+         f->size -= n;
+         f->flags |= HUB_FRAME_STARTED;
+         break;
+      }
+      n -= f->size;
+      ++done;
+   }
+   memmove(c->queued, c->queued + done, (c->queued_count - done) * sizeof(hub_queued_t));
+   c->queued_count -= done;
+}
+
+/*
+Drop the frames of out that match flags, or all of them with flags 0, oldest
+first, until out holds at most hub->high_water bytes. Frames already started
+stay.
+*/
+static void hub_queue_drop(commhub_t hub, hub_client_t* c, int flags) {
+   hub_queue_counters_t* q = &hub->queues[c->row];
+   size_t from = 0, to = 0;
+   int i, kept = 0;
+   for(i = 0; i < c->queued_count; ++i) {
+      hub_queued_t f = c->queued[i];
+      if(c->out.size - (from - to) > hub->high_water && !(f.flags & HUB_FRAME_STARTED) &&
+         (f.flags & flags) == flags) {
+         /* The frames after a lost keyframe cannot be decoded against it: start over from a new one */
+         if(f.flags & HUB_FRAME_KEY) memset(&c->pose, 0, sizeof(c->pose));
+         counter_add(&q->frames_shed, 1);
+         counter_add(&q->bytes_shed, f.size);
+         counter_add(&hub->counters.frames_shed, 1);
+      }
+      else {
+         memmove(c->out.data + to, c->out.data + from, f.size);
+         to += f.size;
+         c->queued[kept++] = f;
+      }
+      from += f.size;
+   }
+   c->out.size = to;
+   c->queued_count = kept;
+}
+
+/* Make room in the queue of a slow client before a new frame */
+static void hub_queue_shed(commhub_t hub, hub_client_t* c) {
+   if(!hub->high_water || c->out.size <= hub->high_water) return;
+   hub_queue_drop(hub, c, HUB_FRAME_POSE_ONLY);
+   if(c->out.size > hub->high_water) hub_queue_drop(hub, c, 0);
+   hub_queue_report(hub, c);
+}
+
+/* Note that out has bytes waiting for the socket (EPOLLOUT) or the ring (shm_backlog) */
+static void hub_want_write(commhub_t hub, hub_client_t* c, int want) {
+   if(c->want_write == want) return;
+   c->want_write = want;
+   if(c->transport == TRANSPORT_SHM) {
+      hub->shm_backlog += want ? 1 : -1;
+      return;
+   }
+   struct epoll_event ev;
+   ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+   ev.data.ptr = &c->tag;
+   epoll_ctl(hub->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void hub_ring_bell(hub_client_t* c) {
+   uint64_t one = 1;
+   if(write(c->ch.vm_fd, &one, sizeof(one)) < 0) return;  // Only fails when the counter is already high
+}
+
+/* Write the bytes the socket or the ring did not accept before */
+static void hub_flush(commhub_t hub, hub_client_t* c) {
+   if(c->transport == TRANSPORT_SHM) {
+      size_t n = shm_ring_write(c->ch.to_vm, c->out.data, c->out.size);
+      if(n) hub_ring_bell(c);
+      hub_queue_consume(c, n);
+   }
+   while(c->transport == TRANSPORT_TCP && c->out.size) {
+      ssize_t n = send(c->fd, c->out.data, c->out.size, MSG_NOSIGNAL);
+      if(n < 0) {
+         if(errno == EINTR) continue;
+         if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+         hub_close_client(hub, c, 1);
+         return;
+      }
+      hub_queue_consume(c, n);
+   }
+   if(c->row >= 0 && !c->closed) hub_queue_report(hub, c);
+   if(!c->out.size) hub_want_write(hub, c, 0);
+}
+
+/* Write buffers in the ring of a shm client. Return the number of buffers written whole, and the rest in *sent */
+static int hub_write_ring(hub_client_t* c, const struct iovec* iov, int count, size_t* sent) {
+   int i;
+   size_t n = 0;
+   for(i = 0; i < count; ++i) {
+      n = shm_ring_write(c->ch.to_vm, iov[i].iov_base, iov[i].iov_len);
+      if(n < iov[i].iov_len) break;
+      n = 0;
+   }
+   if(i || n) hub_ring_bell(c);
+   *sent = n;
+   return i;
+}
+
+/*
+Send buffers to a client with as few system calls as possible. What the socket
+or the ring does not take is kept, and written when there is room. For udp,
+the buffers are one datagram, lost if the socket does not take it.
+flags are the HUB_FRAME_* of the frame of the buffers.
+Return 0, or -1 if the connection broke.
+*/
+static int hub_send(commhub_t hub, hub_client_t* c, const struct iovec* iov, int count, int flags) {
+   int i = 0;
+   size_t sent = 0;   // Bytes of iov[i] already sent
+   for(i = 0; i < count; ++i)
+      hub->tick_bytes += iov[i].iov_len;
+   if(hub->capture) capture_frame(hub->capture, hub->robots[c->row].id, iov, count);
+   i = 0;
+   if(c->transport == TRANSPORT_UDP) {
+      if(udp_send_datagram(hub->udp_fd, &c->peer, c->peer_len, iov, count) <= 0)
+         counter_add(&hub->counters.datagrams_dropped, 1);
+      return 0;
+   }
+   if(c->out.size) hub_flush(hub, c);
+   if(c->closed) return -1;
+   if(!c->out.size && c->transport == TRANSPORT_SHM) {
+      i = hub_write_ring(c, iov, count, &sent);
+   }
+   else if(!c->out.size) {
+      while(i < count) {
+         struct msghdr msg;
+         memset(&msg, 0, sizeof(msg));
+         msg.msg_iov = (struct iovec*)iov + i;
+         msg.msg_iovlen = count - i < HUB_IOV_MAX ? count - i : HUB_IOV_MAX;
+         ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+         if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            hub_close_client(hub, c, 1);
+            return -1;
+         }
+         while(i < count && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            ++i;
+         }
+         sent = n;
+         if(sent) break;  // The socket buffer is full
+      }
+   }
+   size_t queued = c->out.size;
+   if(i || sent) flags |= HUB_FRAME_STARTED;
+   for(; i < count; ++i) {
+      if(buffer_append(&c->out, (const uint8_t*)iov[i].iov_base + sent, iov[i].iov_len - sent)) {
+         hub_close_client(hub, c, 1);
+         return -1;
+      }
+      sent = 0;
+   }
+   if(c->out.size > queued) {
+      if(hub_queue_push(hub, c, c->out.size - queued, flags)) {
+         hub_close_client(hub, c, 1);
+         return -1;
+      }
+      hub_queue_report(hub, c);
+   }
+   if(c->out.size) hub_want_write(hub, c, 1);
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
+static uint64_t hub_now_us(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/*
+Build a frame in hub->iov, with a record for each of rows[0..count).
+own is the keyframe state of the receiver, or NULL to send origin as a keyframe.
+Return the number of buffers.
+*/
+static int hub_build_frame(commhub_t hub,
+                           pose_codec_t* own,
+                           uint64_t seq,
+                           uint64_t timestamp,
+                           const float* origin,
+                           const int* rows,
+                           int count) {
+   uint8_t* header = hub->scratch + FRAME_PREFIX_MAX;
+   float coded[4];
+   size_t size = frame_put_header(header, seq, timestamp, own, origin, hub->resolution, count, coded);
+   uint8_t* p = header + size;
+   int i, m = 2;
+   hub->iov[0].iov_base = hub->scratch;
+   hub->iov[1].iov_base = header;
+   hub->iov[1].iov_len = size;
+   for(i = 0; i < count; ++i) {
+      int r = rows[i];
+      size_t n = frame_put_record(p, hub->robots[r].id, &hub->tick_positions[3*r], coded, coded[3]);
+      hub->iov[m].iov_base = p;
+      hub->iov[m++].iov_len = n;
+      hub->iov[m++] = hub->messages[r];
+      p += n;
+      size += n + hub->messages[r].iov_len;
+   }
+   hub->iov[0].iov_len = frame_put_prefix(hub->scratch, size);
+   return m;
+}
+
+/*
+Send a robot at row r its frame of this tick, with the records of
+hub->rows[0..count). A udp client gets as many frames as it takes datagrams.
+Return 0, or -1 if the connection broke.
+*/
+static int hub_send_frames(commhub_t hub, hub_client_t* c, int r, int count, uint64_t timestamp) {
+   const float* origin = &hub->tick_positions[3*r];
+   int first = 0;
+   if(c->transport != TRANSPORT_UDP) {
+      int flags = HUB_FRAME_POSE_ONLY, i;
+      for(i = 0; i < count; ++i)
+         if(hub->messages[hub->rows[i]].iov_len > 1) flags = 0;
+      hub_queue_shed(hub, c);
+      int m = hub_build_frame(hub, &c->pose, c->seq++, timestamp, origin, hub->rows, count);
+      if(!c->pose.since_key) flags |= HUB_FRAME_KEY;
+      return hub_send(hub, c, hub->iov, m, flags);
+   }
+   do {
+      size_t size = FRAME_PREFIX_MAX + FRAME_HEADER_MAX;
+      int last = first;
+      while(last < count && last - first < HUB_UDP_RECORDS &&
+            size + FRAME_RECORD_MAX + hub->messages[hub->rows[last]].iov_len <= UDP_MAX_DATAGRAM)
+         size += FRAME_RECORD_MAX + hub->messages[hub->rows[last++]].iov_len;
+      int m = hub_build_frame(hub, &c->pose, c->seq++, timestamp, origin, hub->rows + first, last - first);
+      hub_send(hub, c, hub->iov, m, 0);
+      first = last;
+   } while(first < count);
+   return 0;
+}
+
+static int64_t hub_monotonic_ns(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+Bytes of a serialized Buzz object (buzzobj_serialize: a big-endian uint16 type,
+then the value) if it is a nil, an int or a string, which can be keys. 0 for
+other objects, or if it does not end before end.
+*/
+static size_t hub_buzz_key_size(const uint8_t* p, const uint8_t* end) {
+   size_t size;
+   if(end - p < 2) return 0;
+   switch((p[0] << 8) | p[1]) {
+      case 0:  // nil
+         return 2;
+      case 1:  // int, int32
+         return end - p >= 6 ? 6 : 0;
+      case 3:  // string, uint16 length and the characters
+         if(end - p < 4) return 0;
+         size = 4 + (size_t)((p[2] << 8) | p[3]);
+         return (size_t)(end - p) >= size ? size : 0;
+   }
+   return 0;
+}
+
+/* Class of a Buzz message, and the key of the messages it supersedes */
+static int hub_classify(const uint8_t* msg, size_t size, hub_message_t* m) {
+   const uint8_t* end = msg + size;
+   size_t key_size;
+   m->key = msg;
+   m->key_size = 0;
+   switch(msg[0]) {
+      case BUZZ_MSG_BROADCAST:  // type, topic, value
+         key_size = hub_buzz_key_size(msg + 1, end);
+         if(key_size) m->key_size = 1 + key_size;
+         return COMMHUB_CLASS_BROADCAST;
+      case BUZZ_MSG_SWARM_LIST:  // The whole list of the swarms of the robot
+         m->key_size = 1;
+         return COMMHUB_CLASS_SWARM;
+      case BUZZ_MSG_SWARM_JOIN:
+      case BUZZ_MSG_SWARM_LEAVE:
+         return COMMHUB_CLASS_SWARM;
+      case BUZZ_MSG_VSTIG_PUT:  // type, uint16 stigmergy id, key, entry
+      case BUZZ_MSG_VSTIG_QUERY:
+         key_size = size >= 3 ? hub_buzz_key_size(msg + 3, end) : 0;
+         if(key_size) m->key_size = 3 + key_size;
+         return COMMHUB_CLASS_STIGMERGY;
+   }
+   return COMMHUB_CLASS_OTHER;
+}
+
+static uint32_t hub_key_hash(const uint8_t* key, size_t size) {
+   uint32_t h = 2166136261u;  // FNV-1a
+   size_t i;
+   for(i = 0; i < size; ++i)
+      h = (h ^ key[i]) * 16777619u;
+   return h;
+}
+
+static int hub_shape_reserve(commhub_t hub, int n) {
+   if(n <= hub->shape_capacity) return 0;
+   int capacity = hub->shape_capacity ? hub->shape_capacity : 64;
+   while(capacity < n) capacity *= 2;
+   hub_message_t* shape = (hub_message_t*)realloc(hub->shape, capacity * sizeof(hub_message_t));
+   if(shape) hub->shape = shape;
+   int* table = (int*)realloc(hub->shape_table, 2 * capacity * sizeof(int));
+   if(table) hub->shape_table = table;
+   if(!shape || !table) return -1;
+   hub->shape_capacity = capacity;
+   return 0;
+}
+
+/* Mark the messages a later message of the same robot supersedes. Return their number */
+static int hub_coalesce(commhub_t hub, int count) {
+   hub_message_t* m = hub->shape;
+   int size = 2, i, superseded = 0;
+   while(size < 2 * count) size <<= 1;
+   memset(hub->shape_table, 0, size * sizeof(int));
+   for(i = count - 1; i >= 0; --i) {
+      if(!m[i].key_size) continue;
+      unsigned h = m[i].hash & (size - 1);
+      int entry;
+      while((entry = hub->shape_table[h])) {
+         const hub_message_t* later = &m[entry - 1];
+         if(later->hash == m[i].hash && later->key_size == m[i].key_size &&
+            !memcmp(later->key, m[i].key, m[i].key_size)) {
+            m[i].superseded = 1;
+            ++superseded;
+            break;
+         }
+         h = (h + 1) & (size - 1);
+      }
+      if(!entry) hub->shape_table[h] = i + 1;
+   }
+   return superseded;
+}
+
+/*
+Move the num_msgs messages of c->frame to c->tick_frame, without the
+superseded ones, lane after lane. The messages over the budget of their lane go
+back to c->frame, for the next tick.
+Return the number of messages in c->tick_frame, or -1 on error.
+*/
+static int hub_shape(commhub_t hub, hub_client_t* c, int num_msgs) {
+   const uint8_t* p = c->frame.data;
+   const uint8_t* end = p + c->frame.size;
+   int count = 0, kept = 0, deferred = 0, shed = 0, lane, i;
+   if(hub_shape_reserve(hub, num_msgs)) return -1;
+   hub_message_t* m = hub->shape;
+   /* c->frame holds valid messages, without their terminator */
+   while(p < end && count < num_msgs) {
+      const uint8_t* start = p;
+      uint64_t len;
+      varint_get(&p, end, &len);
+      m[count].data = start;
+      m[count].size = (size_t)(p - start) + (size_t)len;
+      m[count].lane = hub->lane_of_class[hub_classify(p, (size_t)len, &m[count])];
+      m[count].superseded = 0;
+      if(hub->coalesce && m[count].key_size) m[count].hash = hub_key_hash(m[count].key, m[count].key_size);
+      else m[count].key_size = 0;
+      p += len;
+      ++count;
+   }
+   int superseded = hub->coalesce ? hub_coalesce(hub, count) : 0;
+   hub->deferred.size = 0;
+   for(lane = 0; lane < hub->n_lanes; ++lane) {
+      size_t budget = hub->lane_budget[lane], used = 0, held = 0;
+      for(i = 0; i < count; ++i) {
+         if(m[i].superseded || m[i].lane != lane) continue;
+         /* Once a message is held back, the later ones of its lane wait behind it */
+         if(held || (budget && used && used + m[i].size > budget)) {
+            if(held + m[i].size > COMMHUB_LANE_BACKLOG * budget) {
+               ++shed;
+               continue;
+            }
+            if(buffer_append(&hub->deferred, m[i].data, m[i].size)) return -1;
+            held += m[i].size;
+            ++deferred;
+            continue;
+         }
+         if(buffer_append(&c->tick_frame, m[i].data, m[i].size)) return -1;
+         used += m[i].size;
+         ++kept;
+      }
+   }
+   /* frame_since is left as it is: the held back messages are as old as it says */
+   c->frame.size = 0;
+   if(buffer_append(&c->frame, hub->deferred.data, hub->deferred.size)) return -1;
+   c->frame_msgs = deferred;
+   counter_add(&hub->counters.messages_coalesced, superseded);
+   counter_add(&hub->counters.messages_deferred, deferred);
+   counter_add(&hub->counters.messages_shed, shed);
+   return kept;
+}
+
+/*
+Start a tick: take the latest positions, and the messages received since the
+last tick, which new frames no longer touch. Return 1, or 0 if there is
+nothing to do until all the robots are connected and have a position.
+*/
+static int hub_tick_begin(commhub_t hub) {
+   static const uint8_t no_messages[1] = { 0 };
+   int n = hub->n_clients, r1;
+   if(hub->num_robots < n) return 0;
+   /* Latest pose of each robot, however far the writers are in their next update */
+   for(r1 = 0; r1 < n; ++r1) {
+      float pose[4];
+      if(hub_pose_read(&hub->poses[r1], pose)) return 0;
+      memcpy(&hub->tick_positions[3*r1], pose, 3 * sizeof(float));
+   }
+
+   if(hub_grid_neighbors(hub->grid, hub->tick_positions, n, hub->neighbor_distance,
+                         hub->offsets, &hub->tick_neighbors) < 0)
+      return 0;
+   uint64_t now = stats_now_ns();
+   int num_msgs = 0;
+   for(r1 = 0; r1 < n; ++r1) {
+      hub_client_t* c1 = hub->robots[r1].client;
+      hub->messages[r1].iov_base = (void*)no_messages;
+      hub->messages[r1].iov_len = 1;
+      if(!c1) continue;
+      if(c1->frame_msgs) hist_record(&hub->counters.forward_delay, now - c1->frame_since);
+      int frame_msgs = c1->frame_msgs;
+      c1->frame_msgs = 0;
+      if(frame_msgs && (hub->coalesce || hub->n_lanes > 1 || hub->lane_budget[0])) {
+         frame_msgs = hub_shape(hub, c1, frame_msgs);
+         if(frame_msgs < 0) {
+            /* Out of memory: the messages of this robot are lost */
+            c1->frame.size = c1->tick_frame.size = 0;
+            c1->frame_msgs = frame_msgs = 0;
+         }
+      }
+      else {
+         hub_buffer_t taken = c1->frame;
+         c1->frame = c1->tick_frame;
+         c1->tick_frame = taken;
+      }
+      num_msgs += frame_msgs;
+      if(c1->tick_frame.size && !buffer_append(&c1->tick_frame, no_messages, 1)) {
+         hub->messages[r1].iov_base = c1->tick_frame.data;
+         hub->messages[r1].iov_len = c1->tick_frame.size;
+      }
+   }
+   hist_record(&hub->counters.tick_messages, num_msgs);
+   hub->tick_timestamp = hub_now_us();
+   if(hub->capture) {
+      for(r1 = 0; r1 < n; ++r1)
+         hub->capture_ids[r1] = hub->robots[r1].id;
+      capture_tick(hub->capture, hub->capture_ticks++, hub->tick_timestamp, hub->capture_ids,
+                   hub->tick_positions, n);
+   }
+   hub->tick_bytes = 0;
+   hub->tick_next = 0;
+   hub->tick_listening = 0;
+   hub->tick_multicast = 0;
+   return 1;
+}
+
+/*
+Send to each robot, from the next row of the tick on, a frame with its own
+position, and a record for each robot in range with its messages.
+When every robot is in range of every other, the udp clients get the records
+from the multicast group instead.
+With a deadline, give way once it is past, after at least one robot. The
+others are served by the next calls, while the hub reads in between.
+Return 1 once every robot is served, or 0.
+*/
+static int hub_tick_serve(commhub_t hub, int64_t deadline_ns) {
+   int n = hub->n_clients, r1, r2, k;
+   int* neighbors = hub->tick_neighbors;
+   int multicast = hub->multicast_fd >= 0 && isinf(hub->neighbor_distance);
+   for(r2 = hub->tick_next; r2 < n; ++r2) {
+      if(deadline_ns && r2 > hub->tick_next && hub_monotonic_ns() >= deadline_ns) {
+         hub->tick_next = r2;
+         return 0;
+      }
+      hub_client_t* c2 = hub->robots[r2].client;
+      if(!c2) continue;
+      int count = 0;
+      if(multicast && c2->transport == TRANSPORT_UDP) {
+         hub->tick_multicast = 1;
+      }
+      else {
+         for(k = hub->offsets[r2]; k < hub->offsets[r2+1]; ++k) {
+            r1 = neighbors[k];
+            if(!hub->robots[r1].client) continue;
+            /* Messages that do not fit in any datagram are lost */
+            if(c2->transport == TRANSPORT_UDP && hub->messages[r1].iov_len > HUB_UDP_MESSAGES) {
+               counter_add(&hub->counters.records_dropped, 1);
+               continue;
+            }
+            hub->rows[count++] = r1;
+         }
+      }
+      if(hub_send_frames(hub, c2, r2, count, hub->tick_timestamp) == 0)
+         hub->tick_listening = 1;
+   }
+   hub->tick_next = n;
+   return 1;
+}
+
+/* Finish a tick once every robot is served. Return 0, or -1 if no robot is listening anymore */
+static int hub_tick_end(commhub_t hub) {
+   int n = hub->n_clients, r1;
+   /* Each robot in its own datagram, so the robots can skip their own */
+   for(r1 = 0; hub->tick_multicast && r1 < n; ++r1) {
+      if(!hub->robots[r1].client || hub->messages[r1].iov_len > HUB_UDP_MESSAGES) continue;
+      int m = hub_build_frame(hub, NULL, hub->multicast_seq++, hub->tick_timestamp,
+                              &hub->tick_positions[3*r1], &r1, 1);
+      for(int i = 0; i < m; ++i)
+         hub->tick_bytes += hub->iov[i].iov_len;
+      if(hub->capture) capture_frame(hub->capture, CAPTURE_MULTICAST, hub->iov, m);
+      if(udp_send_datagram(hub->multicast_fd, &hub->multicast, sizeof(hub->multicast), hub->iov, m) <= 0)
+         counter_add(&hub->counters.datagrams_dropped, 1);
+   }
+   hist_record(&hub->counters.tick_bytes, hub->tick_bytes);
+   counter_add(&hub->counters.bytes_out, hub->tick_bytes);
+   hub_client_t* c;
+   uint64_t slow = 0;
+   for(c = hub->clients; c; c = c->next) {
+      c->tick_frame.size = 0;
+      slow += !c->closed && c->out.size;
+   }
+   atomic_store_explicit(&hub->counters.slow_clients, slow, memory_order_relaxed);
+   if(hub->capture) capture_kick(hub->capture);
+   return hub->tick_listening ? 0 : -1;
+}
+
+/****************************************/
+/****************************************/
+
+static void hub_arm_timer(commhub_t hub) {
+   struct itimerspec its;
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_sec = (time_t)(hub->deadline_ns / 1000000000);
+   its.it_value.tv_nsec = (long)(hub->deadline_ns % 1000000000);
+   timerfd_settime(hub->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+The deadline of the automatic tick passed. Move it one period later, or past
+now if the hub is so late that whole ticks are missed, which are skipped: their
+messages go with the next tick.
+*/
+static void hub_next_deadline(commhub_t hub, int64_t now) {
+   int64_t late = now - hub->deadline_ns;
+   hub->deadline_ns += hub->period_ns;
+   uint64_t missed = 0;
+   if(hub->deadline_ns <= now) {
+      missed = (uint64_t)((now - hub->deadline_ns) / hub->period_ns) + 1;
+      hub->deadline_ns += (int64_t)missed * hub->period_ns;
+   }
+   hub_arm_timer(hub);
+   pthread_mutex_lock(&hub->mutex);
+   hub->stats.missed += missed;
+   if(late > 0 && (uint64_t)late / 1000 > hub->stats.max_late_us) hub->stats.max_late_us = (uint64_t)late / 1000;
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+/* Account for a tick, and report the overruns at most once a second */
+static void hub_tick_done(commhub_t hub, int split) {
+   int64_t now = hub_monotonic_ns();
+   uint64_t duration = (uint64_t)(now - hub->tick_start_ns) / 1000;
+   hist_record(&hub->counters.tick_time, (uint64_t)(now - hub->tick_start_ns));
+   pthread_mutex_lock(&hub->mutex);
+   hub->stats.ticks++;
+   hub->stats.split += split;
+   hub->stats.last_us = duration;
+   if(duration > hub->stats.max_us) hub->stats.max_us = duration;
+   if((hub->stats.split + hub->stats.missed != hub->stats.reported) && now - hub->report_ns >= 1000000000) {
+      hub->stats.reported = hub->stats.split + hub->stats.missed;
+      hub->report_ns = now;
+      hub_push_event_locked(hub, COMMHUB_EVENT_OVERRUN, 0, NULL);
+   }
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+/* Close everything. The hub is dead after this */
+static void hub_shutdown(commhub_t hub) {
+   hub_client_t* c;
+   for(c = hub->clients; c; c = c->next)
+      hub_close_client(hub, c, 0);
+   hub_reap(hub);
+   if(hub->listen_fd >= 0) close(hub->listen_fd);
+   if(hub->unix_fd >= 0) close(hub->unix_fd);
+   if(hub->udp_fd >= 0) close(hub->udp_fd);
+   hub->listen_fd = hub->unix_fd = hub->udp_fd = -1;
+   pthread_mutex_lock(&hub->mutex);
+   hub->alive = 0;
+   hub->forward_served = hub->forward_requested;
+   hub_push_event_locked(hub, COMMHUB_EVENT_STOPPED, 0, NULL);
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+static void hub_handle(commhub_t hub, const struct epoll_event* event, int* tick) {
+   hub_tag_t* tag = (hub_tag_t*)event->data.ptr;
+   hub_client_t* c = tag->client;
+   uint64_t value;
+   switch(tag->kind) {
+      case TAG_LISTEN:
+         hub_accept(hub, hub->listen_fd, TRANSPORT_TCP);
+         break;
+      case TAG_UNIX:
+         hub_accept(hub, hub->unix_fd, TRANSPORT_SHM);
+         break;
+      case TAG_UDP:
+         hub_udp_read(hub);
+         break;
+      case TAG_WAKE:
+         if(read(hub->wake_fd, &value, sizeof(value)) < 0) break;
+         break;
+      case TAG_TIMER:
+         if(read(hub->timer_fd, &value, sizeof(value)) == sizeof(value)) {
+            hub_next_deadline(hub, hub_monotonic_ns());
+            *tick = 1;
+         }
+         break;
+      case TAG_CLIENT:
+         if(!c->closed && (event->events & EPOLLIN)) hub_read(hub, c);
+         if(!c->closed && (event->events & EPOLLOUT)) hub_flush(hub, c);
+         if(!c->closed && (event->events & (EPOLLERR | EPOLLHUP)) && !(event->events & EPOLLIN))
+            hub_close_client(hub, c, 1);
+         break;
+      case TAG_DOORBELL:
+         if(!c->closed) hub_read_ring(hub, c);
+         break;
+   }
+}
+
+static void* hub_loop(void* arg) {
+   commhub_t hub = (commhub_t)arg;
+   struct epoll_event events[HUB_MAX_EVENTS];
+   uint64_t served = 0;
+   int i;
+   if(hub->cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(hub->cpu, &set);
+      if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+         fprintf(stderr, "CommHub: cannot pin the hub thread to core %d\n", hub->cpu);
+   }
+   while(1) {
+      /* Rings are not watched for room: retry soon while some are full */
+      int timeout = ((hub->period == 0 && hub->all_connected) || hub->tick_open) ? 0 : hub->shm_backlog ? 1 : -1;
+      int n = epoll_wait(hub->epoll_fd, events, HUB_MAX_EVENTS, timeout);
+      if(n < 0 && errno != EINTR) break;
+      int tick = hub->period == 0;
+      for(i = 0; i < n; ++i)
+         hub_handle(hub, &events[i], &tick);
+      if(hub->shm_backlog) {
+         hub_client_t* c;
+         for(c = hub->clients; c; c = c->next)
+            if(!c->closed && c->transport == TRANSPORT_SHM && c->want_write) hub_flush(hub, c);
+      }
+      pthread_mutex_lock(&hub->mutex);
+      int stop = hub->stop;
+      uint64_t requested = hub->forward_requested;
+      pthread_mutex_unlock(&hub->mutex);
+      if(stop) break;
+      int due = tick || requested != served;
+      /*
+      A tick that gave way goes on where it stopped. It is finished in one go
+      before the next tick starts, so that no robot is late by more than a period.
+      */
+      if(hub->tick_open) {
+         if(hub_tick_serve(hub, due ? 0 : hub->deadline_ns)) {
+            hub->tick_open = 0;
+            hub_tick_done(hub, 1);
+            if(hub_tick_end(hub)) break;  // Nobody is listening anymore
+         }
+      }
+      if(due && !hub->tick_open) {
+         hub->tick_start_ns = hub_monotonic_ns();
+         if(hub_tick_begin(hub)) {
+            /* Only the automatic ticks have a deadline */
+            int64_t deadline = (tick && requested == served && hub->period > 0) ? hub->deadline_ns : 0;
+            hub->tick_open = !hub_tick_serve(hub, deadline);
+            if(!hub->tick_open) {
+               hub_tick_done(hub, 0);
+               if(hub_tick_end(hub)) break;
+            }
+         }
+      }
+      if(requested != served && !hub->tick_open) {
+         served = requested;
+         pthread_mutex_lock(&hub->mutex);
+         hub->forward_served = served;
+         pthread_cond_broadcast(&hub->cond);
+         pthread_mutex_unlock(&hub->mutex);
+      }
+      /* The open tick still refers to the messages of the closed clients */
+      if(!hub->tick_open) hub_reap(hub);
+   }
+   hub_shutdown(hub);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+static int hub_listen(commhub_t hub, const char* host, int port, int transports) {
+   struct addrinfo hints, *res;
+   char service[16];
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   snprintf(service, sizeof(service), "%d", port);
+   if(getaddrinfo(host, service, &hints, &res)) {
+      errno = EADDRNOTAVAIL;
+      return -1;
+   }
+   int status;
+   hub->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   status = hub->listen_fd < 0 ||
+            bind(hub->listen_fd, res->ai_addr, res->ai_addrlen) ||
+            listen(hub->listen_fd, hub->n_clients);
+   if(!status && (transports & TRANSPORT_UDP)) {
+      int one = 1;
+      hub->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      status = hub->udp_fd < 0 ||
+               setsockopt(hub->udp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+               bind(hub->udp_fd, res->ai_addr, res->ai_addrlen);
+   }
+   freeaddrinfo(res);
+   if(!status && (transports & TRANSPORT_SHM)) {
+      struct sockaddr_un addr;
+      socklen_t addr_len = shm_socket_address(port, &addr);
+      hub->unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      status = hub->unix_fd < 0 ||
+               bind(hub->unix_fd, (struct sockaddr*)&addr, addr_len) ||
+               listen(hub->unix_fd, hub->n_clients);
+   }
+   return status ? -1 : 0;
+}
+
+commhub_t commhub_new(const char* host,
+                      int port,
+                      int n_clients,
+                      float neighbor_distance,
+                      float resolution,
+                      int transports,
+                      const char* multicast_group) {
+   if(n_clients <= 0) {
+      errno = EINVAL;
+      return NULL;
+   }
+   commhub_t hub = (commhub_t)calloc(1, sizeof(struct commhub_s));
+   if(!hub) return NULL;
+   hub->listen_fd = hub->unix_fd = hub->udp_fd = hub->multicast_fd = -1;
+   hub->epoll_fd = hub->wake_fd = hub->timer_fd = -1;
+   hub->listen_tag.kind = TAG_LISTEN;
+   hub->unix_tag.kind = TAG_UNIX;
+   hub->udp_tag.kind = TAG_UDP;
+   hub->wake_tag.kind = TAG_WAKE;
+   hub->timer_tag.kind = TAG_TIMER;
+   hub->n_clients = n_clients;
+   hub->n_lanes = 1;
+   hub->neighbor_distance = neighbor_distance;
+   if(!(resolution > 0) || isinf(resolution))
+      resolution = isfinite(neighbor_distance) && neighbor_distance > 0 ? neighbor_distance / 8192 : 1e-3f;
+   hub->resolution = resolution;
+   pthread_mutex_init(&hub->mutex, NULL);
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&hub->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   if(multicast_group && multicast_group[0]) {
+      hub->multicast.sin_family = AF_INET;
+      hub->multicast.sin_port = htons(port + 1);
+      if(!(transports & TRANSPORT_UDP) || inet_pton(AF_INET, multicast_group, &hub->multicast.sin_addr) != 1) {
+         commhub_destroy(hub);
+         errno = EINVAL;
+         return NULL;
+      }
+      hub->multicast_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if(hub->multicast_fd < 0) {
+         int error = errno;
+         commhub_destroy(hub);
+         errno = error;
+         return NULL;
+      }
+   }
+   int table_size = 2;
+   while(table_size < 2 * n_clients) table_size <<= 1;
+   hub->id_table_mask = table_size - 1;
+   hub->id_table = (atomic_int*)calloc(table_size, sizeof(atomic_int));
+   hub->robots = (hub_robot_t*)calloc(n_clients, sizeof(hub_robot_t));
+   hub->queues = (hub_queue_counters_t*)calloc(n_clients, sizeof(hub_queue_counters_t));
+   hub->poses = (hub_pose_t*)calloc(n_clients, sizeof(hub_pose_t));
+   hub->tick_positions = (float*)malloc(3 * n_clients * sizeof(float));
+   hub->messages = (struct iovec*)malloc(n_clients * sizeof(struct iovec));
+   hub->rows = (int*)malloc(n_clients * sizeof(int));
+   hub->offsets = (int*)malloc((n_clients + 1) * sizeof(int));
+   hub->iov = (struct iovec*)malloc((2 * n_clients + 2) * sizeof(struct iovec));
+   hub->scratch = (uint8_t*)malloc(FRAME_PREFIX_MAX + FRAME_HEADER_MAX + n_clients * FRAME_RECORD_MAX);
+   hub->datagram = (transports & TRANSPORT_UDP) ? (uint8_t*)malloc(UDP_MAX_DATAGRAM) : NULL;
+   hub->grid = hub_grid_new();
+   if(!hub->id_table || !hub->robots || !hub->queues || !hub->poses ||
+      !hub->tick_positions || !hub->messages || !hub->rows || !hub->offsets || !hub->iov ||
+      !hub->scratch || !hub->grid ||
+      ((transports & TRANSPORT_UDP) && !hub->datagram)) {
+      commhub_destroy(hub);
+      errno = ENOMEM;
+      return NULL;
+   }
+   if(hub_listen(hub, host, port, transports) ||
+      (hub->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (hub->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+      hub_watch(hub, hub->listen_fd, &hub->listen_tag) ||
+      (hub->unix_fd >= 0 && hub_watch(hub, hub->unix_fd, &hub->unix_tag)) ||
+      (hub->udp_fd >= 0 && hub_watch(hub, hub->udp_fd, &hub->udp_tag)) ||
+      hub_watch(hub, hub->wake_fd, &hub->wake_tag)) {
+      int error = errno;
+      commhub_destroy(hub);
+      errno = error;
+      return NULL;
+   }
+   hub->alive = 1;
+   return hub;
+}
+
+int commhub_start(commhub_t hub, double period, int cpu) {
+   if(hub->started || !hub->alive) return -1;
+   hub->period = period;
+   hub->cpu = cpu;
+   if(period > 0) {
+      hub->period_ns = (int64_t)(period * 1e9);
+      if(hub->period_ns < 1) hub->period_ns = 1;
+      hub->deadline_ns = hub_monotonic_ns() + hub->period_ns;
+      hub->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if(hub->timer_fd < 0 || hub_watch(hub, hub->timer_fd, &hub->timer_tag))
+         return -1;
+      hub_arm_timer(hub);
+   }
+   if(pthread_create(&hub->thread, NULL, hub_loop, hub)) return -1;
+   hub->started = 1;
+   return 0;
+}
+
+int commhub_set_coalescing(commhub_t hub, int on) {
+   if(hub->started) {
+      errno = EBUSY;
+      return -1;
+   }
+   hub->coalesce = on != 0;
+   return 0;
+}
+
+int commhub_set_lanes(commhub_t hub, int n_lanes, const int* lane_of_class, const size_t* budgets) {
+   int i;
+   if(hub->started) {
+      errno = EBUSY;
+      return -1;
+   }
+   if(n_lanes < 1 || n_lanes > COMMHUB_NUM_CLASSES) {
+      errno = EINVAL;
+      return -1;
+   }
+   for(i = 0; i < COMMHUB_NUM_CLASSES; ++i) {
+      if(lane_of_class[i] < 0 || lane_of_class[i] >= n_lanes) {
+         errno = EINVAL;
+         return -1;
+      }
+   }
+   hub->n_lanes = n_lanes;
+   for(i = 0; i < COMMHUB_NUM_CLASSES; ++i) {
+      hub->lane_of_class[i] = lane_of_class[i];
+      hub->lane_budget[i] = i < n_lanes ? budgets[i] : 0;
+   }
+   return 0;
+}
+
+int commhub_set_high_water(commhub_t hub, size_t high_water) {
+   if(hub->started) {
+      errno = EBUSY;
+      return -1;
+   }
+   hub->high_water = high_water;
+   return 0;
+}
+
+int commhub_set_capture(commhub_t hub, const char* path, size_t ring_size) {
+   if(hub->started || hub->capture) {
+      errno = EBUSY;
+      return -1;
+   }
+   hub->capture_ids = (uint32_t*)malloc(hub->n_clients * sizeof(uint32_t));
+   if(!hub->capture_ids) {
+      errno = ENOMEM;
+      return -1;
+   }
+   hub->capture = capture_open(path, ring_size);
+   if(!hub->capture) {
+      int error = errno;
+      free(hub->capture_ids);
+      hub->capture_ids = NULL;
+      errno = error;
+      return -1;
+   }
+   return 0;
+}
+
+static void hub_wake(commhub_t hub) {
+   uint64_t one = 1;
+   if(write(hub->wake_fd, &one, sizeof(one)) < 0) return;  // Only fails when the counter is already high
+}
+
+void commhub_forward(commhub_t hub) {
+   pthread_mutex_lock(&hub->mutex);
+   if(!hub->started || !hub->alive) {
+      pthread_mutex_unlock(&hub->mutex);
+      return;
+   }
+   uint64_t target = ++hub->forward_requested;
+   hub_wake(hub);
+   while(hub->forward_served < target && hub->alive)
+      pthread_cond_wait(&hub->cond, &hub->mutex);
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+int commhub_update_position(commhub_t hub, uint32_t robot_id, float x, float y, float z) {
+   int row = hub_find_row(hub, robot_id);
+   if(row < 0) return -1;
+   float xyz[3] = { x, y, z };
+   hub_pose_write(&hub->poses[row], xyz, NULL);
+   if(hub->capture) capture_pose(hub->capture, robot_id, xyz, NULL);
+   return 0;
+}
+
+int commhub_update_pose(commhub_t hub, uint32_t robot_id, const float* position, const float* quaternion) {
+   int row = hub_find_row(hub, robot_id);
+   if(row < 0) return -1;
+   float yaw = quaternion_yaw(quaternion);
+   hub_pose_write(&hub->poses[row], position, &yaw);
+   if(hub->capture) capture_pose(hub->capture, robot_id, position, &yaw);
+   return 0;
+}
+
+int commhub_get_pose(commhub_t hub, uint32_t robot_id, float* pose) {
+   int row = hub_find_row(hub, robot_id);
+   if(row < 0) return -1;
+   return hub_pose_read(&hub->poses[row], pose);
+}
+
+int commhub_next_event(commhub_t hub, commhub_event_t* ev, int timeout_ms) {
+   struct timespec deadline;
+   if(timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+      if(deadline.tv_nsec >= 1000000000) {
+         deadline.tv_sec += 1;
+         deadline.tv_nsec -= 1000000000;
+      }
+   }
+   pthread_mutex_lock(&hub->mutex);
+   while(!hub->events_count) {
+      if(hub->events_closed ||
+         (timeout_ms < 0 ? pthread_cond_wait(&hub->cond, &hub->mutex)
+                         : pthread_cond_timedwait(&hub->cond, &hub->mutex, &deadline)) == ETIMEDOUT) {
+         int status = hub->events_closed ? -1 : 0;
+         pthread_mutex_unlock(&hub->mutex);
+         return status;
+      }
+   }
+   *ev = hub->events[hub->events_head];
+   hub->events_head = (hub->events_head + 1) % hub->events_capacity;
+   --hub->events_count;
+   if(ev->type == COMMHUB_EVENT_STOPPED) hub->events_closed = 1;
+   pthread_mutex_unlock(&hub->mutex);
+   return 1;
+}
+
+static uint64_t hub_counter(const atomic_uint_fast64_t* counter) {
+   return atomic_load_explicit((atomic_uint_fast64_t*)counter, memory_order_relaxed);
+}
+
+void commhub_stats(commhub_t hub, commhub_stats_t* stats) {
+   stats->frames_in = hub_counter(&hub->counters.frames_in);
+   stats->messages_in = hub_counter(&hub->counters.messages_in);
+   stats->bytes_in = hub_counter(&hub->counters.bytes_in);
+   stats->bytes_out = hub_counter(&hub->counters.bytes_out);
+   stats->datagrams_dropped = hub_counter(&hub->counters.datagrams_dropped);
+   stats->records_dropped = hub_counter(&hub->counters.records_dropped);
+   stats->disconnects = hub_counter(&hub->counters.disconnects);
+   stats->messages_coalesced = hub_counter(&hub->counters.messages_coalesced);
+   stats->messages_deferred = hub_counter(&hub->counters.messages_deferred);
+   stats->messages_shed = hub_counter(&hub->counters.messages_shed);
+   stats->frames_shed = hub_counter(&hub->counters.frames_shed);
+   stats->slow_clients = hub_counter(&hub->counters.slow_clients);
+   hist_summarize(&hub->counters.forward_delay, &stats->forward_delay);
+   hist_summarize(&hub->counters.tick_time, &stats->tick_time);
+   hist_summarize(&hub->counters.tick_bytes, &stats->tick_bytes);
+   hist_summarize(&hub->counters.tick_messages, &stats->tick_messages);
+   capture_stats_t capture;
+   memset(&capture, 0, sizeof(capture));
+   if(hub->capture) capture_stats(hub->capture, &capture);
+   stats->capture_records = capture.records;
+   stats->capture_dropped = capture.dropped;
+}
+
+int commhub_queue_stats(commhub_t hub, uint32_t robot_id, commhub_queue_stats_t* stats) {
+   int row = hub_find_row(hub, robot_id);
+   if(row < 0) return -1;
+   hub_queue_counters_t* q = &hub->queues[row];
+   stats->queued_bytes = hub_counter(&q->queued_bytes);
+   stats->max_queued_bytes = hub_counter(&q->max_queued_bytes);
+   stats->frames_queued = hub_counter(&q->frames_queued);
+   stats->frames_shed = hub_counter(&q->frames_shed);
+   stats->bytes_shed = hub_counter(&q->bytes_shed);
+   return 0;
+}
+
+void commhub_tick_stats(commhub_t hub, commhub_tick_stats_t* stats) {
+   pthread_mutex_lock(&hub->mutex);
+   *stats = hub->stats;
+   pthread_mutex_unlock(&hub->mutex);
+}
+
+int commhub_is_alive(commhub_t hub) {
+   pthread_mutex_lock(&hub->mutex);
+   int alive = hub->alive;
+   pthread_mutex_unlock(&hub->mutex);
+   return alive;
+}
+
+void commhub_stop(commhub_t hub) {
+   if(hub->started) {
+      pthread_mutex_lock(&hub->mutex);
+      hub->stop = 1;
+      hub_wake(hub);
+      pthread_mutex_unlock(&hub->mutex);
+      pthread_join(hub->thread, NULL);
+      hub->started = 0;
+   }
+   else if(hub->alive) {
+      hub_shutdown(hub);
+   }
+   /* The log is complete once the hub stopped. The capture itself lives on for the late pose updates */
+   if(hub->capture && capture_close(hub->capture))
+      fprintf(stderr, "CommHub: the capture is incomplete: %s\n", strerror(errno));
+}
+
+void commhub_destroy(commhub_t hub) {
+   if(!hub) return;
+   commhub_stop(hub);
+   if(hub->listen_fd >= 0) close(hub->listen_fd);
+   if(hub->unix_fd >= 0) close(hub->unix_fd);
+   if(hub->udp_fd >= 0) close(hub->udp_fd);
+   if(hub->multicast_fd >= 0) close(hub->multicast_fd);
+   if(hub->epoll_fd >= 0) close(hub->epoll_fd);
+   if(hub->wake_fd >= 0) close(hub->wake_fd);
+   if(hub->timer_fd >= 0) close(hub->timer_fd);
+   free(hub->id_table);
+   free(hub->robots);
+   free(hub->queues);
+   free(hub->poses);
+   free(hub->tick_positions);
+   free(hub->messages);
+   free(hub->rows);
+   free(hub->offsets);
+   free(hub->iov);
+   free(hub->scratch);
+   free(hub->datagram);
+   hub_grid_destroy(hub->grid);
+   free(hub->shape);
+   free(hub->shape_table);
+   buffer_free(&hub->deferred);
+   capture_destroy(hub->capture);
+   free(hub->capture_ids);
+   free(hub->events);
+   pthread_mutex_destroy(&hub->mutex);
+   pthread_cond_destroy(&hub->cond);
+   free(hub);
+}
@@ -0,0 +1,233 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats_utility.h"
+
+#ifndef COMMHUB_UTILITY_H
+#define COMMHUB_UTILITY_H
+
+/*
+Uniform grid over the robot positions, with cells as wide as the communication
+range, used to find the robots in range of each other in one pass.
+The grid keeps its buffers from one call to the next.
+*/
+typedef struct hub_grid_s* hub_grid_t;
+
+extern hub_grid_t hub_grid_new(void);
+extern void hub_grid_destroy(hub_grid_t grid);
+
+/*
+Find, for each of the n positions of xyz (x, y, z triplets), the other positions
+closer than radius.
+offsets must hold n + 1 ints. The neighbors of position i are written in
+(*neighbors)[offsets[i]] to (*neighbors)[offsets[i + 1] - 1], in a buffer that
+belongs to the grid and stays valid until the next call.
+Return the total number of neighbors, or -1 on error.
+*/
+extern int hub_grid_neighbors(hub_grid_t grid,
+                              const float* xyz,
+                              int n,
+                              float radius,
+                              int* offsets,
+                              int** neighbors);
+
+/*
+Communication hub serving the BuzzVMs from one native thread.
+The thread waits on all the sockets at once (epoll), decodes the frames as
+they come in (see packet_utility.h), and forwards the messages of each robot
+to the robots in range at each forward tick. Only position updates and
+lifecycle events cross over to the caller. The positions are read by the
+ticks without locks, so that they can come straight from a motion capture
+thread.
+*/
+typedef struct commhub_s* commhub_t;
+
+typedef enum {
+   COMMHUB_EVENT_CONNECTED = 0,   // A robot finished its handshake
+   COMMHUB_EVENT_DISCONNECTED,    // The connection of a robot broke or sent garbage
+   COMMHUB_EVENT_ALL_CONNECTED,   // All the expected robots connected once
+   COMMHUB_EVENT_STOPPED,         // The hub thread is done, last event
+   COMMHUB_EVENT_OVERRUN          // Ticks missed their deadline, at most one event a second
+} commhub_event_type_e;
+
+typedef struct commhub_event_s {
+   int      type;
+   uint32_t robot_id;
+   char     address[64];   // Peer of the connection, for COMMHUB_EVENT_CONNECTED
+} commhub_event_t;
+
+/*
+Bind and listen on host:port for n_clients robots.
+transports is TRANSPORT_TCP, TRANSPORT_SHM and TRANSPORT_UDP or'ed together
+(see transport_utility.h). TCP is always served.
+resolution is the step of the positions sent to the robots. With 0, it is
+neighbor_distance / 8192, or 1e-3 for an infinite neighbor_distance.
+multicast_group is the IPv4 multicast address for the udp clients, or NULL.
+Return NULL and set errno on error.
+*/
+extern commhub_t commhub_new(const char* host,
+                             int port,
+                             int n_clients,
+                             float neighbor_distance,
+                             float resolution,
+                             int transports,
+                             const char* multicast_group);
+
+/*
+Start the hub thread, pinned to the core cpu unless it is negative.
+With period > 0, messages are forwarded at absolute deadlines period seconds
+apart, with period == 0 as often as possible, and with period < 0 only on
+commhub_forward.
+A tick still running at the next deadline gives way to the reads, and serves
+the robots it did not reach right before the next tick. When the hub is late
+by whole periods, the missed ticks are skipped, and their messages go with
+the next tick.
+Return 0 on success.
+*/
+extern int commhub_start(commhub_t hub, double period, int cpu);
+
+/*
+Classes of the Buzz messages, from their first byte (the type of buzzmsg.h).
+swarm: the lists of swarms a robot belongs to, joins and leaves
+stigmergy: puts and queries of the virtual stigmergies
+broadcast: neighbors.broadcast
+*/
+typedef enum {
+   COMMHUB_CLASS_SWARM = 0,
+   COMMHUB_CLASS_STIGMERGY,
+   COMMHUB_CLASS_BROADCAST,
+   COMMHUB_CLASS_OTHER,
+   COMMHUB_NUM_CLASSES
+} commhub_class_e;
+
+/*
+With on, each tick forwards only the latest of the messages of a robot that
+supersede each other: the broadcasts of one topic, the puts of one key of a
+stigmergy, the queries of one key, and the swarm lists.
+Call before commhub_start. Return 0, or -1 and set errno.
+*/
+extern int commhub_set_coalescing(commhub_t hub, int on);
+
+/*
+Forward the messages of each robot lane after lane, in the order of the lanes,
+instead of in the order they were sent. lane_of_class gives the lane of each
+class of commhub_class_e, from 0 to n_lanes - 1. budgets gives the most bytes
+of a robot each lane forwards per tick, or 0 for no limit. A lane always
+forwards at least one message. The messages over budget are forwarded by the
+next ticks, and dropped once a lane holds back more than COMMHUB_LANE_BACKLOG
+times its budget.
+Call before commhub_start. Return 0, or -1 and set errno.
+*/
+#define COMMHUB_LANE_BACKLOG 8
+extern int commhub_set_lanes(commhub_t hub, int n_lanes, const int* lane_of_class, const size_t* budgets);
+
+/*
+Bound the bytes waiting for the socket or the ring of each tcp or shm robot.
+Before a frame is sent to a robot with more than high_water bytes waiting, the
+frames of its queue that carry no messages are dropped first, as the new frame
+has a newer position, then the oldest ones, until high_water bytes are left.
+A frame the socket took a part of is never dropped. With 0, the queues grow
+without limit.
+Call before commhub_start. Return 0, or -1 and set errno.
+*/
+extern int commhub_set_high_water(commhub_t hub, size_t high_water);
+
+/*
+Capture every frame sent to the robots, every tick and every pose update in
+the log at path (see capture_utility.h). The hub thread hands its records to
+the writer through a ring of ring_size bytes (0 for the default), and drops
+them when the ring is full rather than wait. The log is complete once the hub
+is stopped.
+Call before commhub_start. Return 0, or -1 and set errno.
+*/
+extern int commhub_set_capture(commhub_t hub, const char* path, size_t ring_size);
+
+/*
+Forward the messages received since the last tick, and wait until it is done.
+Does nothing until all the robots are connected and have a position.
+*/
+extern void commhub_forward(commhub_t hub);
+
+/*
+Set the position of a robot, sent with the next tick.
+Return 0, or -1 if no robot with this id connected.
+*/
+extern int commhub_update_position(commhub_t hub, uint32_t robot_id, float x, float y, float z);
+
+/*
+Set the pose of a robot from a motion capture frame: its position (x, y, z) and
+the quaternion (x, y, z, w) of its orientation, of which the yaw about z is kept.
+The update and commhub_update_position never wait for the hub, or for each other.
+Return 0, or -1 if no robot with this id connected.
+*/
+extern int commhub_update_pose(commhub_t hub, uint32_t robot_id, const float* position, const float* quaternion);
+
+/*
+Get the last pose set for a robot: x, y, z, and the yaw in radians (0 until
+commhub_update_pose is called).
+Return 0, or -1 if the robot did not connect or has no position yet.
+*/
+extern int commhub_get_pose(commhub_t hub, uint32_t robot_id, float* pose);
+
+/*
+Wait for the next lifecycle event for up to timeout_ms milliseconds (forever
+if negative).
+Return 1 and fill ev, 0 on timeout, or -1 once the last event was taken.
+*/
+extern int commhub_next_event(commhub_t hub, commhub_event_t* ev, int timeout_ms);
+
+typedef struct commhub_tick_stats_s {
+   uint64_t ticks;        // Ticks served
+   uint64_t split;        // Ticks that ran past the next deadline, and were finished later
+   uint64_t missed;       // Deadlines skipped because the hub was late by whole periods
+   uint64_t last_us;      // Duration of the last tick, split ones included
+   uint64_t max_us;
+   uint64_t max_late_us;  // Most time between a deadline and the hub noticing it
+   uint64_t reported;     // split + missed at the last COMMHUB_EVENT_OVERRUN
+} commhub_tick_stats_t;
+
+extern void commhub_tick_stats(commhub_t hub, commhub_tick_stats_t* stats);
+
+/* Counters since the hub was created, read from any thread without stopping the hub */
+typedef struct commhub_stats_s {
+   uint64_t       frames_in;          // Frames with messages from the robots
+   uint64_t       messages_in;
+   uint64_t       bytes_in;           // Of the messages
+   uint64_t       bytes_out;          // Of the frames sent to the robots, multicast included
+   uint64_t       datagrams_dropped;  // Not taken by a full socket buffer
+   uint64_t       records_dropped;    // Messages of a robot too big for a datagram, once per udp receiver
+   uint64_t       disconnects;        // Connections that broke or sent garbage
+   uint64_t       messages_coalesced; // Not forwarded, superseded by a later message (commhub_set_coalescing)
+   uint64_t       messages_deferred;  // Held back for the next tick by the budget of their lane, every time
+   uint64_t       messages_shed;      // Dropped by a lane holding back too much already
+   uint64_t       frames_shed;        // Dropped from the queue of a slow robot (commhub_set_high_water)
+   uint64_t       slow_clients;       // Robots with bytes waiting for their socket at the end of the last tick
+   uint64_t       capture_records;    // Written to the log (commhub_set_capture)
+   uint64_t       capture_dropped;    // Not captured, by a full ring or a failed write
+   hist_summary_t forward_delay;      // Nanoseconds from the first frame of a robot to the tick forwarding it
+   hist_summary_t tick_time;          // Nanoseconds per tick, split ones included
+   hist_summary_t tick_bytes;         // Sent per tick
+   hist_summary_t tick_messages;      // Forwarded per tick, each counted once whatever its receivers
+} commhub_stats_t;
+
+extern void commhub_stats(commhub_t hub, commhub_stats_t* stats);
+
+/* Queue of the frames waiting to be sent to one robot, read from any thread without stopping the hub */
+typedef struct commhub_queue_stats_s {
+   uint64_t queued_bytes;      // Waiting now
+   uint64_t max_queued_bytes;
+   uint64_t frames_queued;     // Frames that had to wait for room, since the hub was created
+   uint64_t frames_shed;       // Dropped over the high-water mark
+   uint64_t bytes_shed;
+} commhub_queue_stats_t;
+
+/* Return 0, or -1 if no robot with this id connected */
+extern int commhub_queue_stats(commhub_t hub, uint32_t robot_id, commhub_queue_stats_t* stats);
+
+extern int commhub_is_alive(commhub_t hub);
+
+/* Close all the connections and stop the hub thread */
+extern void commhub_stop(commhub_t hub);
+extern void commhub_destroy(commhub_t hub);
+
+#endif
@@ -0,0 +1,392 @@
+#include "geometry_utility.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEO_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define GEO_NEON 1
+#include <arm_neon.h>
+#endif
+
+/****************************************/
+/****************************************/
+
+/*
+atan2 without libm: the octant is found from the signs and the order of |x| and
+|y|, and the arctangent of t = min / max in [0, 1] is reduced to [0, tan(pi/8)]
+with atan(t) = pi/4 + atan((t - 1) / (t + 1)), where the polynomial of the
+atanf of Cephes holds.
+*/
+#define GEO_TAN_PI_8 0.414213562373095f
+#define GEO_PI_4     0.785398163397448f
+#define GEO_PI_2     1.570796326794897f
+#define GEO_PI       3.141592653589793f
+#define GEO_P0       8.05374449538e-2f
+#define GEO_P1       -1.38776856032e-1f
+#define GEO_P2       1.99777106478e-1f
+#define GEO_P3       -3.33329491539e-1f
+
+/* Widest batch of a kernel, for the padded last batch */
+#define GEO_MAX_WIDTH 8
+
+typedef struct geo_kernels_s {
+   const char* name;
+   int         width;   // n is a multiple of it for each kernel
+   void (*distances2)(const float* p, const float* x, const float* y, const float* z, int n, float* out);
+   int  (*in_range)(const float* p, const float* x, const float* y, const float* z, int n, float radius2,
+                    uint8_t* mask);
+   void (*polar)(const float* origin, const float* x, const float* y, const float* z, int n,
+                 float* distance, float* azimuth, float* elevation);
+   void (*atan2)(const float* y, const float* x, int n, float* out);
+} geo_kernels_t;
+
+/****************************************/
+/****************************************/
+
+static float scalar_atan2_one(float y, float x) {
+   float ax = fabsf(x), ay = fabsf(y);
+   float mx = ax > ay ? ax : ay;
+   float mn = ax > ay ? ay : ax;
+   int big = mn > mx * GEO_TAN_PI_8;
+   float num = big ? mn - mx : mn;
+   float den = big ? mn + mx : mx;
+   if(den < FLT_MIN) den = FLT_MIN;
+   float t = num / den;
+   float z = t * t;
+   float r = (((GEO_P0 * z + GEO_P1) * z + GEO_P2) * z + GEO_P3) * z * t + t;
+   if(big) r += GEO_PI_4;
+   if(ay > ax) r = GEO_PI_2 - r;
+   if(x < 0) r = GEO_PI - r;
+   return copysignf(r, y);
+}
+
+static void scalar_distances2(const float* p, const float* x, const float* y, const float* z, int n, float* out) {
+   int i;
+   for(i = 0; i < n; ++i) {
+      float dx = x[i] - p[0], dy = y[i] - p[1], dz = z[i] - p[2];
+      out[i] = dx*dx + dy*dy + dz*dz;
+   }
+}
+
+static int scalar_in_range(const float* p, const float* x, const float* y, const float* z, int n, float radius2,
+                           uint8_t* mask) {
+   int i, count = 0;
+   for(i = 0; i < n; ++i) {
+      float dx = x[i] - p[0], dy = y[i] - p[1], dz = z[i] - p[2];
+      mask[i] = dx*dx + dy*dy + dz*dz < radius2;
+      count += mask[i];
+   }
+   return count;
+}
+
+static void scalar_polar(const float* origin, const float* x, const float* y, const float* z, int n,
+                         float* distance, float* azimuth, float* elevation) {
+   int i;
+   for(i = 0; i < n; ++i) {
+      float dx = x[i] - origin[0], dy = y[i] - origin[1], dz = z[i] - origin[2];
+      float planar2 = dx*dx + dy*dy;
+      distance[i] = sqrtf(planar2 + dz*dz);
+      azimuth[i] = scalar_atan2_one(-dy, dx);
+      elevation[i] = scalar_atan2_one(dz, sqrtf(planar2));
+   }
+}
+
+static void scalar_atan2(const float* y, const float* x, int n, float* out) {
+   int i;
+   for(i = 0; i < n; ++i)
+      out[i] = scalar_atan2_one(y[i], x[i]);
+}
+
+static const geo_kernels_t scalar_kernels = {
+   "scalar", 1, scalar_distances2, scalar_in_range, scalar_polar, scalar_atan2
+};
+
+/****************************************/
+/****************************************/
+
+#ifdef GEO_AVX2
+
+#define GEO_AVX2_TARGET __attribute__((target("avx2,fma")))
+
+GEO_AVX2_TARGET static inline __m256 avx2_atan2_one(__m256 y, __m256 x) {
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   __m256 ax = _mm256_andnot_ps(sign, x), ay = _mm256_andnot_ps(sign, y);
+   __m256 mx = _mm256_max_ps(ax, ay), mn = _mm256_min_ps(ax, ay);
+   __m256 big = _mm256_cmp_ps(mn, _mm256_mul_ps(mx, _mm256_set1_ps(GEO_TAN_PI_8)), _CMP_GT_OQ);
+   __m256 num = _mm256_blendv_ps(mn, _mm256_sub_ps(mn, mx), big);
+   __m256 den = _mm256_blendv_ps(mx, _mm256_add_ps(mn, mx), big);
+   __m256 t = _mm256_div_ps(num, _mm256_max_ps(den, _mm256_set1_ps(FLT_MIN)));
+   __m256 z = _mm256_mul_ps(t, t);
+   __m256 r = _mm256_fmadd_ps(_mm256_set1_ps(GEO_P0), z, _mm256_set1_ps(GEO_P1));
+   r = _mm256_fmadd_ps(r, z, _mm256_set1_ps(GEO_P2));
+   r = _mm256_fmadd_ps(r, z, _mm256_set1_ps(GEO_P3));
+   r = _mm256_fmadd_ps(_mm256_mul_ps(r, z), t, t);
+   r = _mm256_add_ps(r, _mm256_and_ps(big, _mm256_set1_ps(GEO_PI_4)));
+   r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(GEO_PI_2), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+   r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(GEO_PI), r),
+                        _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+   return _mm256_or_ps(r, _mm256_and_ps(sign, y));
+}
+
+GEO_AVX2_TARGET static inline __m256 avx2_distance2(__m256 dx, __m256 dy, __m256 dz) {
+   return _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+}
+
+GEO_AVX2_TARGET static void avx2_distances2(const float* p, const float* x, const float* y, const float* z,
+                                            int n, float* out) {
+   __m256 px = _mm256_set1_ps(p[0]), py = _mm256_set1_ps(p[1]), pz = _mm256_set1_ps(p[2]);
+   int i;
+   for(i = 0; i < n; i += 8) {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), px);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), py);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), pz);
+      _mm256_storeu_ps(out + i, avx2_distance2(dx, dy, dz));
+   }
+}
+
+GEO_AVX2_TARGET static int avx2_in_range(const float* p, const float* x, const float* y, const float* z, int n,
+                                         float radius2, uint8_t* mask) {
+   __m256 px = _mm256_set1_ps(p[0]), py = _mm256_set1_ps(p[1]), pz = _mm256_set1_ps(p[2]);
+   __m256 r2 = _mm256_set1_ps(radius2);
+   int i, k, count = 0;
+   for(i = 0; i < n; i += 8) {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), px);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), py);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), pz);
+      int bits = _mm256_movemask_ps(_mm256_cmp_ps(avx2_distance2(dx, dy, dz), r2, _CMP_LT_OQ));
+      for(k = 0; k < 8; ++k)
+         mask[i + k] = (bits >> k) & 1;
+      count += __builtin_popcount(bits);
+   }
+   return count;
+}
+
+GEO_AVX2_TARGET static void avx2_polar(const float* origin, const float* x, const float* y, const float* z, int n,
+                                       float* distance, float* azimuth, float* elevation) {
+   __m256 ox = _mm256_set1_ps(origin[0]), oy = _mm256_set1_ps(origin[1]), oz = _mm256_set1_ps(origin[2]);
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   int i;
+   for(i = 0; i < n; i += 8) {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), ox);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), oy);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), oz);
+      __m256 planar2 = _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx));
+      _mm256_storeu_ps(distance + i, _mm256_sqrt_ps(_mm256_fmadd_ps(dz, dz, planar2)));
+      _mm256_storeu_ps(azimuth + i, avx2_atan2_one(_mm256_xor_ps(dy, sign), dx));
+      _mm256_storeu_ps(elevation + i, avx2_atan2_one(dz, _mm256_sqrt_ps(planar2)));
+   }
+}
+
+GEO_AVX2_TARGET static void avx2_atan2(const float* y, const float* x, int n, float* out) {
+   int i;
+   for(i = 0; i < n; i += 8)
+      _mm256_storeu_ps(out + i, avx2_atan2_one(_mm256_loadu_ps(y + i), _mm256_loadu_ps(x + i)));
+}
+
+static const geo_kernels_t avx2_kernels = {
+   "avx2", 8, avx2_distances2, avx2_in_range, avx2_polar, avx2_atan2
+};
+
+#endif
+
+/****************************************/
+/****************************************/
+
+#ifdef GEO_NEON
+
+/* 32-bit ARM has no vector division or square root: Newton steps from the estimates */
+static inline float32x4_t neon_div(float32x4_t a, float32x4_t b) {
+#ifdef __aarch64__
+   return vdivq_f32(a, b);
+#else
+   float32x4_t r = vrecpeq_f32(b);
+   r = vmulq_f32(vrecpsq_f32(b, r), r);
+   r = vmulq_f32(vrecpsq_f32(b, r), r);
+   return vmulq_f32(a, r);
+#endif
+}
+
+static inline float32x4_t neon_sqrt(float32x4_t a) {
+#ifdef __aarch64__
+   return vsqrtq_f32(a);
+#else
+   float32x4_t r = vrsqrteq_f32(a);
+   r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(a, r), r), r);
+   r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(a, r), r), r);
+   /* The estimate of 1 / sqrt(0) is infinite */
+   return vbslq_f32(vceqq_f32(a, vdupq_n_f32(0.0f)), a, vmulq_f32(a, r));
+#endif
+}
+
+static inline float32x4_t neon_atan2_one(float32x4_t y, float32x4_t x) {
+   float32x4_t ax = vabsq_f32(x), ay = vabsq_f32(y);
+   float32x4_t mx = vmaxq_f32(ax, ay), mn = vminq_f32(ax, ay);
+   uint32x4_t big = vcgtq_f32(mn, vmulq_f32(mx, vdupq_n_f32(GEO_TAN_PI_8)));
+   float32x4_t num = vbslq_f32(big, vsubq_f32(mn, mx), mn);
+   float32x4_t den = vbslq_f32(big, vaddq_f32(mn, mx), mx);
+   float32x4_t t = neon_div(num, vmaxq_f32(den, vdupq_n_f32(FLT_MIN)));
+   float32x4_t z = vmulq_f32(t, t);
+   float32x4_t r = vmlaq_f32(vdupq_n_f32(GEO_P1), vdupq_n_f32(GEO_P0), z);
+   r = vmlaq_f32(vdupq_n_f32(GEO_P2), r, z);
+   r = vmlaq_f32(vdupq_n_f32(GEO_P3), r, z);
+   r = vmlaq_f32(t, vmulq_f32(r, z), t);
+   r = vbslq_f32(big, vaddq_f32(r, vdupq_n_f32(GEO_PI_4)), r);
+   r = vbslq_f32(vcgtq_f32(ay, ax), vsubq_f32(vdupq_n_f32(GEO_PI_2), r), r);
+   r = vbslq_f32(vcltq_f32(x, vdupq_n_f32(0.0f)), vsubq_f32(vdupq_n_f32(GEO_PI), r), r);
+   return vbslq_f32(vdupq_n_u32(0x80000000u), y, r);
+}
+
+static inline float32x4_t neon_distance2(float32x4_t dx, float32x4_t dy, float32x4_t dz) {
+   return vmlaq_f32(vmlaq_f32(vmulq_f32(dx, dx), dy, dy), dz, dz);
+}
+
+static void neon_distances2(const float* p, const float* x, const float* y, const float* z, int n, float* out) {
+   float32x4_t px = vdupq_n_f32(p[0]), py = vdupq_n_f32(p[1]), pz = vdupq_n_f32(p[2]);
+   int i;
+   for(i = 0; i < n; i += 4) {
+      float32x4_t dx = vsubq_f32(vld1q_f32(x + i), px);
+      float32x4_t dy = vsubq_f32(vld1q_f32(y + i), py);
+      float32x4_t dz = vsubq_f32(vld1q_f32(z + i), pz);
+      vst1q_f32(out + i, neon_distance2(dx, dy, dz));
+   }
+}
+
+static int neon_in_range(const float* p, const float* x, const float* y, const float* z, int n, float radius2,
+                         uint8_t* mask) {
+   float32x4_t px = vdupq_n_f32(p[0]), py = vdupq_n_f32(p[1]), pz = vdupq_n_f32(p[2]);
+   float32x4_t r2 = vdupq_n_f32(radius2);
+   int i, count = 0;
+   for(i = 0; i < n; i += 4) {
+      float32x4_t dx = vsubq_f32(vld1q_f32(x + i), px);
+      float32x4_t dy = vsubq_f32(vld1q_f32(y + i), py);
+      float32x4_t dz = vsubq_f32(vld1q_f32(z + i), pz);
+      uint32x4_t in = vshrq_n_u32(vcltq_f32(neon_distance2(dx, dy, dz), r2), 31);
+      mask[i]     = (uint8_t)vgetq_lane_u32(in, 0);
+      mask[i + 1] = (uint8_t)vgetq_lane_u32(in, 1);
+      mask[i + 2] = (uint8_t)vgetq_lane_u32(in, 2);
+      mask[i + 3] = (uint8_t)vgetq_lane_u32(in, 3);
+      count += mask[i] + mask[i + 1] + mask[i + 2] + mask[i + 3];
+   }
+   return count;
+}
+
+static void neon_polar(const float* origin, const float* x, const float* y, const float* z, int n,
+                       float* distance, float* azimuth, float* elevation) {
+   float32x4_t ox = vdupq_n_f32(origin[0]), oy = vdupq_n_f32(origin[1]), oz = vdupq_n_f32(origin[2]);
+   int i;
+   for(i = 0; i < n; i += 4) {
+      float32x4_t dx = vsubq_f32(vld1q_f32(x + i), ox);
+      float32x4_t dy = vsubq_f32(vld1q_f32(y + i), oy);
+      float32x4_t dz = vsubq_f32(vld1q_f32(z + i), oz);
+      float32x4_t planar2 = vmlaq_f32(vmulq_f32(dx, dx), dy, dy);
+      vst1q_f32(distance + i, neon_sqrt(vmlaq_f32(planar2, dz, dz)));
+      vst1q_f32(azimuth + i, neon_atan2_one(vnegq_f32(dy), dx));
+      vst1q_f32(elevation + i, neon_atan2_one(dz, neon_sqrt(planar2)));
+   }
+}
+
+static void neon_atan2(const float* y, const float* x, int n, float* out) {
+   int i;
+   for(i = 0; i < n; i += 4)
+      vst1q_f32(out + i, neon_atan2_one(vld1q_f32(y + i), vld1q_f32(x + i)));
+}
+
+static const geo_kernels_t neon_kernels = {
+   "neon", 4, neon_distances2, neon_in_range, neon_polar, neon_atan2
+};
+
+#endif
+
+/****************************************/
+/****************************************/
+
+static const geo_kernels_t* geo_kernels(void) {
+   static _Atomic(const geo_kernels_t*) selected = NULL;
+   const geo_kernels_t* k = atomic_load_explicit(&selected, memory_order_relaxed);
+   if(k) return k;
+   k = &scalar_kernels;
+#ifdef GEO_NEON
+   k = &neon_kernels;
+#endif
+#ifdef GEO_AVX2
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) k = &avx2_kernels;
+#endif
+   atomic_store_explicit(&selected, k, memory_order_relaxed);
+   return k;
+}
+
+/*
+Copy the last n % width positions of a batch, starting at first, into
+batches of width, the free lanes holding copies of the first one
+*/
+static int geo_pad(const geo_kernels_t* k, int n, int* first, const float** in, float (*padded)[GEO_MAX_WIDTH],
+                   int count) {
+   int rest = n % k->width, i, j;
+   *first = n - rest;
+   for(j = 0; j < count && rest; ++j)
+      for(i = 0; i < k->width; ++i)
+         padded[j][i] = in[j][*first + (i < rest ? i : 0)];
+   return rest;
+}
+
+const char* geo_kernel(void) {
+   return geo_kernels()->name;
+}
+
+void geo_distances2(const float* p, const float* x, const float* y, const float* z, int n, float* out) {
+   const geo_kernels_t* k = geo_kernels();
+   const float* in[3] = { x, y, z };
+   float padded[4][GEO_MAX_WIDTH];
+   int first, rest = geo_pad(k, n, &first, in, padded, 3);
+   k->distances2(p, x, y, z, first, out);
+   if(!rest) return;
+   k->distances2(p, padded[0], padded[1], padded[2], k->width, padded[3]);
+   memcpy(out + first, padded[3], rest * sizeof(float));
+}
+
+int geo_in_range(const float* p, const float* x, const float* y, const float* z, int n, float radius,
+                 uint8_t* mask) {
+   const geo_kernels_t* k = geo_kernels();
+   const float* in[3] = { x, y, z };
+   float padded[3][GEO_MAX_WIDTH];
+   uint8_t padded_mask[GEO_MAX_WIDTH];
+   int first, i, rest = geo_pad(k, n, &first, in, padded, 3);
+   int count = k->in_range(p, x, y, z, first, radius * radius, mask);
+   if(!rest) return count;
+   k->in_range(p, padded[0], padded[1], padded[2], k->width, radius * radius, padded_mask);
+   for(i = 0; i < rest; ++i)
+      count += mask[first + i] = padded_mask[i];
+   return count;
+}
+
+void geo_polar(const float* origin, const float* x, const float* y, const float* z, int n,
+               float* distance, float* azimuth, float* elevation) {
+   const geo_kernels_t* k = geo_kernels();
+   const float* in[3] = { x, y, z };
+   float padded[6][GEO_MAX_WIDTH];
+   int first, rest = geo_pad(k, n, &first, in, padded, 3);
+   k->polar(origin, x, y, z, first, distance, azimuth, elevation);
+   if(!rest) return;
+   k->polar(origin, padded[0], padded[1], padded[2], k->width, padded[3], padded[4], padded[5]);
+   memcpy(distance + first, padded[3], rest * sizeof(float));
+   memcpy(azimuth + first, padded[4], rest * sizeof(float));
+   memcpy(elevation + first, padded[5], rest * sizeof(float));
+}
+
+void geo_atan2(const float* y, const float* x, int n, float* out) {
+   const geo_kernels_t* k = geo_kernels();
+   const float* in[2] = { y, x };
+   float padded[3][GEO_MAX_WIDTH];
+   int first, rest = geo_pad(k, n, &first, in, padded, 2);
+   k->atan2(y, x, first, out);
+   if(!rest) return;
+   k->atan2(padded[0], padded[1], k->width, padded[2]);
+   memcpy(out + first, padded[2], rest * sizeof(float));
+}
@@ -0,0 +1,55 @@
+#include <stdint.h>
+
+#ifndef GEOMETRY_UTILITY_H
+#define GEOMETRY_UTILITY_H
+
+/*
+Geometry of batches of positions, shared by the CommHub and the BuzzVMs.
+The positions are given as a structure of arrays: x[i], y[i], z[i].
+The kernels run on AVX2 when the CPU has it, on NEON on ARM, and in plain C
+otherwise. A batch is served by one kernel, its last positions included, so
+that a position gives the same result wherever it is in a batch.
+*/
+
+/* Kernels in use: "avx2", "neon" or "scalar" */
+extern const char* geo_kernel(void);
+
+/* Squared distance from p (x, y, z) to each of the n positions */
+extern void geo_distances2(const float* p,
+                           const float* x,
+                           const float* y,
+                           const float* z,
+                           int n,
+                           float* out);
+
+/*
+Set mask[i] to 1 for each of the n positions closer than radius to p, and to 0
+for the others. Return the number of positions in range.
+*/
+extern int geo_in_range(const float* p,
+                        const float* x,
+                        const float* y,
+                        const float* z,
+                        int n,
+                        float radius,
+                        uint8_t* mask);
+
+/*
+Distance, azimuth and elevation in radians of the n positions relative to
+origin, for a robot facing the positive x direction:
+atan2(-dy, dx) and atan2(dz, hypot(dx, dy)).
+The angles are within 3e-7 radians of the exact ones.
+*/
+extern void geo_polar(const float* origin,
+                      const float* x,
+                      const float* y,
+                      const float* z,
+                      int n,
+                      float* distance,
+                      float* azimuth,
+                      float* elevation);
+
+/* atan2(y[i], x[i]) of n pairs, as precise as geo_polar */
+extern void geo_atan2(const float* y, const float* x, int n, float* out);
+
+#endif
@@ -0,0 +1,180 @@
+#include "inbox_utility.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INBOX_LENGTH_SIZE 4
+#define INBOX_HEADER_SIZE 16   // Sender and position, before the messages
+
+/*
+head and tail count the bytes written and taken since the start. Only the
+producer moves head. Both move tail: the consumer after taking an entry, and
+the producer when it drops the oldest one. The consumer copies an entry before
+moving tail past it, and throws the copy away when the producer moved tail
+first, as the bytes may have been written over.
+*/
+struct inbox_s {
+   atomic_uint_fast64_t head;
+   char                 pad1[64 - sizeof(atomic_uint_fast64_t)];
+   atomic_uint_fast64_t tail;
+   char                 pad2[64 - sizeof(atomic_uint_fast64_t)];
+   atomic_int           waiting;   // The producer waits for room
+   atomic_int           closed;
+   atomic_uint_fast64_t dropped;
+   int                  policy;
+   size_t               capacity;  // A power of two
+   uint8_t*             data;
+   uint8_t*             entry;     // Copy of the entry taken by the consumer
+   pthread_mutex_t      mutex;     // Only for the producer waiting for room
+   pthread_cond_t       cond;
+};
+
+/****************************************/
+/****************************************/
+
+static void ring_put(inbox_t inbox, uint64_t at, const void* src, size_t n) {
+   size_t i = at & (inbox->capacity - 1);
+   size_t first = n < inbox->capacity - i ? n : inbox->capacity - i;
+   memcpy(inbox->data + i, src, first);
+   memcpy(inbox->data, (const uint8_t*)src + first, n - first);
+}
+
+static void ring_get(inbox_t inbox, uint64_t at, void* dst, size_t n) {
+   size_t i = at & (inbox->capacity - 1);
+   size_t first = n < inbox->capacity - i ? n : inbox->capacity - i;
+   memcpy(dst, inbox->data + i, first);
+   memcpy((uint8_t*)dst + first, inbox->data, n - first);
+}
+
+static uint32_t ring_length(inbox_t inbox, uint64_t at) {
+   uint32_t n;
+   ring_get(inbox, at, &n, sizeof(n));
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+inbox_t inbox_new(size_t capacity, int policy) {
+   inbox_t inbox = (inbox_t)calloc(1, sizeof(struct inbox_s));
+   if(!inbox) return NULL;
+   inbox->capacity = 1024;
+   while(inbox->capacity < capacity) inbox->capacity <<= 1;
+   inbox->policy = policy;
+   pthread_mutex_init(&inbox->mutex, NULL);
+   pthread_cond_init(&inbox->cond, NULL);
+   inbox->data = (uint8_t*)malloc(inbox->capacity);
+   inbox->entry = (uint8_t*)malloc(inbox->capacity);
+   if(!inbox->data || !inbox->entry) {
+      inbox_destroy(inbox);
+      errno = ENOMEM;
+      return NULL;
+   }
+   return inbox;
+}
+
+void inbox_destroy(inbox_t inbox) {
+   if(!inbox) return;
+   pthread_mutex_destroy(&inbox->mutex);
+   pthread_cond_destroy(&inbox->cond);
+   free(inbox->data);
+   free(inbox->entry);
+   free(inbox);
+}
+
+/* Wait until need bytes are free, or the inbox is closed. Return 0, or -1 if closed */
+static int inbox_wait_room(inbox_t inbox, uint64_t head, size_t need) {
+   pthread_mutex_lock(&inbox->mutex);
+   atomic_store(&inbox->waiting, 1);
+   /* Check again after waiting is set: the consumer that moves tail after this signals */
+   while(!atomic_load(&inbox->closed) && inbox->capacity - (size_t)(head - atomic_load(&inbox->tail)) < need)
+      pthread_cond_wait(&inbox->cond, &inbox->mutex);
+   atomic_store(&inbox->waiting, 0);
+   pthread_mutex_unlock(&inbox->mutex);
+   return atomic_load(&inbox->closed) ? -1 : 0;
+}
+
+int inbox_push(inbox_t inbox,
+               uint32_t sender,
+               const float* position,
+               const uint8_t* msgs,
+               size_t msgs_size,
+               int wait) {
+   size_t need = INBOX_LENGTH_SIZE + INBOX_HEADER_SIZE + msgs_size;
+   int dropped = 0;
+   if(atomic_load_explicit(&inbox->closed, memory_order_relaxed)) return -1;
+   if(need > inbox->capacity) {
+      atomic_fetch_add_explicit(&inbox->dropped, 1, memory_order_relaxed);
+      return 1;
+   }
+   uint64_t head = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+   while(1) {
+      uint64_t tail = atomic_load_explicit(&inbox->tail, memory_order_acquire);
+      if(inbox->capacity - (size_t)(head - tail) >= need) break;
+      if(inbox->policy == INBOX_BLOCK) {
+         if(!wait || inbox_wait_room(inbox, head, need)) return -1;
+         continue;
+      }
+      /* The entry at tail was written by this thread, and is not written over before tail moves */
+      uint64_t next = tail + INBOX_LENGTH_SIZE + ring_length(inbox, tail);
+      if(atomic_compare_exchange_strong_explicit(&inbox->tail, &tail, next,
+                                                 memory_order_acq_rel, memory_order_acquire))
+         ++dropped;
+   }
+   uint32_t length = (uint32_t)(INBOX_HEADER_SIZE + msgs_size);
+   uint8_t header[INBOX_LENGTH_SIZE + INBOX_HEADER_SIZE];
+   memcpy(header, &length, 4);
+   memcpy(header + 4, &sender, 4);
+   memcpy(header + 8, position, 12);
+   ring_put(inbox, head, header, sizeof(header));
+   ring_put(inbox, head + sizeof(header), msgs, msgs_size);
+   atomic_store_explicit(&inbox->head, head + need, memory_order_release);
+   if(dropped) atomic_fetch_add_explicit(&inbox->dropped, dropped, memory_order_relaxed);
+   return dropped;
+}
+
+int inbox_pop(inbox_t inbox, inbox_record_t* r) {
+   while(1) {
+      uint64_t tail = atomic_load_explicit(&inbox->tail, memory_order_acquire);
+      uint64_t head = atomic_load_explicit(&inbox->head, memory_order_acquire);
+      if(tail == head) return 0;
+      uint32_t length = ring_length(inbox, tail);
+      if(length < INBOX_HEADER_SIZE || INBOX_LENGTH_SIZE + (uint64_t)length > head - tail ||
+         INBOX_LENGTH_SIZE + (size_t)length > inbox->capacity) {
+         /* Written over by the producer, which moved tail */
+         if(atomic_load_explicit(&inbox->tail, memory_order_acquire) == tail) return 0;
+         continue;
+      }
+      ring_get(inbox, tail + INBOX_LENGTH_SIZE, inbox->entry, length);
+      /* Sequentially consistent with the check of waiting below, against inbox_wait_room */
+      if(!atomic_compare_exchange_strong(&inbox->tail, &tail, tail + INBOX_LENGTH_SIZE + length))
+         continue;  // Dropped while it was copied
+      if(atomic_load(&inbox->waiting)) {
+         pthread_mutex_lock(&inbox->mutex);
+         pthread_cond_signal(&inbox->cond);
+         pthread_mutex_unlock(&inbox->mutex);
+      }
+      memcpy(&r->sender, inbox->entry, 4);
+      memcpy(r->position, inbox->entry + 4, 12);
+      r->msgs = inbox->entry + INBOX_HEADER_SIZE;
+      r->msgs_size = length - INBOX_HEADER_SIZE;
+      return 1;
+   }
+}
+
+void inbox_close(inbox_t inbox) {
+   pthread_mutex_lock(&inbox->mutex);
+   atomic_store(&inbox->closed, 1);
+   pthread_cond_broadcast(&inbox->cond);
+   pthread_mutex_unlock(&inbox->mutex);
+}
+
+int inbox_is_closed(inbox_t inbox) {
+   return atomic_load(&inbox->closed);
+}
+
+uint64_t inbox_dropped(inbox_t inbox) {
+   return atomic_load_explicit(&inbox->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,61 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef INBOX_UTILITY_H
+#define INBOX_UTILITY_H
+
+/*
+Inbox of a BuzzVM: the records decoded from the frames of the CommHub, from
+the receiver thread (the only producer) to the step (the only consumer).
+
+A byte ring without locks. Each entry holds a record: the id and the position
+of the sender, and its messages as in the frame (see packet_utility.h).
+When the ring is full, INBOX_DROP_OLDEST drops the oldest records to make
+room, and INBOX_BLOCK makes the producer wait for the consumer, which pushes
+back on the CommHub over TCP.
+*/
+#define INBOX_DROP_OLDEST 0
+#define INBOX_BLOCK       1
+
+typedef struct inbox_s* inbox_t;
+
+typedef struct inbox_record_s {
+   uint32_t       sender;
+   float          position[3];
+   const uint8_t* msgs;        // Messages of the record, terminator included
+   size_t         msgs_size;
+} inbox_record_t;
+
+/* Create an inbox of at least capacity bytes. Return NULL and set errno on error */
+extern inbox_t inbox_new(size_t capacity, int policy);
+
+extern void inbox_destroy(inbox_t inbox);
+
+/*
+Add a record. With INBOX_BLOCK and no room, wait for room if wait is not 0.
+Return the number of records dropped to make room, or itself if it can never
+fit, or -1 if there is no room and wait is 0, or if the inbox is closed.
+*/
+extern int inbox_push(inbox_t inbox,
+                      uint32_t sender,
+                      const float* position,
+                      const uint8_t* msgs,
+                      size_t msgs_size,
+                      int wait);
+
+/*
+Take the oldest record. Its messages stay valid until the next call.
+Return 1, or 0 if the inbox is empty.
+*/
+extern int inbox_pop(inbox_t inbox, inbox_record_t* r);
+
+/* Release the producer waiting for room, and make the next pushes fail */
+extern void inbox_close(inbox_t inbox);
+
+extern int inbox_is_closed(inbox_t inbox);
+
+/* Number of records dropped since the inbox was created */
+extern uint64_t inbox_dropped(inbox_t inbox);
+
+#endif
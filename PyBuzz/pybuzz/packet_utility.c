@@ -0,0 +1,271 @@
+#include "packet_utility.h"
+
+#include <math.h>
+#include <string.h>
+
+/****************************************/
+/****************************************/
+
+static void put_float(uint8_t* out, float f) {
+   uint32_t v;
+   memcpy(&v, &f, sizeof(v));
+   out[0] = (uint8_t)v;
+   out[1] = (uint8_t)(v >> 8);
+   out[2] = (uint8_t)(v >> 16);
+   out[3] = (uint8_t)(v >> 24);
+}
+
+static float get_float(const uint8_t* buf) {
+   uint32_t v = (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+   float f;
+   memcpy(&f, &v, sizeof(f));
+   return f;
+}
+
+void handshake_put(uint8_t* out, uint32_t robot_id) {
+   out[0] = (uint8_t)robot_id;
+   out[1] = (uint8_t)(robot_id >> 8);
+   out[2] = (uint8_t)(robot_id >> 16);
+   out[3] = (uint8_t)(robot_id >> 24);
+   out[4] = WIRE_VERSION;
+}
+
+int handshake_get(const uint8_t* buf, uint32_t* robot_id) {
+   *robot_id = (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+   return buf[4] == WIRE_VERSION ? 0 : -1;
+}
+
+size_t varint_put(uint8_t* out, uint64_t v) {
+   size_t n = 0;
+   while(v >= 0x80) {
+      out[n++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+   }
+   out[n++] = (uint8_t)v;
+   return n;
+}
+
+int varint_get(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+   const uint8_t* q = *p;
+   uint64_t result = 0;
+   int shift;
+   for(shift = 0; shift < 64 && q < end; shift += 7) {
+      uint8_t byte = *q++;
+      result |= (uint64_t)(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) {
+         *p = q;
+         *v = result;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+static size_t zigzag_put(uint8_t* out, int64_t v) {
+   return varint_put(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int zigzag_get(const uint8_t** p, const uint8_t* end, int64_t* v) {
+   uint64_t u;
+   if(varint_get(p, end, &u)) return -1;
+   *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+   return 0;
+}
+
+/* Steps of resolution from origin to position. The receiver gets origin + steps * resolution */
+static int64_t quantize(float position, float origin, float resolution) {
+   double steps = ((double)position - (double)origin) / resolution;
+   if(!(fabs(steps) < 4e18)) return 0;  // NaN, or a position that makes no sense
+   return llrint(steps);
+}
+
+/****************************************/
+/****************************************/
+
+int frame_scan(const uint8_t* buf, size_t len, size_t* length) {
+   const uint8_t* p = buf + 1;
+   uint64_t body;
+   if(len < 1) return 0;
+   if(buf[0] != WIRE_VERSION) return -1;
+   if(varint_get(&p, buf + len, &body))
+      return len - 1 < VARINT_MAX_SIZE ? 0 : -1;
+   if(body > FRAME_MAX_SIZE) return -1;
+   size_t total = (size_t)(p - buf) + (size_t)body;
+   if(len < total) return 0;
+   *length = total;
+   return 1;
+}
+
+size_t frame_put_prefix(uint8_t* out, size_t body_size) {
+   out[0] = WIRE_VERSION;
+   return 1 + varint_put(out + 1, body_size);
+}
+
+size_t frame_put_header(uint8_t* out,
+                        uint64_t seq,
+                        uint64_t timestamp,
+                        pose_codec_t* own,
+                        const float* origin,
+                        float resolution,
+                        int num_records,
+                        float* coded) {
+   uint8_t* p = out + 1;
+   int k, key = 1;
+   int64_t steps[3];
+   p += varint_put(p, seq);
+   p += varint_put(p, timestamp);
+   if(own && own->has_key && own->since_key + 1 < POSE_KEY_INTERVAL) {
+      key = 0;
+      for(k = 0; k < 3; ++k) {
+         steps[k] = quantize(origin[k], own->key[k], own->resolution);
+         if(steps[k] >= POSE_MAX_STEPS || steps[k] <= -POSE_MAX_STEPS) key = 1;
+      }
+   }
+   if(key) {
+      for(k = 0; k < 3; ++k) {
+         put_float(p, origin[k]);
+         p += 4;
+         coded[k] = origin[k];
+      }
+      put_float(p, resolution);
+      p += 4;
+      coded[3] = resolution;
+      if(own) {
+         own->has_key = 1;
+         own->key_seq = seq;
+         memcpy(own->key, origin, sizeof(own->key));
+         own->resolution = resolution;
+         own->since_key = 0;
+      }
+   }
+   else {
+      p += varint_put(p, own->key_seq);
+      for(k = 0; k < 3; ++k) {
+         p += zigzag_put(p, steps[k]);
+         coded[k] = own->key[k] + (float)((double)steps[k] * own->resolution);
+      }
+      coded[3] = own->resolution;
+      own->since_key++;
+   }
+   out[0] = (own ? FRAME_OWN : 0) | (key ? FRAME_KEY : 0);
+   p += varint_put(p, (uint64_t)num_records);
+   return (size_t)(p - out);
+}
+
+size_t frame_put_record(uint8_t* out,
+                        uint32_t robot_id,
+                        const float* position,
+                        const float* origin,
+                        float resolution) {
+   uint8_t* p = out;
+   int k;
+   p += varint_put(p, robot_id);
+   for(k = 0; k < 3; ++k)
+      p += zigzag_put(p, quantize(position[k], origin[k], resolution));
+   return (size_t)(p - out);
+}
+
+size_t frame_put_uplink(uint8_t* out, uint64_t seq, uint64_t timestamp, uint32_t robot_id) {
+   uint8_t* p = out;
+   *p++ = FRAME_UPLINK;
+   p += varint_put(p, seq);
+   p += varint_put(p, timestamp);
+   p += varint_put(p, robot_id);
+   return (size_t)(p - out);
+}
+
+/****************************************/
+/****************************************/
+
+int frame_open(const uint8_t* frame, size_t length, pose_codec_t* own, frame_view_t* v) {
+   const uint8_t* p = frame + 1;
+   const uint8_t* end = frame + length;
+   uint64_t body, value;
+   int k;
+   memset(v, 0, sizeof(*v));
+   if(length < 2 || frame[0] != WIRE_VERSION || varint_get(&p, end, &body) || p >= end) return -1;
+   v->flags = *p++;
+   if(varint_get(&p, end, &v->seq) || varint_get(&p, end, &v->timestamp)) return -1;
+   if(v->flags & FRAME_UPLINK) {
+      if(varint_get(&p, end, &value) || value > UINT32_MAX) return -1;
+      v->sender = (uint32_t)value;
+      v->next = p;
+      v->end = end;
+      return 0;
+   }
+   if(v->flags & FRAME_KEY) {
+      if(end - p < 16) return -1;
+      for(k = 0; k < 3; ++k)
+         v->origin[k] = get_float(p + 4*k);
+      v->resolution = get_float(p + 12);
+      p += 16;
+      if(!(v->resolution > 0) || isinf(v->resolution)) return -1;
+      v->has_origin = 1;
+      if(own && (v->flags & FRAME_OWN)) {
+         own->has_key = 1;
+         own->key_seq = v->seq;
+         memcpy(own->key, v->origin, sizeof(own->key));
+         own->resolution = v->resolution;
+      }
+   }
+   else {
+      int64_t steps[3];
+      if(!(v->flags & FRAME_OWN) || varint_get(&p, end, &value)) return -1;
+      for(k = 0; k < 3; ++k)
+         if(zigzag_get(&p, end, &steps[k])) return -1;
+      if(own && own->has_key && own->key_seq == value) {
+         for(k = 0; k < 3; ++k)
+            v->origin[k] = own->key[k] + (float)((double)steps[k] * own->resolution);
+         v->resolution = own->resolution;
+         v->has_origin = 1;
+      }
+   }
+   if(varint_get(&p, end, &value) || value > (uint64_t)(end - p)) return -1;
+   v->num_records = (int)value;
+   v->next = p;
+   v->end = end;
+   return 0;
+}
+
+int frame_next_record(frame_view_t* v, record_view_t* r) {
+   uint64_t value;
+   int64_t steps;
+   int k;
+   if(!v->num_records) return 0;
+   if(varint_get(&v->next, v->end, &value) || value > UINT32_MAX) return -1;
+   r->sender = (uint32_t)value;
+   for(k = 0; k < 3; ++k) {
+      if(zigzag_get(&v->next, v->end, &steps)) return -1;
+      r->position[k] = v->has_origin ? v->origin[k] + (float)((double)steps * v->resolution) : NAN;
+   }
+   if(messages_scan(v->next, v->end, &r->msgs_size, &r->num_msgs)) return -1;
+   r->msgs = v->next;
+   v->next += r->msgs_size;
+   v->num_records--;
+   return 1;
+}
+
+int messages_scan(const uint8_t* p, const uint8_t* end, size_t* size, int* num_msgs) {
+   const uint8_t* start = p;
+   uint64_t len;
+   int n = 0;
+   while(1) {
+      if(varint_get(&p, end, &len)) return -1;
+      if(len == 0) break;
+      if(len > FRAME_MAX_SIZE || len > (uint64_t)(end - p)) return -1;
+      p += len;
+      n++;
+   }
+   *size = (size_t)(p - start);
+   *num_msgs = n;
+   return 0;
+}
+
+int message_next(const uint8_t** p, const uint8_t** msg, size_t* size) {
+   uint64_t len;
+   if(varint_get(p, *p + VARINT_MAX_SIZE, &len) || len == 0) return 0;
+   *msg = *p;
+   *size = (size_t)len;
+   *p += len;
+   return 1;
+}
@@ -0,0 +1,168 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PACKET_UTILITY_H
+#define PACKET_UTILITY_H
+
+/*
+Wire format between the BuzzVMs and the CommHub, version WIRE_VERSION.
+All numbers are little-endian. varint: unsigned LEB128. zigzag: signed varint.
+
+Handshake, from the BuzzVM (a UDP datagram of its own for the udp transport):
+   uint32 robot id
+   uint8  WIRE_VERSION
+
+Frame:
+   uint8  WIRE_VERSION
+   varint size of the body (n)
+   n bytes body
+
+Body of a frame from a BuzzVM:
+   uint8  flags (FRAME_UPLINK)
+   varint seq
+   varint timestamp, in microseconds
+   varint robot id
+   messages
+
+Body of a frame from the CommHub:
+   uint8  flags
+   varint seq
+   varint timestamp, in microseconds
+   origin: with FRAME_KEY    { float32 x, y, z, float32 resolution }
+           without FRAME_KEY { varint seq of the keyframe, 3 zigzag (origin - keyframe) / resolution }
+   varint number of records
+   records { varint robot id, 3 zigzag (position - origin) / resolution, messages }
+
+messages: { varint size (n > 0), n bytes }..., varint 0
+
+With FRAME_OWN, the origin is the position of the receiver, which replaces
+the packet of its own position of the first version. It is a delta from the
+last keyframe sent to the receiver, with a keyframe at least every
+POSE_KEY_INTERVAL frames. A receiver that missed the keyframe (udp) knows it
+from its seq. The frames without FRAME_OWN (multicast) always have a keyframe.
+*/
+#define WIRE_VERSION       2
+#define HANDSHAKE_SIZE     5
+#define FRAME_KEY          1   // The origin is absolute
+#define FRAME_OWN          2   // The origin is the position of the receiver
+#define FRAME_UPLINK       4   // From a BuzzVM to the CommHub
+#define POSE_KEY_INTERVAL  64
+#define POSE_MAX_STEPS     (1 << 20)   // Deltas from the keyframe beyond this many resolutions need a keyframe
+
+#define VARINT_MAX_SIZE    10
+#define FRAME_PREFIX_MAX   (1 + VARINT_MAX_SIZE)
+#define FRAME_HEADER_MAX   (1 + 5 * VARINT_MAX_SIZE + 16)  // Body of a frame from the CommHub, before the records
+#define FRAME_UPLINK_MAX   (1 + 3 * VARINT_MAX_SIZE)       // Body of a frame from a BuzzVM, before the messages
+#define FRAME_RECORD_MAX   (4 * VARINT_MAX_SIZE)           // Record, before the messages
+/* A message or a frame announcing more bytes than this means the stream is corrupted */
+#define FRAME_MAX_SIZE     (1 << 24)
+
+/* Write the handshake of a robot, HANDSHAKE_SIZE bytes */
+extern void handshake_put(uint8_t* out, uint32_t robot_id);
+
+/* Read a handshake. Return 0, or -1 if it is from another version */
+extern int handshake_get(const uint8_t* buf, uint32_t* robot_id);
+
+/* Write v as a varint. Return the bytes written, at most VARINT_MAX_SIZE */
+extern size_t varint_put(uint8_t* out, uint64_t v);
+
+/* Decode a varint at *p, and move *p after it. Return 0, or -1 if it does not end before end */
+extern int varint_get(const uint8_t** p, const uint8_t* end, uint64_t* v);
+
+/*
+Look for a complete frame at the start of buf.
+Return 1 and set *length to the bytes of the whole frame, 0 if more bytes are
+needed, or -1 if the bytes cannot be a frame of this version.
+*/
+extern int frame_scan(const uint8_t* buf, size_t len, size_t* length);
+
+/* Write the version and the size of a body of body_size bytes. Return the bytes written */
+extern size_t frame_put_prefix(uint8_t* out, size_t body_size);
+
+/*
+Keyframe state of the position of a receiver, on both sides of a link.
+Zero it for a new link.
+*/
+typedef struct pose_codec_s {
+   int      has_key;
+   uint64_t key_seq;
+   float    key[3];
+   float    resolution;
+   int      since_key;     // Frames since the keyframe, on the side of the CommHub
+} pose_codec_t;
+
+/*
+Write the body of a frame from the CommHub, up to its records.
+With own, origin is the position of the receiver, encoded against own.
+Without, origin is written as a keyframe with this resolution.
+coded[4] is set to the origin and the resolution the receiver will decode,
+to encode the records against.
+Return the bytes written, at most FRAME_HEADER_MAX.
+*/
+extern size_t frame_put_header(uint8_t* out,
+                               uint64_t seq,
+                               uint64_t timestamp,
+                               pose_codec_t* own,
+                               const float* origin,
+                               float resolution,
+                               int num_records,
+                               float* coded);
+
+/*
+Write a record up to its messages. origin and resolution are those of the
+frame. Return the bytes written, at most FRAME_RECORD_MAX.
+*/
+extern size_t frame_put_record(uint8_t* out,
+                               uint32_t robot_id,
+                               const float* position,
+                               const float* origin,
+                               float resolution);
+
+/* Write the body of a frame from a BuzzVM, up to its messages. Return the bytes written */
+extern size_t frame_put_uplink(uint8_t* out, uint64_t seq, uint64_t timestamp, uint32_t robot_id);
+
+typedef struct frame_view_s {
+   int            flags;
+   uint64_t       seq;
+   uint64_t       timestamp;
+   uint32_t       sender;        // Frames from a BuzzVM
+   float          origin[3];     // Frames from the CommHub
+   int            has_origin;    // 0 if the keyframe of the origin was missed
+   float          resolution;
+   int            num_records;
+   const uint8_t* next;          // Next record, or the messages of a frame from a BuzzVM
+   const uint8_t* end;
+} frame_view_t;
+
+/*
+Decode the header of a frame found by frame_scan.
+own is the keyframe state of the receiver, NULL on the CommHub.
+Return 0, or -1 if the frame is corrupted.
+*/
+extern int frame_open(const uint8_t* frame, size_t length, pose_codec_t* own, frame_view_t* v);
+
+typedef struct record_view_s {
+   uint32_t       sender;
+   float          position[3];
+   const uint8_t* msgs;          // Messages of the record, terminator included
+   size_t         msgs_size;
+   int            num_msgs;
+} record_view_t;
+
+/* Decode the next record of a frame from the CommHub. Return 1, 0 after the last one, or -1 */
+extern int frame_next_record(frame_view_t* v, record_view_t* r);
+
+/*
+Check the messages that start at p, and end before end.
+Set *size to their bytes, terminator included, and *num_msgs.
+Return 0, or -1 if they are corrupted.
+*/
+extern int messages_scan(const uint8_t* p, const uint8_t* end, size_t* size, int* num_msgs);
+
+/*
+Take the next message of valid messages, and move *p after it.
+Return 1, or 0 at the terminator or at a length that cannot be read.
+*/
+extern int message_next(const uint8_t** p, const uint8_t** msg, size_t* size);
+
+#endif
@@ -13,37 +13,261 @@ See example.py for an example usage on a single computer.
 example_server.py and two instances of example_client.py illustrate distributed compatibility.
 '''
 
-from threading import Thread, Lock
+from threading import Thread, Lock, Event, Condition
+from concurrent.futures import Future
+from collections import deque
 import socket
 import struct
 import time
 import numpy as np
 import sys
+import os
+import select
+import selectors
+import http.server
+
+from cpython.pycapsule cimport PyCapsule_GetPointer
+from libc.errno cimport errno, EINVAL
+from libc.stdint cimport uint8_t, uint16_t, uint32_t, uint64_t
+from libc.string cimport memcpy
+
+cdef extern from "stats_utility.h":
+    ctypedef struct hist_t:
+        pass
+    ctypedef struct hist_summary_t:
+        uint64_t count
+        uint64_t sum
+        uint64_t max
+        uint64_t p50
+        uint64_t p90
+        uint64_t p99
+        uint64_t p999
+    cdef void hist_record(hist_t* h, uint64_t value)
+    cdef void hist_summarize(const hist_t* h, hist_summary_t* s)
+    cdef uint64_t stats_now_ns()
+    cdef uint64_t stats_realtime_us()
 
 # Imported from buzz_utility.h and can be used in this file. Name must be identical to the
 # one in the header file.
 cdef extern from "buzz_utility.h":
+    ctypedef int (*buzzvm_funp)(void* vm)
     cdef int buzz_script_set(const char* bo_filename, const char* bdbg_filename, int comm_id)
+    cdef int buzz_script_reload(int vmid, const char* bo_filename, const char* bdbg_filename, int init)
     cdef void import_module(const char* module_name)
-    cdef int register_hook(int vmid, int hook_number, const char* function_name)
+    cdef int register_hook(int vmid, const char* function_name, int batched)
+    cdef int add_native_hook(const char* name, buzzvm_funp fun)
+    cdef int register_native_hook(int vmid, const char* name)
+    cdef int hook_batch_take(int hook_id, int** robots, double** args, int* width)
+    cdef void hook_batch_give(int hook_id, const double* results, int n)
     cdef int register_init()
     cdef void complete_setup(int vmid, const char* bo_filename)
     cdef void buzz_script_step(int vmid)
+    cdef void buzz_step_all(const int* vmids, int n) nogil
+    cdef void buzz_vm_destroy(int vmid)
     cdef void buzz_script_destroy()
     cdef int buzz_script_done(int vmid)
 
     cdef const int MAX_MESSAGE_SIZE
+    cdef const int HOOK_BATCH_MAX_ARGS
 
     cdef int get_num_virtual_machines()
 
     cdef void reset_neighbors(int vmid)
     cdef void add_neighbor(int vmid, int neighbour_id, float x, float y, float z)
     cdef void feed_buzz_message(int vmid, int sender_id, char* message, int size)
+    cdef void feed_buzz_messages(int vmid, const uint16_t* sender_ids, const uint8_t* buf, const int* offsets, int n)
+    cdef void set_neighbors(int vmid, const uint16_t* ids, const float* xyz, int n)
+    cdef void set_neighbors_csr(const int* vmids, int n, const int* offsets, const int* neighbors,
+                                const uint16_t* ids, const float* xyz)
+    cdef void upsert_neighbor(int vmid, uint16_t id, const float* xyz, uint64_t now)
+    cdef void commit_neighbors(int vmid, uint64_t oldest)
     cdef void set_abs_pos(int vmid, float x, float y, float z)
 
-    cdef int are_more_messages(int vmid)
-    cdef char* get_next_message(int vmid)
-    cdef int get_message_size()
+    cdef int drain_messages(int vmid, uint8_t* buf, int cap, int* sizes, int max)
+
+    cdef int buzz_step_stats(int vmid, hist_summary_t* s)
+    cdef int get_num_python_hooks()
+    cdef const char* python_hook_stats(int hook_id, hist_summary_t* s)
+
+cdef extern from "commhub_utility.h":
+    ctypedef struct commhub_s:
+        pass
+    ctypedef commhub_s* commhub_t
+    cdef enum commhub_event_type_e:
+        COMMHUB_EVENT_CONNECTED
+        COMMHUB_EVENT_DISCONNECTED
+        COMMHUB_EVENT_ALL_CONNECTED
+        COMMHUB_EVENT_STOPPED
+        COMMHUB_EVENT_OVERRUN
+    ctypedef struct commhub_event_t:
+        int type
+        uint32_t robot_id
+        char address[64]
+    cdef commhub_t commhub_new(const char* host, int port, int n_clients, float neighbor_distance,
+                               float resolution, int transports, const char* multicast_group)
+    cdef int commhub_start(commhub_t hub, double period, int cpu)
+    cdef enum commhub_class_e:
+        COMMHUB_CLASS_SWARM
+        COMMHUB_CLASS_STIGMERGY
+        COMMHUB_CLASS_BROADCAST
+        COMMHUB_CLASS_OTHER
+        COMMHUB_NUM_CLASSES
+    cdef int commhub_set_coalescing(commhub_t hub, int on)
+    cdef int commhub_set_lanes(commhub_t hub, int n_lanes, const int* lane_of_class, const size_t* budgets)
+    cdef int commhub_set_high_water(commhub_t hub, size_t high_water)
+    cdef int commhub_set_capture(commhub_t hub, const char* path, size_t ring_size)
+    cdef void commhub_forward(commhub_t hub) nogil
+    cdef int commhub_update_position(commhub_t hub, uint32_t robot_id, float x, float y, float z)
+    cdef int commhub_update_pose(commhub_t hub, uint32_t robot_id, const float* position, const float* quaternion)
+    cdef int commhub_get_pose(commhub_t hub, uint32_t robot_id, float* pose)
+    cdef int commhub_next_event(commhub_t hub, commhub_event_t* ev, int timeout_ms) nogil
+    ctypedef struct commhub_tick_stats_t:
+        uint64_t ticks
+        uint64_t split
+        uint64_t missed
+        uint64_t last_us
+        uint64_t max_us
+        uint64_t max_late_us
+    cdef void commhub_tick_stats(commhub_t hub, commhub_tick_stats_t* stats)
+    ctypedef struct commhub_stats_t:
+        uint64_t frames_in
+        uint64_t messages_in
+        uint64_t bytes_in
+        uint64_t bytes_out
+        uint64_t datagrams_dropped
+        uint64_t records_dropped
+        uint64_t disconnects
+        uint64_t messages_coalesced
+        uint64_t messages_deferred
+        uint64_t messages_shed
+        uint64_t frames_shed
+        uint64_t slow_clients
+        uint64_t capture_records
+        uint64_t capture_dropped
+        hist_summary_t forward_delay
+        hist_summary_t tick_time
+        hist_summary_t tick_bytes
+        hist_summary_t tick_messages
+    cdef void commhub_stats(commhub_t hub, commhub_stats_t* stats)
+    ctypedef struct commhub_queue_stats_t:
+        uint64_t queued_bytes
+        uint64_t max_queued_bytes
+        uint64_t frames_queued
+        uint64_t frames_shed
+        uint64_t bytes_shed
+    cdef int commhub_queue_stats(commhub_t hub, uint32_t robot_id, commhub_queue_stats_t* stats)
+    cdef int commhub_is_alive(commhub_t hub)
+    ctypedef struct hub_grid_s:
+        pass
+    ctypedef hub_grid_s* hub_grid_t
+    cdef hub_grid_t hub_grid_new()
+    cdef void hub_grid_destroy(hub_grid_t grid)
+    cdef int hub_grid_neighbors(hub_grid_t grid, const float* xyz, int n, float radius, int* offsets,
+                                int** neighbors)
+    cdef void commhub_stop(commhub_t hub) nogil
+    cdef void commhub_destroy(commhub_t hub) nogil
+
+cdef extern from "packet_utility.h":
+    cdef const int WIRE_VERSION
+    cdef const int FRAME_OWN
+    cdef const int VARINT_MAX_SIZE
+    cdef const int FRAME_PREFIX_MAX
+    cdef const int FRAME_UPLINK_MAX
+    ctypedef struct pose_codec_t:
+        pass
+    ctypedef struct frame_view_t:
+        int flags
+        uint64_t seq
+        uint64_t timestamp
+        float origin[3]
+        int has_origin
+        int num_records
+    ctypedef struct record_view_t:
+        uint32_t sender
+        float position[3]
+        const unsigned char* msgs
+        size_t msgs_size
+        int num_msgs
+    cdef size_t varint_put(unsigned char* out, uint64_t v)
+    cdef int frame_scan(const unsigned char* buf, size_t len, size_t* length)
+    cdef size_t frame_put_prefix(unsigned char* out, size_t body_size)
+    cdef size_t frame_put_uplink(unsigned char* out, uint64_t seq, uint64_t timestamp, uint32_t robot_id)
+    cdef int frame_open(const unsigned char* frame, size_t length, pose_codec_t* own, frame_view_t* v)
+    cdef int frame_next_record(frame_view_t* v, record_view_t* r)
+    cdef int message_next(const unsigned char** p, const unsigned char** msg, size_t* size)
+
+cdef extern from "geometry_utility.h":
+    cdef const char* geo_kernel()
+    cdef void geo_polar(const float* origin, const float* x, const float* y, const float* z, int n,
+                        float* distance, float* azimuth, float* elevation) nogil
+
+cdef extern from "transport_utility.h":
+    cdef const int TRANSPORT_TCP
+    cdef const int TRANSPORT_SHM
+    cdef const int TRANSPORT_UDP
+    cdef const int UDP_MAX_DATAGRAM
+    ctypedef struct shm_link_s:
+        pass
+    ctypedef shm_link_s* shm_link_t
+    cdef shm_link_t shm_link_connect(int port, uint32_t robot_id)
+    cdef int shm_link_send(shm_link_t link, const void* data, size_t len) nogil
+    cdef ssize_t shm_link_recv(shm_link_t link, void* buf, size_t cap, int timeout_ms) nogil
+    cdef void shm_link_shutdown(shm_link_t link)
+    cdef void shm_link_close(shm_link_t link)
+
+cdef extern from "capture_utility.h":
+    cdef enum capture_type_e:
+        CAPTURE_END
+        CAPTURE_TICK
+        CAPTURE_FRAME
+        CAPTURE_POSE
+    cdef const uint32_t CAPTURE_MULTICAST
+    ctypedef struct capture_file_t:
+        uint64_t start_ns
+        uint64_t start_us
+    ctypedef struct capture_tick_t:
+        uint64_t tick
+        uint64_t timestamp
+        uint32_t n
+    ctypedef struct capture_position_t:
+        uint32_t robot_id
+        float xyz[3]
+    ctypedef struct capture_pose_t:
+        uint32_t robot_id
+        uint32_t has_yaw
+        float pose[4]
+    ctypedef struct capture_reader_t:
+        const capture_file_t* file
+        size_t n_ticks
+    ctypedef struct capture_record_t:
+        int type
+        uint64_t time_ns
+        const unsigned char* payload
+        size_t size
+    cdef int capture_reader_open(capture_reader_t* r, const char* path)
+    cdef int capture_reader_next(capture_reader_t* r, capture_record_t* rec)
+    cdef int capture_reader_seek(capture_reader_t* r, uint64_t tick)
+    cdef void capture_reader_close(capture_reader_t* r)
+
+cdef extern from "inbox_utility.h":
+    cdef const int INBOX_DROP_OLDEST
+    cdef const int INBOX_BLOCK
+    ctypedef struct inbox_s:
+        pass
+    ctypedef inbox_s* inbox_t
+    ctypedef struct inbox_record_t:
+        uint32_t sender
+        float position[3]
+        const unsigned char* msgs
+        size_t msgs_size
+    cdef inbox_t inbox_new(size_t capacity, int policy)
+    cdef void inbox_destroy(inbox_t inbox)
+    cdef int inbox_push(inbox_t inbox, uint32_t sender, const float* position, const unsigned char* msgs,
+                        size_t msgs_size, int wait) nogil
+    cdef int inbox_pop(inbox_t inbox, inbox_record_t* r)
+    cdef void inbox_close(inbox_t inbox)
+    cdef int inbox_is_closed(inbox_t inbox)
+    cdef uint64_t inbox_dropped(inbox_t inbox)
 
 # These are python objects (only used in this file) that have been type declared to accept the return value of an array
 cdef char message[MAX_MESSAGE_SIZE]
@@ -52,90 +276,618 @@ cdef char message[MAX_MESSAGE_SIZE]
 HOST = 'localhost'
 PORT = 8000
 
+# Transports between the BuzzVM objects and the CommHub
+TRANSPORTS = {'tcp': TRANSPORT_TCP, 'shm': TRANSPORT_SHM, 'udp': TRANSPORT_UDP}
+
+# What a BuzzVM does with new records when its inbox is full
+INBOX_POLICIES = {'drop_oldest': INBOX_DROP_OLDEST, 'block': INBOX_BLOCK}
+
+
+'''
+PRIVATE
+:param s: summary of a histogram
+:param scale: float. Factor from the unit of the histogram to the unit of the summary
+:return: dict. 'count' of values, their 'mean', the 'p50', 'p90', 'p99' and 'p999' percentiles and the 'max'
+'''
+cdef dict summary(const hist_summary_t* s, double scale=1):
+    return {'count': s.count, 'mean': s.sum * scale / s.count if s.count else 0.0,
+            'p50': s.p50 * scale, 'p90': s.p90 * scale, 'p99': s.p99 * scale, 'p999': s.p999 * scale,
+            'max': s.max * scale}
+
+
+'''
+PRIVATE
+:param transport: string, or list of strings. Names of transports in TRANSPORTS
+:return: int. The TRANSPORT_* flags of the transports, or'ed together
+'''
+def transport_flags(transport):
+    if isinstance(transport, str):
+        transport = [transport]
+    flags = 0
+    for name in transport:
+        if name not in TRANSPORTS:
+            raise ValueError("Unknown transport '{}'. Use one of {}".format(name, sorted(TRANSPORTS)))
+        flags |= TRANSPORTS[name]
+    return flags
+
+
+'''
+PRIVATE
+Replace the neighbors of a Virtual Machine, straight from the numpy buffers
+:param vmid: int. id of the Virtual Machine
+:param ids: contiguous numpy.uint16 array of the neighbor ids
+:param xyz: contiguous numpy.float32 array of shape (len(ids), 3). Absolute positions of the neighbors
+'''
+def update_neighbors(int vmid, const uint16_t[::1] ids, const float[:, ::1] xyz):
+    if ids.shape[0] == 0:
+        set_neighbors(vmid, NULL, NULL, 0)
+        return
+    if xyz.shape[0] != ids.shape[0] or xyz.shape[1] != 3:
+        raise ValueError("update_neighbors: xyz must have shape (len(ids), 3)")
+    set_neighbors(vmid, &ids[0], &xyz[0, 0], ids.shape[0])
+
+
+'''
+Distance, azimuth and elevation of positions relative to a robot facing the positive x direction, as
+the neighbors table of a BuzzVM gives them, computed with the SIMD kernels of pybuzz
+:param origin: sequence of 3 floats. Position of the robot
+:param xyz: numpy array of shape (n, 3). The positions
+:return: numpy.float32 array of shape (3, n). The distances, and the azimuths and elevations in radians
+'''
+def polar(origin, xyz):
+    cdef float[::1] o = np.ascontiguousarray(origin, dtype=np.float32)
+    cdef float[:, ::1] soa = np.ascontiguousarray(np.asarray(xyz, dtype=np.float32).reshape(-1, 3).T)
+    cdef int n = soa.shape[1]
+    result = np.empty((3, n), dtype=np.float32)
+    cdef float[:, ::1] out = result
+    if o.shape[0] != 3:
+        raise ValueError("polar: origin must have 3 coordinates")
+    if n:
+        with nogil:
+            geo_polar(&o[0], &soa[0, 0], &soa[1, 0], &soa[2, 0], n, &out[0, 0], &out[1, 0], &out[2, 0])
+    return result
+
+
+'''
+:return: string. The kernels of the geometry of pybuzz for this CPU: "avx2", "neon" or "scalar"
+'''
+def geometry_kernel():
+    return geo_kernel().decode()
+
+
+'''
+PRIVATE
+Forget the neighbors of a Virtual Machine not heard from for a while, and give it the neighbors that changed
+:param vmid: int. id of the Virtual Machine
+:param patience: float. Seconds until a neighbor is forgotten
+'''
+def age_neighbors(int vmid, double patience):
+    cdef uint64_t now = stats_now_ns()
+    cdef uint64_t age = <uint64_t> (patience * 1e9)
+    commit_neighbors(vmid, now - age if now > age else 0)
+
+
+'''
+PRIVATE
+Feed one message to a Virtual Machine from any buffer (bytes, memoryview, ...), without copying it
+'''
+def feed_message(int vmid, int sender_id, const unsigned char[::1] msg):
+    if msg.shape[0]:
+        feed_buzz_message(vmid, sender_id, <char*> &msg[0], msg.shape[0])
+
+
+'''
+Feed a batch of messages to a Virtual Machine in one native call, from any buffer (bytes, memoryview, numpy
+array, ...), without copying the buffer or making a Python object per message
+:param vmid: int. id of the Virtual Machine
+:param sender_ids: numpy.array of numpy.uint16. Id of the robot that sent each message
+:param buf: bytes-like object. The messages one after the other
+:param offsets: numpy.array of numpy.intc. Offset in buf of each message, then of the end of the last one
+'''
+def feed_messages(int vmid, const uint16_t[::1] sender_ids, const unsigned char[::1] buf, const int[::1] offsets):
+    cdef int n = sender_ids.shape[0]
+    cdef int i
+    if offsets.shape[0] != n + 1:
+        raise ValueError("feed_messages: offsets must hold {} entries".format(n + 1))
+    if n == 0:
+        return
+    if offsets[0] < 0 or offsets[n] > buf.shape[0]:
+        raise ValueError("feed_messages: offsets out of the buffer")
+    for i in range(n):
+        if offsets[i + 1] < offsets[i]:
+            raise ValueError("feed_messages: offsets must not decrease")
+    if offsets[n] > offsets[0]:
+        feed_buzz_messages(vmid, &sender_ids[0], &buf[0], &offsets[0], n)
+
+
+'''
+PRIVATE
+Set the absolute position of a Virtual Machine, for the benchmarks
+'''
+def set_position(int vmid, float x, float y, float z):
+    set_abs_pos(vmid, x, y, z)
+
+
+'''
+PRIVATE
+Step a Virtual Machine right away on this thread, for the benchmarks
+'''
+def step_vm(int vmid):
+    buzz_script_step(vmid)
+
+
+cdef enum:
+    DRAIN_BATCH = 64  # Messages taken by each call to drain_messages
+
+
+'''
+PRIVATE
+Take all the messages sent by the last step of a Virtual Machine, with a few calls to drain_messages
+:param vmid: int. id of the Virtual Machine
+:param buf: bytearray. Where the messages are written. Replaced by a bigger one when a message does not fit
+:return: (bytearray, list of memoryview) The buffer to pass next time, and a view of each message in the order
+    they were sent. The next call writes over the views
+'''
+def take_messages(int vmid, bytearray buf):
+    cdef int sizes[DRAIN_BATCH]
+    cdef unsigned char[::1] view = buf
+    cdef Py_ssize_t used = 0
+    cdef int n, i
+    cdef object whole = memoryview(buf)
+    msgs = []
+    while True:
+        if used == view.shape[0]:
+            n = -1
+            sizes[0] = 1
+        else:
+            n = drain_messages(vmid, &view[used], view.shape[0] - used, sizes, DRAIN_BATCH)
+        if n < 0:
+            # The next message does not fit in what is left: go on in a new buffer
+            buf = bytearray(max(2 * view.shape[0], sizes[0]))
+            view = buf
+            whole = memoryview(buf)
+            used = 0
+            continue
+        if n == 0:
+            return buf, msgs
+        for i in range(n):
+            msgs.append(whole[used:used + sizes[i]])
+            used += sizes[i]
+
+
+'''
+PRIVATE
+Take all the messages sent by the last step of several Virtual Machines, one after the other in one buffer
+:param vmids: int array. ids of the Virtual Machines
+:param buf: bytearray. Where the messages are written. Replaced by a bigger one when they do not fit
+:return: (bytearray, numpy.array, numpy.array). The buffer to pass next time, the offset in it of each message
+    then of the end of the last one, as for feed_messages, and the number of messages of each Virtual Machine
+'''
+def pack_messages(const int[::1] vmids, bytearray buf):
+    cdef int sizes[DRAIN_BATCH]
+    cdef unsigned char[::1] view = buf
+    cdef int used = 0
+    cdef int total = 0
+    cdef int n, i, v
+    offsets_array = np.zeros(DRAIN_BATCH + 1, dtype=np.intc)
+    counts_array = np.zeros(vmids.shape[0], dtype=np.intc)
+    cdef int[::1] offsets = offsets_array
+    cdef int[::1] counts = counts_array
+    for v in range(vmids.shape[0]):
+        while True:
+            if used == view.shape[0]:
+                n = -1
+                sizes[0] = 1
+            else:
+                n = drain_messages(vmids[v], &view[used], view.shape[0] - used, sizes, DRAIN_BATCH)
+            if n < 0:
+                # The next message does not fit in what is left: go on in a bigger buffer
+                bigger = bytearray(max(2 * view.shape[0], used + sizes[0]))
+                bigger[:used] = buf[:used]
+                buf = bigger
+                view = buf
+                continue
+            if n == 0:
+                break
+            if total + n >= offsets.shape[0]:
+                offsets_array = np.concatenate([offsets_array, np.zeros(offsets.shape[0] + n, dtype=np.intc)])
+                offsets = offsets_array
+            for i in range(n):
+                used += sizes[i]
+                total += 1
+                offsets[total] = used
+            counts[v] += n
+    return buf, offsets_array[:total + 1], counts_array
+
+
+'''
+PRIVATE
+:param comm_id: int. Id of the robot
+:return: bytes. Handshake introducing the robot to the CommHub
+'''
+def handshake(comm_id):
+    return struct.pack('<IB', comm_id, WIRE_VERSION)
+
+
+'''
+PRIVATE
+Encode the messages of a robot into a frame for the CommHub (see packet_utility.h)
+:param seq: int. Number of the frame, counted by the robot
+:param comm_id: int. Id of the robot
+:param msgs: list of bytes-like objects. Each one is fed directly to the buzz script using feed_buzz_message
+:return: bytes
+'''
+def uplink_frame(uint64_t seq, uint32_t comm_id, msgs):
+    cdef unsigned char prefix[FRAME_PREFIX_MAX]
+    cdef unsigned char header[FRAME_UPLINK_MAX]
+    cdef unsigned char size[VARINT_MAX_SIZE]
+    cdef size_t n = frame_put_uplink(header, seq, <uint64_t>(time.time() * 1e6), comm_id)
+    cdef size_t m
+    parts = [(<char*> header)[:n]]
+    cdef size_t body_size = n + 1
+    for msg in msgs:
+        m = varint_put(size, len(msg))
+        parts.append((<char*> size)[:m])
+        parts.append(msg)
+        body_size += m + len(msg)
+    parts.append(b'\0')
+    n = frame_put_prefix(prefix, body_size)
+    return (<char*> prefix)[:n] + b''.join(parts)
+
+
+'''
+PRIVATE
+Group messages into as few frames of at most max_size bytes as possible, keeping their order
+:param msgs: list of bytes-like objects
+:param max_size: int. Most bytes of each frame. A message too big stays alone in its frame
+:return: list of lists of the objects of msgs
+'''
+def split_messages(msgs, max_size):
+    groups = []
+    group = []
+    size = FRAME_PREFIX_MAX + FRAME_UPLINK_MAX + 1
+    for msg in msgs:
+        if group and size + VARINT_MAX_SIZE + len(msg) > max_size:
+            groups.append(group)
+            group = []
+            size = FRAME_PREFIX_MAX + FRAME_UPLINK_MAX + 1
+        group.append(msg)
+        size += VARINT_MAX_SIZE + len(msg)
+    if group:
+        groups.append(group)
+    return groups
+
+
+cdef class Inbox:
+    '''
+    PRIVATE
+    Records received by a BuzzVM and not fed to its Virtual Machine yet, in a native ring without
+    locks between the receiver thread and the step (see inbox_utility.h)
+    :param capacity: int. Bytes of the ring
+    :param policy: string. Name of a policy in INBOX_POLICIES, for when the ring is full
+    '''
+    cdef inbox_t inbox
+
+    def __cinit__(self, size_t capacity, policy):
+        if policy not in INBOX_POLICIES:
+            raise ValueError("Unknown inbox policy '{}'. Use one of {}".format(policy, sorted(INBOX_POLICIES)))
+        self.inbox = inbox_new(capacity, INBOX_POLICIES[policy])
+        if self.inbox is NULL:
+            raise MemoryError()
+
+    def __dealloc__(self):
+        if self.inbox is not NULL:
+            inbox_destroy(self.inbox)
 
-class Packet:
     '''
     PRIVATE
-    Create a Packet to be sent over a socket
-    :params x, y, z: absolute coordinates of sender
-    :param sender_id: comm_id of sender
-    :param msgs: list of bytes objects. Each bytes object is fed directly to the buzz script using feed_buzz_message
+    Add a record, waiting without the GIL for the step to make room with the "block" policy
+    :return: int. Number of records dropped, or -1 once the inbox is closed
     '''
-    def __init__(self, x, y, z, sender_id, msgs=[]):
-        self.x = x
-        self.y = y
-        self.z = z
-        self.comm_id = sender_id
-        self.msgs = msgs
+    cdef int push(self, const record_view_t* r):
+        cdef int status = inbox_push(self.inbox, r.sender, r.position, r.msgs, r.msgs_size, 0)
+        if status < 0 and not inbox_is_closed(self.inbox):
+            with nogil:
+                status = inbox_push(self.inbox, r.sender, r.position, r.msgs, r.msgs_size, 1)
+        return status
 
     '''
     PRIVATE
-    Convert packet to a bytes object containing all the information.
+    Feed the messages of all the records to a Virtual Machine, oldest first, and record the position
+    of each sender in its neighbor table (see upsert_neighbor)
+    :param vmid: int. id of the Virtual Machine
+    :return: int. Number of records taken
+    '''
+    def drain(self, int vmid):
+        cdef inbox_record_t r
+        cdef const unsigned char* p
+        cdef const unsigned char* msg
+        cdef size_t size
+        cdef int n = 0
+        cdef uint64_t now = stats_now_ns()
+        while inbox_pop(self.inbox, &r):
+            upsert_neighbor(vmid, r.sender, r.position, now)
+            p = r.msgs
+            while message_next(&p, &msg, &size):
+                feed_buzz_message(vmid, r.sender, <char*> msg, size)
+            n += 1
+        return n
 
-    Contents:
-        4 bytes x
-        4 bytes y
-        4 bytes z
-        4 bytes comm_id
-        for each message {
-            4 bytes message length (n)
-            n bytes message
-        }
-        4 bytes (0000)
+    '''
+    PRIVATE
+    Release the receiver thread waiting for room, and refuse the next records
+    '''
+    def close(self):
+        inbox_close(self.inbox)
 
-    :return b_string: bytes object representing entire packet
     '''
-    def byte_string(self):
-        b_string = struct.pack('fffI', float(self.x), float(self.y), float(self.z), int(self.comm_id))
-        for msg in self.msgs:
-            b_string += struct.pack('I', len(msg))
-            b_string += msg
-        b_string += struct.pack('I', 0)
-        return b_string
+    PRIVATE
+    :return: int. Number of records dropped since the inbox was created
+    '''
+    def dropped(self):
+        return inbox_dropped(self.inbox)
 
+
+cdef class PacketReader:
     '''
     PRIVATE
-    Create a packet from a socket
-    Block until a string of bytes comes in, and unpack these bytes into a new Packet object.
-    The incomming bytes are in the form described in the documentation for Packet.byte_string
-    :param s: socket object
-    :return: Packet object or False if any socket.error occured
+    Incremental decoder of the frames coming from a socket (see packet_utility.h).
+    Each read takes everything available with one large recv_into, decodes all the complete
+    frames, and pushes their records straight to the inbox of the robot
+    :param sock: socket object
+    :param comm_id: int. Id of the robot reading, whose own records (multicast) are skipped
+    :param inbox: Inbox object of the robot
+    :param capacity: int. Initial size of the receive buffer in bytes
     '''
-    @staticmethod
-    def from_socket(s):
+    cdef object sock
+    cdef bytearray buf
+    cdef Py_ssize_t end  # Number of bytes in buf
+    cdef uint32_t comm_id
+    cdef Inbox inbox
+    cdef pose_codec_t pose  # Keyframe of the position of this robot
+    cdef uint64_t next_seq  # Expected seq of the next frame with our position
+    cdef readonly object loc  # Last position of this robot sent by the CommHub, or None
+    cdef readonly uint64_t frames_lost  # Frames with our position that never came (udp)
+    cdef readonly uint64_t frames_unplaced  # Frames dropped because the keyframe of their origin was lost
+    cdef hist_t delay  # Microseconds from the tick of the CommHub to the decoding of our frames
+
+    def __init__(self, sock, comm_id, Inbox inbox, capacity=65536):
+        self.sock = sock
+        self.comm_id = comm_id
+        self.inbox = inbox
+        self.buf = bytearray(capacity)
+        self.end = 0
+
+    '''
+    PRIVATE
+    Block until bytes come in, and decode them. PacketReader.loc is updated with each frame
+    :return: int. Number of records with messages pushed to the inbox, 0 if the socket timed out,
+        or False if the socket is broken, the bytes are not frames, or the inbox is closed
+    '''
+    def read(self):
+        if self.end == len(self.buf):  # A frame bigger than the buffer
+            self.buf = self.buf + bytearray(len(self.buf))
         try:
-            while True:
-                try:
-                    m = s.recv(16)
-                    break
-                except socket.timeout:
-                    pass
-            if len(m) == 0:
-                # The socket is broken
+            n = self.sock.recv_into(memoryview(self.buf)[self.end:])
+        except socket.timeout:
+            return 0
+        except socket.error:
+            return False
+        if n == 0:
+            # The socket is broken
+            return False
+        self.end += n
+        return self.decode()
+
+    cdef decode(self):
+        cdef const unsigned char[::1] view = self.buf
+        cdef const unsigned char* base = &view[0]
+        cdef frame_view_t v
+        cdef record_view_t r
+        cdef size_t length
+        cdef Py_ssize_t start = 0
+        cdef int status
+        cdef int received = 0
+        cdef uint64_t now
+        while True:
+            status = frame_scan(base + start, self.end - start, &length)
+            if status < 0:
+                return False
+            if status == 0:
+                break
+            if frame_open(base + start, length, &self.pose, &v):
                 return False
-            # Process the message
-            x, y, z, sender_id = struct.unpack('fffI', m)
-            msgs = []
+            start += length
+            if v.flags & FRAME_OWN:
+                now = stats_realtime_us()
+                hist_record(&self.delay, now - v.timestamp if now > v.timestamp else 0)
+                if v.seq > self.next_seq:
+                    self.frames_lost += v.seq - self.next_seq
+                self.next_seq = v.seq + 1
+            if not v.has_origin:
+                self.frames_unplaced += 1
+                continue
+            if v.flags & FRAME_OWN:
+                self.loc = (v.origin[0], v.origin[1], v.origin[2])
             while True:
-                m = s.recv(4)
-                msg_size = struct.unpack('I', m)[0]
-                if msg_size == 0:
+                status = frame_next_record(&v, &r)
+                if status < 0:
+                    return False
+                if status == 0:
                     break
-                msg = s.recv(msg_size)
-                msgs.append(msg)
-            return Packet(x, y, z, sender_id, msgs)
-        except socket.error:
-            return False
+                if r.sender == self.comm_id:
+                    continue
+                if self.inbox.push(&r) < 0:
+                    return False
+                if r.num_msgs:
+                    received += 1
+        if start:
+            # Keep the unfinished frame for the next read
+            self.buf[:self.end - start] = self.buf[start:self.end]
+            self.end -= start
+        return received
+
+    '''
+    PRIVATE
+    :return: dict. summary of the microseconds from the ticks of the CommHub to the decoding of our frames
+    '''
+    def delay_stats(self):
+        cdef hist_summary_t s
+        hist_summarize(&self.delay, &s)
+        return summary(&s)
+
+
+cdef class ShmLink:
+    '''
+    PRIVATE
+    BuzzVM side of the shared memory transport, for a CommHub on the same host.
+    Has the methods of the sockets used by BuzzVM and PacketReader
+    :param port: int. The port of the CommHub
+    :param comm_id: int. Id of the robot
+    '''
+    cdef shm_link_t link
+    cdef bint closed
+
+    def __cinit__(self, int port, uint32_t comm_id):
+        self.link = shm_link_connect(port, comm_id)
+        if self.link is NULL:
+            raise OSError(errno, os.strerror(errno))
+
+    def __dealloc__(self):
+        if self.link is not NULL:
+            shm_link_close(self.link)
+
+    '''
+    PRIVATE
+    Block until bytes come from the CommHub, or for a second (socket.timeout)
+    :return: int. Number of bytes written in buf, 0 if the CommHub is gone
+    '''
+    def recv_into(self, unsigned char[::1] buf):
+        cdef ssize_t n
+        if self.closed:
+            return 0
+        with nogil:
+            n = shm_link_recv(self.link, &buf[0], buf.shape[0], 1000)
+        if n == 0:
+            raise socket.timeout()
+        return max(n, 0)
+
+    def sendall(self, const unsigned char[::1] data):
+        cdef int status = 0
+        if self.closed:
+            raise BrokenPipeError()
+        if data.shape[0]:
+            with nogil:
+                status = shm_link_send(self.link, &data[0], data.shape[0])
+        if status:
+            raise BrokenPipeError()
+
+    def close(self):
+        if not self.closed:
+            self.closed = True
+            shm_link_shutdown(self.link)
+
+
+class UdpLink:
+    REGISTER_PERIOD = 0.5  # seconds between registrations, until the CommHub answers
+    TIMEOUT = 1
+
+    '''
+    PRIVATE
+    BuzzVM side of the UDP transport. Has the methods of the sockets used by BuzzVM and PacketReader
+    :param host: string. The host of the CommHub
+    :param port: int. The port of the CommHub
+    :param comm_id: int. Id of the robot
+    :param multicast_group: string. IPv4 multicast group the CommHub sends to, on port + 1, or None
+    '''
+    def __init__(self, host, port, comm_id, multicast_group=None):
+        self.comm_id = comm_id
+        self.s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.s.connect((host, port))
+        self.m = None
+        if multicast_group is not None:
+            self.m = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            self.m.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            self.m.bind(('', port + 1))
+            mreq = socket.inet_aton(multicast_group) + socket.inet_aton('0.0.0.0')
+            self.m.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+        self.registered = False
+        self.last_registration = 0
+        self.pending = b''  # Bytes of the last datagram not taken by recv_into yet
+        self.closed = False
+
+    '''
+    PRIVATE
+    Block until a datagram comes from the CommHub, or for a second (socket.timeout). Until the CommHub
+    answers, it might not be up yet: the errors of the registrations it did not get are ignored
+    :return: int. Number of bytes written in buf, 0 once the link is closed
+    '''
+    def recv_into(self, buf):
+        sockets = [self.s] if self.m is None else [self.s, self.m]
+        deadline = time.time() + UdpLink.TIMEOUT
+        while not self.pending:
+            if self.closed:
+                return 0
+            now = time.time()
+            if now >= deadline:
+                raise socket.timeout()
+            timeout = deadline - now
+            if not self.registered:
+                if now - self.last_registration >= UdpLink.REGISTER_PERIOD:
+                    self.last_registration = now
+                    try:
+                        self.s.send(handshake(self.comm_id))
+                    except ConnectionRefusedError:
+                        pass  # The port was unreachable for the last registration
+                timeout = min(timeout, self.last_registration + UdpLink.REGISTER_PERIOD - now)
+            try:
+                ready, _, _ = select.select(sockets, [], [], max(timeout, 0))
+            except (OSError, ValueError):
+                if self.closed:
+                    return 0  # Closed by another thread meanwhile
+                raise
+            for sock in ready:
+                try:
+                    data = sock.recv(UDP_MAX_DATAGRAM)
+                except ConnectionRefusedError:
+                    if self.registered:
+                        raise
+                    continue  # No CommHub yet on the port, the next registration tries again
+                if sock is self.s:
+                    self.registered = True
+                self.pending += data  # Our own frames from the group are skipped by PacketReader
+        n = min(len(buf), len(self.pending))
+        buf[:n] = self.pending[:n]
+        self.pending = self.pending[n:]
+        return n
+
+    '''
+    PRIVATE
+    Send a frame in one datagram, of at most UDP_MAX_DATAGRAM bytes
+    '''
+    def send(self, frame):
+        self.s.send(frame)
+
+    def close(self):
+        self.closed = True
+        self.s.close()
+        if self.m is not None:
+            self.m.close()
 
 
 class BuzzVM:
-    MAX_PACKETS_RECEIVED = 1000  # Receiving this many packets before stepping causes an error
-    STEP_POLL_PERIOD = 0.005
+    INBOX_SIZE = 1 << 20  # Default bytes of the inbox of each robot
+    OUTBOX_SIZE = 1 << 16  # Initial bytes of the messages sent by each step
+    MAX_QUEUED_STEPS = 1  # BuzzVM.step blocks while this many steps wait for the stepper
+    CONNECT_TIMEOUT = 1  # seconds the constructor waits for the handshake to be sent
     NEIGHBOR_PATIENCE = 0.5  # seconds until neighbors are forgotten
     instances = []  # List of all BuzzVM instances. Used to close their sockets in BuzzVM.destroy
     destroyed = False  # True iff destroy() was called
     hooks = {}
+    batched_hooks = {}  # (module, hook) : python function, for each hook declared with @buzzhook(batched=True)
+    batched_ids = {}  # hook id : python function, for each batched hook
     py_initted = False
+    next_robot_id = 0  # Id given to the next BuzzVM created without robot_id. Never reused
 
     '''
     Create a Buzz Virtual Machine.
@@ -147,40 +899,51 @@ class BuzzVM:
         this script
     :param host: string. The host of the CommHub. HOST default is "localhost"
     :param port: int. The port of the CommHub. PORT default is 8000
+    :param native_hooks: list of strings. Names of the C hooks, made available with add_native_hook,
+        to bind in this Virtual Machine
+    :param transport: string. How to reach the CommHub: "tcp", "shm" (shared memory, for a CommHub on the
+        same host) or "udp". The CommHub must serve this transport
+    :param multicast_group: string. With transport="udp", the multicast group of the CommHub, if any
+    :param step_on_packets: bool. Take a step as soon as messages come from other robots, for event-driven
+        scripts. Coalesces with the steps already queued
+    :param inbox_size: int. Bytes of the records received and not stepped yet that this robot can hold
+    :param inbox_policy: string. When the inbox is full, "drop_oldest" drops the oldest records, and "block"
+        stops reading from the CommHub until the next step
     '''
-    def __init__(self, bo_filename, bdbg_filename, robot_id=None, host=HOST, port=PORT):
+    def __init__(self, bo_filename, bdbg_filename, robot_id=None, host=HOST, port=PORT, native_hooks=(),
+                 transport="tcp", multicast_group=None, step_on_packets=False, inbox_size=INBOX_SIZE,
+                 inbox_policy="drop_oldest"):
         self.alive = True
+        transport_flags(transport)  # Check the name before anything is created
+        self.inbox = Inbox(inbox_size, inbox_policy)
+        self.transport = transport
+        self.multicast_group = multicast_group
         if BuzzVM.destroyed:
             raise Exception("BuzzVM: Cannot create BuzzVM object after calling BuzzVM.destroy()")
-        BuzzVM.instances.append(self)  # Keep a record of this instance to close it properly
-        self.id = get_num_virtual_machines()
         if robot_id is None:
-            self.comm_id = self.id
+            self.comm_id = BuzzVM.next_robot_id
+            BuzzVM.next_robot_id += 1
         else:
             self.comm_id = robot_id
 
-        if buzz_script_set(bo_filename.encode(), bdbg_filename.encode(), int(self.comm_id)):
+        self.id = buzz_script_set(bo_filename.encode(), bdbg_filename.encode(), int(self.comm_id))
+        if self.id < 0:
             raise Exception('ERROR initializing buzz script')
+        BuzzVM.instances.append(self)  # Keep a record of this instance to close it properly
 
         self.loc = None  # unused. Need to send this to the robot outside the buzz script.
-        self.all_neighbors = {}
-        self.stepping = 0  # 0: ready to step, 1: stepping, 2: step() is blocked
-        self.stepping_lock = Lock()
-        self.packets = []
-        self.packets_lock = Lock()
-        self.packets_received = 0  # Reset at every step
+        self.located = Event()  # Set once self.loc is known, or the connection is lost
+        self.connected = Event()  # Set once the handshake is sent, or the connection failed
+        self.step_on_packets = step_on_packets
+        self.step_cond = Condition()  # Guards step_queue and step_running, notified when either changes
+        self.step_queue = deque()  # Futures of the steps not started yet
+        self.step_running = False  # True while the stepper thread or BuzzVM.step_all steps this robot
+        self.seq = 0  # Of the next frame sent to the CommHub
+        self.outbox = bytearray(BuzzVM.OUTBOX_SIZE)  # The messages of the last step
         self.s = None
+        self.reader = None  # PacketReader of the receiver thread, once connected
 
-        i = 0
-        for module, hooks in BuzzVM.hooks.items():
-            import_module(module.encode())
-            for hook in hooks:
-                if hook == "pyinit" and not BuzzVM.py_initted:
-                    BuzzVM.py_initted = True
-                    register_init()
-                elif hook != "pyinit":
-                    register_hook(self.id, i, hook.encode())
-                    i += 1
+        BuzzVM.register_hooks(self.id, native_hooks)
 
         t = Thread(target=self.receive, args=(host, port), name="Receiver. BuzzVM {}".format(self.comm_id))
         t.start()
@@ -188,122 +951,312 @@ class BuzzVM:
         t = Thread(target=self.stepper, name="Stepper. BuzzVM {}".format(self.comm_id))
         t.start()
 
-        time.sleep(0.25)  # Server issues if this is not here
+        self.connected.wait(BuzzVM.CONNECT_TIMEOUT)
+
+    '''
+    PRIVATE
+    Bind the buzzhooks, and the native hooks listed, in a Virtual Machine. Calls pyinit() the first time
+    :param vmid: int. id of the Virtual Machine
+    :param native_hooks: list of strings. Names of the C hooks made available with native_hook
+    '''
+    @staticmethod
+    def register_hooks(vmid, native_hooks):
+        for module, hooks in BuzzVM.hooks.items():
+            import_module(module.encode())
+            for hook in hooks:
+                if hook == "pyinit" and not BuzzVM.py_initted:
+                    BuzzVM.py_initted = True
+                    register_init()
+                elif hook != "pyinit":
+                    batched = (module, hook) in BuzzVM.batched_hooks
+                    hook_id = register_hook(vmid, hook.encode(), batched)
+                    if batched and hook_id >= 0:
+                        BuzzVM.batched_ids[hook_id] = BuzzVM.batched_hooks[(module, hook)]
+        for hook in native_hooks:
+            register_native_hook(vmid, hook.encode())
 
     '''
     PRIVATE
-    New thread that blocks until new packet comes. Packets are added to self.packets 
+    New thread that blocks until new frames come. Their records are added to self.inbox
     '''
     def receive(self, host, port):
-        self.s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         try:
-            self.s.connect((host, port))
+            self.s = self.connect(host, port)
         except socket.error:
             print("BuzzVM: No CommHub found during during initialization. Calling BuzzVM.destroy()")
+            self.connected.set()
+            self.located.set()  # Release the steps waiting for a position
             BuzzVM.destroy()
             return
-        self.s.sendall(struct.pack('I', self.comm_id))
+        self.connected.set()
+        reader = PacketReader(self.s, self.comm_id, self.inbox)
+        self.reader = reader
         while self.alive:
-            p = Packet.from_socket(self.s)
-            if p:
-                self.packets_received += 1
-                if self.packets_received > BuzzVM.MAX_PACKETS_RECEIVED:
-                    print("BuzzVM: Too long since Robot {} took a step. Closing connection to server".format(self.comm_id))
-                    break
-                if p.comm_id == self.comm_id:
-                    self.loc = (p.x, p.y, p.z)
-                else:
-                    # if len(p.msgs):  # Debug
-                    #     print("Robot {} received a message from Robot {}".format(self.comm_id, p.comm_id))
-                    self.packets_lock.acquire()
-                    self.packets.append(p)
-                    self.packets_lock.release()
-            else:
+            received = reader.read()
+            if received is False:
                 break
+            if reader.loc is not None:
+                self.loc = reader.loc
+                self.located.set()
+            if received and self.step_on_packets:
+                self.queue_step(block=False)
         self.s.close()
         self.loc = (0, 0, 0)  # In case we were waiting for this at the beginning of step(). Let some error be thrown
+        self.located.set()
         print("BuzzVM: Robot {} lost connection to server".format(self.comm_id))
 
+    '''
+    PRIVATE
+    Open the link to the CommHub with the transport of this robot, and introduce the robot
+    :return: socket, or an object with the same recv_into, sendall and close methods
+    '''
+    def connect(self, host, port):
+        if self.transport == "shm":
+            return ShmLink(port, self.comm_id)
+        if self.transport == "udp":
+            return UdpLink(host, port, self.comm_id, self.multicast_group)
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        try:
+            s.connect((host, port))
+            s.sendall(handshake(self.comm_id))
+        except socket.error as e:
+            s.close()
+            raise e
+        return s
+
     '''
     PRIVATE
     New thread to actually do the stepping while the main thread moves onto stepping for other robots.
+    Sleeps on self.step_cond until a step is queued, and completes the future of each step it takes
     '''
     def stepper(self):
-        while self.alive:
-            if self.stepping:  # Step
-                buzz_script_step(self.id)
+        while True:
+            with self.step_cond:
+                while self.alive and (not self.step_queue or self.step_running):
+                    self.step_cond.wait()
+                if not self.alive:
+                    break
+                future = self.step_queue.popleft()
+                self.step_running = True
+                self.step_cond.notify_all()  # Room in the queue for BuzzVM.step
+            try:
+                if future.set_running_or_notify_cancel():
+                    self.prepare_step()
+                    buzz_script_step(self.id)
+                    self.send_messages()
+                    future.set_result(None)
+            except Exception as e:
+                future.set_exception(e)
+            finally:
+                with self.step_cond:
+                    self.step_running = False
+                    self.step_cond.notify_all()
+        for future in self.step_queue:
+            future.cancel()
+        self.step_queue.clear()
+
+    '''
+    PRIVATE
+    Queue a step for the stepper thread
+    :param block: bool. Wait for room in the queue if True, otherwise give up when a step is already queued
+    :return: concurrent.futures.Future of the step, or None if it was not queued
+    '''
+    def queue_step(self, block=True):
+        with self.step_cond:
+            while block and self.alive and len(self.step_queue) >= BuzzVM.MAX_QUEUED_STEPS:
+                self.step_cond.wait()
+            if not self.alive or len(self.step_queue) >= BuzzVM.MAX_QUEUED_STEPS:
+                return None
+            future = Future()
+            self.step_queue.append(future)
+            self.step_cond.notify_all()
+            return future
+
+    '''
+    PRIVATE
+    Block until no step of this robot is queued or running
+    :param claim: bool. Also mark this robot as stepping, until BuzzVM.release_steps
+    '''
+    def wait_steps(self, claim=False):
+        with self.step_cond:
+            while self.step_queue or self.step_running:
+                self.step_cond.wait()
+            if claim:
+                self.step_running = True
 
-                # Send messages from step to neighbouring robots
-                msgs = []
-                while are_more_messages(self.id):
-                    message = get_next_message(self.id)
-                    msg_size = get_message_size()
-                    msgs.append(bytes(message[:msg_size]))
-                self.s.sendall(Packet(self.loc[0], self.loc[1], self.loc[2], self.comm_id, msgs).byte_string())
+    '''
+    PRIVATE
+    Let the stepper thread step this robot again, after BuzzVM.wait_steps(claim=True)
+    '''
+    def release_steps(self):
+        with self.step_cond:
+            self.step_running = False
+            self.step_cond.notify_all()
 
-                self.stepping_lock.acquire()
-                self.stepping -= 1
-                self.stepping_lock.release()
-            else:  # wait a little until next check
-                time.sleep(BuzzVM.STEP_POLL_PERIOD)
 
+    '''
+    PRIVATE
+    Send the messages from the last step to neighbouring robots
+    '''
+    def send_messages(self):
+        self.outbox, msgs = take_messages(self.id, self.outbox)
+        if not msgs:
+            return  # The CommHub knows the position of the robot from CommHub.update_position
+        if self.transport == "udp":
+            for group in split_messages(msgs, UDP_MAX_DATAGRAM):
+                self.s.send(uplink_frame(self.seq, self.comm_id, group))
+                self.seq += 1
+        else:
+            self.s.sendall(uplink_frame(self.seq, self.comm_id, msgs))
+            self.seq += 1
 
     '''
-    Take one step through the buzz script.
-    Blocks until this robot has received its absolute position from the CommHub.
-    Possible for this function to finish executing before the Buzz script step is complete.
+    PRIVATE
+    Feed the packets received since the last step and the position of the robot to the buzz script
     '''
-    def step(self):
-        if self.loc is None:
+    def prepare_step(self):
+        if not self.located.is_set():
             print("BuzzVM: Waiting for absolute position of Robot {} before stepping...".format(self.comm_id))
-            while self.loc is None:
-                time.sleep(BuzzVM.STEP_POLL_PERIOD)
+            self.located.wait()
             print("BuzzVM: Got Robot {}'s position. Stepping...".format(self.comm_id))
         if BuzzVM.destroyed:
             raise socket.error
-        # Copy list of packets and empty list self.packets
-        self.packets_received = 0
-        self.packets_lock.acquire()
-        packets = list(self.packets)[::-1]  # Reverse the list. Most recent first
-        self.packets = []
-        self.packets_lock.release()
-
-        # Update neighbor information
-        reset_neighbors(self.id)
-        neighbors = []
-        for p in packets:
-            if p.comm_id not in neighbors:
-                # Robot Faces in the positive x direction
-                rel_vector = np.array((p.x, p.y, p.z)) - np.array(self.loc)
-                distance = np.linalg.norm(rel_vector)  # This is also computed before sending the packet
-                if rel_vector[0] == 0:
-                    azimuth = -90*np.sign(rel_vector[1])
-                else:
-                    azimuth = np.arctan2(-rel_vector[1], rel_vector[0])*180/np.pi
-                elevation = np.arctan2(rel_vector[2], np.linalg.norm(rel_vector[:2]))*180/np.pi
-                # Seems okay to add the same neighbor twice (potentially)
-                add_neighbor(self.id, p.comm_id, float(distance), float(azimuth), float(elevation))
-                self.all_neighbors[p.comm_id] = [float(distance), float(azimuth), float(elevation), time.time()]
-                neighbors.append(p.comm_id)
-            for msg in p.msgs:
-                feed_buzz_message(self.id, p.comm_id, msg, len(msg))
-        # Add neighbours that have not yet sent packets
-        for i, n in self.all_neighbors.items():
-            if (i not in neighbors) and (time.time() - n[3] < BuzzVM.NEIGHBOR_PATIENCE):
-                add_neighbor(self.id, i, n[0], n[1], n[2])
-
-        # Send the absolute position of the robot to the buzz script
+        # Send the absolute position of the robot to the buzz script. The neighbors are relative to it
         set_abs_pos(self.id, self.loc[0], self.loc[1], self.loc[2])
 
-        # Step trhough buzz script TODO
-        if self.stepping:  
-            self.stepping_lock.acquire()
-            self.stepping += 1
-            self.stepping_lock.release()
-            while self.stepping == 2:
-                time.sleep(BuzzVM.STEP_POLL_PERIOD)
-        else:
-            self.stepping = 1  # signify to stepper that it's time to step. Don't need lock because it wont be decremented in stepper()
+        # Feed the messages, and update neighbor information. Only the most recent position of each neighbor is kept
+        self.inbox.drain(self.id)
+
+        # Keep neighbours that have not sent packets since the last step, for a while
+        age_neighbors(self.id, BuzzVM.NEIGHBOR_PATIENCE)
+
+    '''
+    Take one step through the buzz script, on the thread of this robot.
+    The step waits until this robot has received its absolute position from the CommHub.
+    Returns once the step is queued, and blocks only while the previous step is still waiting to run.
+    :return: concurrent.futures.Future, done when the step and the sending of its messages are complete
+    '''
+    def step(self):
+        if BuzzVM.destroyed:
+            raise socket.error
+        future = self.queue_step()
+        if future is None:
+            raise socket.error
+        return future
+
+    '''
+    Take one step through the buzz script for several robots at once.
+    The steps run in parallel on all cores, without holding the GIL except while a buzzhook runs.
+    Blocks until every robot has received its absolute position from the CommHub, and until all
+    the steps are complete.
+    :param vms: list of BuzzVM objects. All BuzzVM objects if left None
+    '''
+    @staticmethod
+    def step_all(vms=None):
+        if vms is None:
+            vms = list(BuzzVM.instances)
+        if len(vms) == 0:
+            return
+        cdef int[::1] vmids = np.array([bvm.id for bvm in vms], dtype=np.intc)
+        claimed = []
+        try:
+            for bvm in vms:
+                bvm.wait_steps(claim=True)  # Let the steps queued with BuzzVM.step finish
+                claimed.append(bvm)
+                bvm.prepare_step()
+            with nogil:
+                buzz_step_all(&vmids[0], vmids.shape[0])
+            BuzzVM.flush_hooks()
+            for bvm in vms:
+                bvm.send_messages()
+        finally:
+            for bvm in claimed:
+                bvm.release_steps()
+
+    '''
+    Deliver the calls queued by the batched buzzhooks since the last delivery, one Python call per hook.
+    Called at the end of BuzzVM.step_all. Must be called regularly when stepping with BuzzVM.step only
+    '''
+    @staticmethod
+    def flush_hooks():
+        cdef int* robots
+        cdef double* args
+        cdef int width
+        cdef int n
+        cdef double[::1] results
+        for hook_id, func in BuzzVM.batched_ids.items():
+            n = hook_batch_take(hook_id, &robots, &args, &width)
+            if n == 0:
+                hook_batch_give(hook_id, NULL, 0)
+                continue
+            robot_ids = np.array(<int[:n]> robots)
+            arguments = np.array(<double[:n, :HOOK_BATCH_MAX_ARGS]> args)[:, :width]
+            try:
+                ret_val = func(robot_ids, arguments)
+                results = np.ascontiguousarray(np.broadcast_to(np.asarray(ret_val, dtype=np.float64), (n,)))
+            except Exception as e:
+                print("BuzzVM: Error in batched buzzhook '{}': {}".format(func.__name__, e))
+                results = np.full(n, np.nan)
+            hook_batch_give(hook_id, &results[0], n)
+
+    '''
+    Counters of this robot since it was created. Can be called from any thread, at any time
+    :return: dict. summary of the 'step_us' duration of the steps, and of the 'receive_delay_us' from the
+        tick of the CommHub to the decoding of the frame by this robot (host clocks must agree), with
+        the 'count', 'mean', 'p50', 'p90', 'p99', 'p999' and 'max' of each, then the records
+        'inbox_dropped' because the inbox was full, the 'frames_lost' (udp), and the 'frames_unplaced'
+        because the keyframe of their origin was lost
+    '''
+    def stats(self):
+        cdef hist_summary_t s
+        reader = self.reader
+        step = {}
+        if not BuzzVM.destroyed and buzz_step_stats(self.id, &s) == 0:
+            step = summary(&s, 1e-3)
+        return {'step_us': step,
+                'receive_delay_us': reader.delay_stats() if reader is not None else {},
+                'inbox_dropped': self.inbox.dropped(),
+                'frames_lost': reader.frames_lost if reader is not None else 0,
+                'frames_unplaced': reader.frames_unplaced if reader is not None else 0}
+
+    '''
+    Time spent in each buzzhook, shared by all the robots
+    :return: dict. hook name : summary of the microseconds of each call, with the 'count', 'mean', 'p50',
+        'p90', 'p99', 'p999' and 'max'. For a batched hook, of each batch delivered by BuzzVM.flush_hooks
+    '''
+    @staticmethod
+    def hook_stats():
+        cdef hist_summary_t s
+        cdef const char* name
+        hooks = {}
+        for hook_id in range(get_num_python_hooks()):
+            name = python_hook_stats(hook_id, &s)
+            if name is not NULL:
+                hooks[name.decode()] = summary(&s, 1e-3)
+        return hooks
+
+    '''
+    Run another compiled script from the next step, without restarting the robot. Waits for the queued
+    steps. The swarms, stigmergies, neighbors and hooks of the robot are kept, as are the global variables
+    the new script does not assign, and the functions and message listeners of the old script are dropped.
+    The next step runs the global part of the new script, which assigns its global variables again, then
+    its init() when asked. The functions the old script stored in tables are kept: with init=False, the
+    new script must not call them. The new script must have the same string table as the running one:
+    the robot keeps running its script when it does not
+    :param bo_filename: string. *.bo filename from compiled buzz script
+    :param bdbg_filename: string. *.bdb filename from compiled buzz script
+    :param init: bool. Call init() of the new script
+    '''
+    def reload(self, bo_filename, bdbg_filename, init=True):
+        if BuzzVM.destroyed:
+            raise Exception("BuzzVM: Cannot reload after calling BuzzVM.destroy()")
+        self.wait_steps(claim=True)
+        try:
+            status = buzz_script_reload(self.id, bo_filename.encode(), bdbg_filename.encode(), bool(init))
+        finally:
+            self.release_steps()
+        if status < 0:
+            raise Exception('ERROR reloading buzz script')
 
     '''
     :return: boolean. True if buzz script finished
@@ -311,6 +1264,30 @@ class BuzzVM:
     def is_done(self):
         return bool(buzz_script_done(self.id))
 
+    '''
+    PRIVATE
+    Let the queued steps finish, then stop the stepper thread
+    '''
+    def stop_stepping(self):
+        self.wait_steps()
+        with self.step_cond:
+            self.alive = False
+            self.step_cond.notify_all()
+
+    '''
+    Destroy this Virtual Machine only, and close its socket. The other BuzzVM objects keep running
+    and new ones can still be created. Do not attempt to call methods from this object afterwards
+    '''
+    def close(self):
+        if BuzzVM.destroyed or self not in BuzzVM.instances:
+            return
+        self.stop_stepping()
+        self.inbox.close()  # Wakes the receiver thread waiting for room
+        if self.s is not None:
+            self.s.close()
+        BuzzVM.instances.remove(self)
+        buzz_vm_destroy(self.id)
+
     '''
     Destroy all Virtual Machines. Do not attempt to call methods from any existing BuzzVM
     objects, or create any new ones. Also closes sockets
@@ -320,189 +1297,820 @@ class BuzzVM:
         if len(BuzzVM.instances) and not BuzzVM.destroyed:
             BuzzVM.destroyed = True
             for bvm in BuzzVM.instances:
-                while bvm.stepping:
-                    time.sleep(BuzzVM.STEP_POLL_PERIOD)
-                bvm.alive = False
-                bvm.s.close()
+                bvm.stop_stepping()
+                bvm.inbox.close()
+                if bvm.s is not None:
+                    bvm.s.close()
             buzz_script_destroy()
 
 
-class Client:
+cdef class NeighborGrid:
     '''
     PRIVATE
-    Used by the CommHub to communicate with one of the BuzzVM objects on the client's computer.
-    :param conn: socket that is used for communication with the client
+    Robots in range of each other, with the grid of the CommHub (see hub_grid_neighbors)
     '''
-    def __init__(self, conn):
-        self.is_alive = True
-        self.comm_id = None
-        self.conn = conn
-        self.packets = []
-        self.packets_lock = Lock()
-        self.loc = None
+    cdef hub_grid_t grid
+    cdef int[::1] offsets
+    cdef int* neighbors
+
+    def __cinit__(self):
+        self.grid = hub_grid_new()
+        if self.grid is NULL:
+            raise MemoryError()
+        self.offsets = np.zeros(1, dtype=np.intc)
 
-        self.t = Thread(target=self.receive, name="Receiver. Client {}".format(self.comm_id))
-        self.t.start()
+    def __dealloc__(self):
+        hub_grid_destroy(self.grid)
 
     '''
     PRIVATE
-    New thread that blocks until new packet comes. Packets are added to self.packets 
+    Find the robots in range of each robot. The neighbors of robot i are neighbors[offsets[i]:offsets[i + 1]],
+    valid until the next call
     '''
-    def receive(self):
-        while True:
-            if not self.is_alive:
-                return
-            try:
-                m = self.conn.recv(4)
-                break
-            except socket.timeout:
-                pass
-        if len(m) == 0:
-            # The socket is broken
-            return False
-        self.comm_id = struct.unpack('I', m)[0]
-        while True:
-            p = Packet.from_socket(self.conn)
-            if p:
-                # print("Received packet from Robot {}".format(self.comm_id))  # Debug
-                self.packets_lock.acquire()
-                self.packets.append(p)
-                self.packets_lock.release()
-            else:
-                break
+    cdef int compute(self, const float[:, ::1] xyz, float radius) except -1:
+        cdef int n = xyz.shape[0]
+        if self.offsets.shape[0] < n + 1:
+            self.offsets = np.zeros(n + 1, dtype=np.intc)
+        if n == 0:
+            self.offsets[0] = 0
+            return 0
+        cdef int count = hub_grid_neighbors(self.grid, &xyz[0, 0], n, radius, &self.offsets[0], &self.neighbors)
+        if count < 0:
+            raise MemoryError()
+        return count
 
     '''
     PRIVATE
-    Destroy this client object by stopping its receive thread and clossing its socket
+    :param xyz: numpy.array of shape (n, 3). The positions
+    :param radius: float. The range
+    :return: (numpy.array, numpy.array) of ints. Each robot, and one of its neighbors, for every pair in range
     '''
-    def destroy(self):
-        self.is_alive = False
-        self.conn.close()
+    def pairs(self, xyz, float radius):
+        cdef const float[:, ::1] view = np.ascontiguousarray(xyz, dtype=np.float32).reshape(-1, 3)
+        cdef int count = self.compute(view, radius)
+        n = view.shape[0]
+        if count == 0:
+            return np.zeros(0, dtype=np.intc), np.zeros(0, dtype=np.intc)
+        offsets = np.asarray(self.offsets[:n + 1])
+        return np.repeat(np.arange(n, dtype=np.intc), np.diff(offsets)), np.array(<int[:count]> self.neighbors)
 
 
-class CommHub:
-    TIMEOUT = 1
+cdef class Simulation:
+    '''
+    Swarm simulated in this process, without CommHub, sockets or threads of its own.
+    The robots step in lockstep: at each tick, every robot gets the messages sent at the last tick
+    by the robots in range, as a CommHub forwarding every tick would deliver them, then all of them step.
+    Runs as fast as the robots step, and two runs from the same positions feed the same messages in
+    the same order
+    :param bo_filename: string. *.bo filename from compiled buzz script
+    :param bdbg_filename: string. *.bdb filename from compiled buzz script
+    :param robot_ids: int, or list of ints. Number of robots, with ids 0 to robot_ids - 1, or their ids
+    :param neighbor_distance: float. The range for communication between robots, in the units of the positions
+    :param native_hooks: list of strings. Names of the C hooks, made available with native_hook, to bind in
+        every robot
+    :param parallel: bool. Step the robots on all cores. Leave False for buzzhooks that keep a state shared
+        by the robots, so that they are called in the order of the robots
+    '''
+    cdef NeighborGrid grid
+    cdef readonly int[::1] vmids  # id of the Virtual Machine of each robot
+    cdef readonly object robot_ids  # numpy.uint16 array, in the order of the positions
+    cdef readonly float neighbor_distance
+    cdef readonly int ticks  # Taken so far
+    cdef readonly bint parallel
+    cdef bytearray outbox  # The messages of the last tick
+    cdef tuple sent  # Offsets of the messages in outbox, and number of messages of each robot, from pack_messages
+    cdef bint closed
+
+    def __init__(self, bo_filename, bdbg_filename, robot_ids, neighbor_distance=1, native_hooks=(), parallel=False):
+        if BuzzVM.destroyed:
+            raise Exception("Simulation: Cannot create a Simulation after calling BuzzVM.destroy()")
+        if isinstance(robot_ids, int):
+            robot_ids = range(robot_ids)
+        self.grid = NeighborGrid()
+        self.robot_ids = np.array(robot_ids, dtype=np.uint16)
+        self.neighbor_distance = neighbor_distance
+        self.parallel = parallel
+        n = self.robot_ids.shape[0]
+        self.vmids = np.full(n, -1, dtype=np.intc)
+        for i in range(n):
+            vmid = buzz_script_set(bo_filename.encode(), bdbg_filename.encode(), int(self.robot_ids[i]))
+            if vmid < 0:
+                self.close()
+                raise Exception('ERROR initializing buzz script')
+            self.vmids[i] = vmid
+            BuzzVM.register_hooks(vmid, native_hooks)
+        self.outbox = bytearray(BuzzVM.OUTBOX_SIZE)
+        self.sent = (np.zeros(1, dtype=np.intc), np.zeros(n, dtype=np.intc))
+
+    '''
+    Take one tick: deliver the messages of the last tick, step every robot, and keep their messages
+    :param positions: numpy.array of shape (number of robots, 3). Absolute position of each robot for this tick,
+        in the order of robot_ids
+    :param remote: tuple, or None. Robots stepped elsewhere, such as in another shard, seen as neighbors by
+        the robots of this Simulation: (ids, positions, messages, sizes, counts), with the messages they
+        sent at the last tick one after the other in a bytes-like object, the size of each message, and
+        the number of messages of each robot
+    '''
+    def step(self, positions, remote=None):
+        cdef int[::1] vmids = self.vmids
+        cdef int n = vmids.shape[0]
+        cdef int* neighbors
+        cdef int i, j, k, first, count
+        cdef const unsigned char[::1] outbox = self.outbox
+        cdef const unsigned char[::1] blob
+        # Messages of the last tick, as for feed_messages: first the robots of this Simulation, then the remote ones
+        cdef const int[::1] first_msg  # Index of the first message of each robot
+        cdef const int[::1] msg_offsets
+        cdef const uint16_t[::1] senders
+        cdef const int[::1] remote_first
+        cdef const int[::1] remote_offsets
+        cdef const uint16_t[::1] remote_senders
+        cdef const int[::1] offsets
+        cdef const uint16_t[::1] ids
+        if self.closed or BuzzVM.destroyed:
+            raise Exception("Simulation: Cannot step a closed Simulation")
+        positions = np.ascontiguousarray(positions, dtype=np.float32)
+        if positions.shape != (n, 3):
+            raise ValueError("Simulation: positions must have shape ({}, 3)".format(n))
+        if n == 0:
+            return
+        robot_ids = self.robot_ids
+        msg_offsets, counts = self.sent
+        first_msg = np.concatenate([[0], np.cumsum(counts)]).astype(np.intc)
+        senders = np.repeat(robot_ids, counts)
+        if remote is not None:
+            remote_ids, remote_xyz, remote_blob, remote_sizes, remote_counts = remote
+            remote_ids = np.asarray(remote_ids, dtype=np.uint16)
+            robot_ids = np.concatenate([robot_ids, remote_ids])
+            positions = np.ascontiguousarray(np.concatenate(
+                [positions, np.asarray(remote_xyz, dtype=np.float32).reshape(-1, 3)]))
+            blob = memoryview(remote_blob).cast('B')
+            remote_first = np.concatenate([[0], np.cumsum(remote_counts)]).astype(np.intc)
+            remote_offsets = np.concatenate([[0], np.cumsum(remote_sizes)]).astype(np.intc)
+            remote_senders = np.repeat(remote_ids, remote_counts)
+        cdef const float[:, ::1] xyz = positions
+        ids = robot_ids
+        self.grid.compute(xyz, self.neighbor_distance)
+        neighbors = self.grid.neighbors
+        offsets = self.grid.offsets
+        for i in range(n):
+            set_abs_pos(vmids[i], xyz[i, 0], xyz[i, 1], xyz[i, 2])
+        # The bearings of the neighbors are computed from the positions just set
+        set_neighbors_csr(&vmids[0], n, &offsets[0], neighbors, &ids[0], &xyz[0, 0])
+        for i in range(n):
+            for k in range(offsets[i], offsets[i + 1]):
+                j = neighbors[k]
+                if j < n:
+                    first = first_msg[j]
+                    count = first_msg[j + 1] - first
+                    if count and msg_offsets[first + count] > msg_offsets[first]:
+                        feed_buzz_messages(vmids[i], &senders[first], &outbox[0], &msg_offsets[first], count)
+                    continue
+                first = remote_first[j - n]
+                count = remote_first[j - n + 1] - first
+                if count and remote_offsets[first + count] > remote_offsets[first]:
+                    feed_buzz_messages(vmids[i], &remote_senders[first], &blob[0], &remote_offsets[first], count)
+        if self.parallel:
+            with nogil:
+                buzz_step_all(&vmids[0], n)
+        else:
+            for i in range(n):
+                buzz_script_step(vmids[i])
+        BuzzVM.flush_hooks()
+        self.outbox, msg_offsets_array, counts = pack_messages(vmids, self.outbox)
+        self.sent = (msg_offsets_array, counts)
+        self.ticks += 1
+
+    '''
+    The messages sent by each robot at the last tick, packed as for the remote robots of Simulation.step
+    :return: (bytes, numpy.array, numpy.array). The messages one after the other, the size of each message, and
+        the number of messages of each robot, in the order of robot_ids
+    '''
+    def messages(self):
+        msg_offsets, counts = self.sent
+        return bytes(memoryview(self.outbox)[:msg_offsets[-1]]), np.diff(msg_offsets).astype(np.intc), counts
+
+    '''
+    Take ticks until every robot is done, or for a number of ticks
+    :param positions: numpy.array of shape (ticks, number of robots, 3) with the positions of each tick, or a
+        function of the tick number returning the positions of the tick, or None to stop
+    :param ticks: int. Most ticks to take. The length of positions if left None
+    :return: int. Number of ticks taken
+    '''
+    def run(self, positions, ticks=None):
+        if ticks is None:
+            ticks = len(positions)
+        for t in range(ticks):
+            if self.all_done():
+                return t
+            tick = positions(self.ticks) if callable(positions) else positions[t]
+            if tick is None:
+                return t
+            self.step(tick)
+        return ticks
+
+    '''
+    Run another compiled script in every robot from the next tick, keeping their state, as BuzzVM.reload does.
+    The robots reloaded before an error run the new script
+    :param bo_filename: string. *.bo filename from compiled buzz script
+    :param bdbg_filename: string. *.bdb filename from compiled buzz script
+    :param init: bool. Call init() of the new script
+    '''
+    def reload(self, bo_filename, bdbg_filename, init=True):
+        for vmid in self.vmids:
+            if buzz_script_reload(vmid, bo_filename.encode(), bdbg_filename.encode(), bool(init)) < 0:
+                raise Exception('ERROR reloading buzz script')
+
+    '''
+    :return: numpy.array of bool. True for each robot whose buzz script finished
+    '''
+    def is_done(self):
+        return np.array([bool(buzz_script_done(vmid)) for vmid in self.vmids], dtype=bool)
+
+    '''
+    :return: bool. True once every buzz script finished
+    '''
+    def all_done(self):
+        return bool(self.is_done().all())
+
+    '''
+    Destroy the Virtual Machines of this Simulation. Other Simulations and BuzzVM objects keep running
+    '''
+    def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        if not BuzzVM.destroyed:
+            for vmid in self.vmids:
+                if vmid >= 0:
+                    buzz_vm_destroy(vmid)
+
+
+'''
+PRIVATE
+Run the commands of a ShardedSimulation on a Simulation of this process, until the connection closes
+:param conn: multiprocessing.connection.Connection to the ShardedSimulation
+'''
+def shard_worker(conn):
+    sim = None
+    try:
+        while True:
+            try:
+                command = conn.recv()
+            except EOFError:
+                break
+            kind = command[0]
+            if kind == "init":
+                sim = Simulation(*command[1:])
+                conn.send(True)
+            elif kind == "step":
+                sim.step(command[1], command[2])
+                conn.send(sim.messages())
+            elif kind == "reload":
+                sim.reload(*command[1:])
+                conn.send(True)
+            elif kind == "done":
+                conn.send(sim.is_done())
+            elif kind == "close":
+                break
+    except Exception as e:
+        print("Shard: Error: {}".format(e))
+        conn.send(e)
+    finally:
+        if sim is not None:
+            sim.close()
+        conn.close()
+
+
+'''
+Serve the shards of ShardedSimulation objects on this host, one at a time, until the process is killed.
+Import the modules with the buzzhooks before calling it. The Buzz scripts must be at the same path on
+every host
+:param address: (string, int). Address to listen on
+:param authkey: bytes. Key shared with the ShardedSimulation objects
+'''
+def serve_shard(address, authkey):
+    from multiprocessing.connection import Listener
+    with Listener(address, authkey=authkey) as listener:
+        while True:
+            shard_worker(listener.accept())
+
+
+class ShardedSimulation:
+    '''
+    Simulation split into shards, each stepping its robots in a process of its own, on this host or others.
+    Each robot belongs to a shard for good, cut by space from its first position. At each tick, the shards
+    step in parallel, and each gets, in one batch, the positions and the messages of the last tick of the
+    robots of the other shards in range of its own
+    :param bo_filename: string. *.bo filename from compiled buzz script
+    :param bdbg_filename: string. *.bdb filename from compiled buzz script
+    :param robot_ids: int, or list of ints. Number of robots, with ids 0 to robot_ids - 1, or their ids
+    :param positions: numpy.array of shape (number of robots, 3). First positions, to cut the shards
+    :param shards: int, or list of (host, port). Number of processes to fork on this host, or the addresses of
+        serve_shard on other hosts
+    :param neighbor_distance: float. The range for communication between robots, in the units of the positions
+    :param native_hooks: list of strings. Names of the C hooks, made available with native_hook, to bind in
+        every robot
+    :param parallel: bool. Step the robots of each shard on all the cores of its host
+    :param authkey: bytes. Key of the serve_shard processes
+    '''
+    def __init__(self, bo_filename, bdbg_filename, robot_ids, positions, shards=None, neighbor_distance=1,
+                 native_hooks=(), parallel=False, authkey=None):
+        import multiprocessing
+        from multiprocessing.connection import Client
+        if isinstance(robot_ids, int):
+            robot_ids = range(robot_ids)
+        self.robot_ids = np.array(robot_ids, dtype=np.uint16)
+        self.neighbor_distance = neighbor_distance
+        self.ticks = 0
+        self.grid = NeighborGrid()
+        if shards is None:
+            shards = os.cpu_count() or 1
+        n_shards = shards if isinstance(shards, int) else len(shards)
+        self.owner = ShardedSimulation.partition(np.asarray(positions, dtype=np.float32).reshape(-1, 3), n_shards)
+        self.members = [np.flatnonzero(self.owner == s) for s in range(n_shards)]
+        self.conns = []
+        self.processes = []
+        for s in range(n_shards):
+            if isinstance(shards, int):
+                ctx = multiprocessing.get_context("fork")  # The children inherit the buzzhooks
+                conn, child = ctx.Pipe()
+                p = ctx.Process(target=shard_worker, args=(child,), name="Shard {}".format(s), daemon=True)
+                p.start()
+                child.close()
+                self.processes.append(p)
+            else:
+                conn = Client(tuple(shards[s]), authkey=authkey)
+            self.conns.append(conn)
+        for s, conn in enumerate(self.conns):
+            conn.send(("init", bo_filename, bdbg_filename, self.robot_ids[self.members[s]].tolist(), neighbor_distance,
+                       native_hooks, parallel))
+        for conn in self.conns:
+            self.receive(conn)
+        # Messages of the last tick of each shard
+        self.sent = [(b'', np.zeros(0, dtype=np.intc), np.zeros(len(m), dtype=np.intc)) for m in self.members]
+
+    '''
+    PRIVATE
+    Cut space into shards of as many robots each, along the widest axis of the robots of each cut
+    :param xyz: numpy.array of shape (number of robots, 3)
+    :param n_shards: int
+    :return: numpy.array. The shard of each robot
+    '''
+    @staticmethod
+    def partition(xyz, n_shards):
+        owner = np.zeros(xyz.shape[0], dtype=np.intc)
+        def cut(robots, first, count):
+            if count == 1 or len(robots) == 0:
+                owner[robots] = first
+                return
+            axis = int(np.argmax(np.ptp(xyz[robots], axis=0)))
+            order = robots[np.argsort(xyz[robots, axis], kind="stable")]
+            half = count // 2
+            split = len(order) * half // count
+            cut(order[:split], first, half)
+            cut(order[split:], first + half, count - half)
+        cut(np.arange(xyz.shape[0]), 0, n_shards)
+        return owner
+
+    '''
+    PRIVATE
+    :return: the answer of a shard, raising the error of the shard if it failed
+    '''
+    def receive(self, conn):
+        answer = conn.recv()
+        if isinstance(answer, Exception):
+            raise answer
+        return answer
+
+    '''
+    Take one tick on every shard, in parallel
+    :param positions: numpy.array of shape (number of robots, 3). Absolute position of each robot for this tick,
+        in the order of robot_ids
+    '''
+    def step(self, positions):
+        positions = np.ascontiguousarray(positions, dtype=np.float32)
+        if positions.shape != (self.robot_ids.shape[0], 3):
+            raise ValueError("ShardedSimulation: positions must have shape ({}, 3)".format(self.robot_ids.shape[0]))
+        src, dst = self.grid.pairs(positions, self.neighbor_distance)
+        owner = self.owner
+        crossing = owner[src] != owner[dst]
+        src, dst = src[crossing], dst[crossing]
+        # Where the messages of each robot are in the batch of its shard
+        index = np.zeros(self.robot_ids.shape[0], dtype=np.intp)
+        byte_starts = []
+        msg_starts = []
+        for s, members in enumerate(self.members):
+            index[members] = np.arange(len(members))
+            _, sizes, counts = self.sent[s]
+            msg_starts.append(np.concatenate([[0], np.cumsum(counts)]).astype(np.intp))
+            byte_starts.append(np.concatenate([[0], np.cumsum(sizes)]).astype(np.intp))
+        for s, conn in enumerate(self.conns):
+            remote = np.unique(dst[owner[src] == s])
+            chunks = []
+            sizes = []
+            counts = np.zeros(len(remote), dtype=np.intc)
+            for k, j in enumerate(remote):
+                blob, shard_sizes, _ = self.sent[owner[j]]
+                first, last = msg_starts[owner[j]][index[j]], msg_starts[owner[j]][index[j] + 1]
+                starts = byte_starts[owner[j]]
+                chunks.append(blob[starts[first]:starts[last]])
+                sizes.append(shard_sizes[first:last])
+                counts[k] = last - first
+            sizes = np.concatenate(sizes).astype(np.intc) if sizes else np.zeros(0, dtype=np.intc)
+            conn.send(("step", positions[self.members[s]],
+                       (self.robot_ids[remote], positions[remote], b''.join(chunks), sizes, counts)))
+        self.sent = [self.receive(conn) for conn in self.conns]
+        self.ticks += 1
+
+    '''
+    Take ticks until every robot is done, or for a number of ticks
+    :param positions: numpy.array of shape (ticks, number of robots, 3) with the positions of each tick, or a
+        function of the tick number returning the positions of the tick, or None to stop
+    :param ticks: int. Most ticks to take. The length of positions if left None
+    :return: int. Number of ticks taken
+    '''
+    def run(self, positions, ticks=None):
+        if ticks is None:
+            ticks = len(positions)
+        for t in range(ticks):
+            if self.all_done():
+                return t
+            tick = positions(self.ticks) if callable(positions) else positions[t]
+            if tick is None:
+                return t
+            self.step(tick)
+        return ticks
+
+    '''
+    Run another compiled script in every robot of every shard from the next tick, as Simulation.reload does.
+    The script must be at the same path on every host
+    :param bo_filename: string. *.bo filename from compiled buzz script
+    :param bdbg_filename: string. *.bdb filename from compiled buzz script
+    :param init: bool. Call init() of the new script
+    '''
+    def reload(self, bo_filename, bdbg_filename, init=True):
+        for conn in self.conns:
+            conn.send(("reload", bo_filename, bdbg_filename, init))
+        for conn in self.conns:
+            self.receive(conn)
+
+    '''
+    :return: numpy.array of bool. True for each robot whose buzz script finished, in the order of robot_ids
+    '''
+    def is_done(self):
+        done = np.zeros(self.robot_ids.shape[0], dtype=bool)
+        for conn in self.conns:
+            conn.send(("done",))
+        for members, conn in zip(self.members, self.conns):
+            done[members] = self.receive(conn)
+        return done
+
+    '''
+    :return: bool. True once every buzz script finished
+    '''
+    def all_done(self):
+        return bool(self.is_done().all())
+
+    '''
+    Destroy the Virtual Machines of every shard, and stop the processes of this host
+    '''
+    def close(self):
+        for conn in self.conns:
+            try:
+                conn.send(("close",))
+                conn.close()
+            except OSError:
+                pass
+        for p in self.processes:
+            p.join()
+        self.conns = []
+        self.processes = []
+
+
+cdef class HubCore:
+    '''
+    PRIVATE
+    Native part of the CommHub: one thread serving the sockets of all the BuzzVM objects,
+    which decodes and forwards their packets without going through python
+    :param host: string. The host of the CommHub
+    :param port: int. The port of the CommHub
+    :param n_clients: int. Exact number of BuzzVM objects that will connect
+    :param neighbor_distance: float. The range for communication between robots
+    :param resolution: float. Step of the positions sent to the robots, 0 for the default
+    :param transports: int. TRANSPORT_* flags of the transports to serve besides TCP
+    :param multicast_group: string. IPv4 multicast group for the UDP clients, or None
+    '''
+    cdef commhub_t hub
+
+    def __cinit__(self, host, int port, int n_clients, float neighbor_distance, float resolution=0,
+                  int transports=0, multicast_group=None):
+        cdef const char* c_group = NULL
+        if multicast_group is not None:
+            group = multicast_group.encode()
+            c_group = group
+        self.hub = commhub_new(host.encode(), port, n_clients, neighbor_distance, resolution, transports, c_group)
+        if self.hub is NULL:
+            raise OSError(errno, os.strerror(errno))
+
+    def __dealloc__(self):
+        if self.hub is not NULL:
+            with nogil:
+                commhub_destroy(self.hub)
+
+    '''
+    PRIVATE
+    Forward only the latest of the messages of a robot that supersede each other. Before start
+    :param on: bool
+    '''
+    def set_coalescing(self, on):
+        if commhub_set_coalescing(self.hub, 1 if on else 0):
+            raise OSError(errno, os.strerror(errno))
+
+    '''
+    PRIVATE
+    Forward the messages of each robot lane after lane. Before start
+    :param lane_of_class: sequence of COMMHUB_NUM_CLASSES ints. Lane of each COMMHUB_CLASS_*
+    :param budgets: sequence of ints. Most bytes of a robot per tick of each lane, 0 for no limit
+    '''
+    def set_lanes(self, lane_of_class, budgets):
+        cdef int c_lanes[COMMHUB_NUM_CLASSES]
+        cdef size_t c_budgets[COMMHUB_NUM_CLASSES]
+        cdef int i
+        if len(lane_of_class) != COMMHUB_NUM_CLASSES or not 0 < len(budgets) <= COMMHUB_NUM_CLASSES:
+            raise ValueError("One lane per class, and at most one budget per class")
+        for i in range(COMMHUB_NUM_CLASSES):
+            c_lanes[i] = lane_of_class[i]
+            c_budgets[i] = budgets[i] if i < len(budgets) else 0
+        if commhub_set_lanes(self.hub, len(budgets), c_lanes, c_budgets):
+            raise OSError(errno, os.strerror(errno))
+
+    '''
+    PRIVATE
+    Bound the bytes waiting to be sent to each robot. Before start
+    :param high_water: int. The bytes, 0 for no limit
+    '''
+    def set_high_water(self, size_t high_water):
+        if commhub_set_high_water(self.hub, high_water):
+            raise OSError(errno, os.strerror(errno))
+
+    '''
+    PRIVATE
+    Capture the traffic of the hub in a log. Before start
+    :param filename: string. The log, replaced if it exists
+    :param ring_size: int. Bytes of the ring to the writer thread, 0 for the default
+    '''
+    def set_capture(self, filename, size_t ring_size=0):
+        if commhub_set_capture(self.hub, os.fsencode(filename), ring_size):
+            raise OSError(errno, os.strerror(errno), filename)
+
+    '''
+    PRIVATE
+    Start the thread of the hub
+    :param period: float. Seconds between automatic forwards, 0 for as often as possible, negative for none
+    :param cpu: int. Core the thread is pinned to, negative for any
+    '''
+    def start(self, double period, int cpu=-1):
+        if commhub_start(self.hub, period, cpu):
+            raise OSError(errno, os.strerror(errno))
+
+    '''
+    PRIVATE
+    Forward the packets received since the last forward, and return once they are sent
+    '''
+    def forward(self):
+        with nogil:
+            commhub_forward(self.hub)
+
+    '''
+    PRIVATE
+    :return: bool. False if no robot with this id is connected
+    '''
+    def update_position(self, uint32_t robot_id, float x, float y, float z):
+        return commhub_update_position(self.hub, robot_id, x, y, z) == 0
+
+    '''
+    PRIVATE
+    :param position: sequence of 3 floats
+    :param rotation: sequence of 4 floats. Quaternion (x, y, z, w)
+    :return: bool. False if no robot with this id is connected
+    '''
+    def update_pose(self, uint32_t robot_id, position, rotation):
+        cdef float p[3]
+        cdef float q[4]
+        p[0], p[1], p[2] = position
+        q[0], q[1], q[2], q[3] = rotation
+        return commhub_update_pose(self.hub, robot_id, p, q) == 0
+
+    '''
+    PRIVATE
+    :return: (x, y, z, yaw), or None if the robot has no position yet
+    '''
+    def get_pose(self, uint32_t robot_id):
+        cdef float pose[4]
+        if commhub_get_pose(self.hub, robot_id, pose):
+            return None
+        return pose[0], pose[1], pose[2], pose[3]
+
+    '''
+    PRIVATE
+    Block until the next lifecycle event of the hub
+    :param timeout_ms: int. Milliseconds to wait, forever if negative
+    :return: (type, robot_id, address), 0 on timeout, or None once the hub stopped
+    '''
+    def next_event(self, int timeout_ms=-1):
+        cdef commhub_event_t ev
+        cdef int status
+        with nogil:
+            status = commhub_next_event(self.hub, &ev, timeout_ms)
+        if status < 0:
+            return None
+        if status == 0:
+            return 0
+        return ev.type, ev.robot_id, ev.address.decode()
+
+    '''
+    PRIVATE
+    :return: dict. The counters of commhub_tick_stats_t
+    '''
+    def tick_stats(self):
+        cdef commhub_tick_stats_t stats
+        commhub_tick_stats(self.hub, &stats)
+        return {'ticks': stats.ticks, 'split': stats.split, 'missed': stats.missed, 'last_us': stats.last_us,
+                'max_us': stats.max_us, 'max_late_us': stats.max_late_us}
+
+    '''
+    PRIVATE
+    :return: dict. The counters of commhub_stats_t, with the durations in microseconds
+    '''
+    def stats(self):
+        cdef commhub_stats_t stats
+        commhub_stats(self.hub, &stats)
+        return {'frames_in': stats.frames_in, 'messages_in': stats.messages_in, 'bytes_in': stats.bytes_in,
+                'bytes_out': stats.bytes_out, 'datagrams_dropped': stats.datagrams_dropped,
+                'records_dropped': stats.records_dropped, 'disconnects': stats.disconnects,
+                'messages_coalesced': stats.messages_coalesced, 'messages_deferred': stats.messages_deferred,
+                'messages_shed': stats.messages_shed, 'frames_shed': stats.frames_shed,
+                'slow_clients': stats.slow_clients, 'capture_records': stats.capture_records,
+                'capture_dropped': stats.capture_dropped,
+                'forward_delay_us': summary(&stats.forward_delay, 1e-3),
+                'tick_us': summary(&stats.tick_time, 1e-3),
+                'tick_bytes': summary(&stats.tick_bytes),
+                'tick_messages': summary(&stats.tick_messages)}
+
+    '''
+    PRIVATE
+    :return: dict. The counters of commhub_queue_stats_t, or None if no robot with this id connected
+    '''
+    def queue_stats(self, uint32_t robot_id):
+        cdef commhub_queue_stats_t stats
+        if commhub_queue_stats(self.hub, robot_id, &stats):
+            return None
+        return {'queued_bytes': stats.queued_bytes, 'max_queued_bytes': stats.max_queued_bytes,
+                'frames_queued': stats.frames_queued, 'frames_shed': stats.frames_shed,
+                'bytes_shed': stats.bytes_shed}
+
+    def is_alive(self):
+        return bool(commhub_is_alive(self.hub))
+
+    def stop(self):
+        with nogil:
+            commhub_stop(self.hub)
+
 
+# Classes of the Buzz messages for the lanes of a CommHub, in the order of commhub_class_e
+MESSAGE_CLASSES = ("swarm", "stigmergy", "broadcast", "other")
+QUEUE_LIMIT = 1 << 22  # Bytes waiting for a slow robot, by default
+
+
+'''
+PRIVATE
+Lanes of the CommHub, as HubCore.set_lanes takes them
+:param lanes: list of (classes, budget). See CommHub
+:return: (list of int, list of int). The lane of each class, and the budget of each lane
+'''
+def lane_table(lanes):
+    lane_of_class = [None] * len(MESSAGE_CLASSES)
+    budgets = []
+    for classes, budget in lanes:
+        for name in [classes] if isinstance(classes, str) else classes:
+            if name not in MESSAGE_CLASSES or lane_of_class[MESSAGE_CLASSES.index(name)] is not None:
+                raise ValueError("Unknown or repeated class of messages: {}".format(name))
+            lane_of_class[MESSAGE_CLASSES.index(name)] = len(budgets)
+        budgets.append(int(budget or 0))
+    if None in lane_of_class:
+        lane_of_class = [len(budgets) if lane is None else lane for lane in lane_of_class]
+        budgets.append(0)
+    return lane_of_class, budgets
+
+
+class CommHub:
     '''
     Communication Hub
     Facilitate communication between the robots, as well as update their absolute positions
     :param n_clients: int. Exact number of BuzzVM objects that will connect to this CommHub
-    :param forward_freq: float. Frequency of automatic calls to CommHub.forward_packets in Hertz
-        Set forward_freq=0 for maximum frequency
+    :param forward_freq: float. Frequency of automatic calls to CommHub.forward_packets in Hertz, held
+        with absolute deadlines. Set forward_freq=0 for maximum frequency
         If left as None, CommHub.forward_packets must be called manually
     :param neighbor_distance: float. The range for communication between robots. Distance units must
         be consistent with the units used for CommHub.update_position
     :param host: string. The host of the CommHub. HOST default is "localhost"
     :param port: int. The port of the CommHub. PORT default is 8000
+    :param transport: string, or list of strings. Transports to serve besides "tcp": "shm" (shared memory,
+        for BuzzVM objects on the same host) and "udp"
+    :param multicast_group: string. IPv4 multicast group for the "udp" clients, used when neighbor_distance
+        is float('inf'). The packets go to the group on port + 1
+    :param pose_resolution: float. Step of the positions sent to the robots, in the units of
+        CommHub.update_position. If left None, neighbor_distance / 8192, or 0.001 for an infinite neighbor_distance
+    :param cpu: int. Core to pin the thread of the CommHub to, for steadier ticks. If left None, any core
+    :param coalesce: bool. Forward, at each tick, only the latest of the messages of a robot that supersede each
+        other: the broadcasts of one topic, the puts and the queries of one key of a stigmergy, and the lists of
+        swarms
+    :param lanes: list of (classes, budget). Priority lanes, first to last. classes is a string, or a list of
+        strings, among MESSAGE_CLASSES. budget is the most bytes of messages of each robot the lane forwards per
+        tick, or None for no limit. The classes left out go to a last lane without limit.
+        If left None, the messages are forwarded in the order they were sent
+    :param queue_limit: int. Most bytes waiting to be sent to a slow robot, over "tcp" or "shm". Past it, the
+        oldest frames without messages are dropped first, then the oldest ones. QUEUE_LIMIT (4 MiB) by default,
+        None or 0 for no limit
+    :param capture: string. Log of every frame sent to the robots and every pose update, written as the CommHub
+        runs and complete once it is destroyed, for Replay. If left None, nothing is captured
     '''
-    def __init__(self, n_clients, forward_freq=None, neighbor_distance=1, host=HOST, port=PORT):
-        self.alive = True
-        self.clients_connected = False
-        self.clients = {}  # comm_id : Client
-        self.locs = {}  # comm_id : np.array()
-        self.s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    def __init__(self, n_clients, forward_freq=None, neighbor_distance=1, host=HOST, port=PORT, transport="tcp",
+                 multicast_group=None, pose_resolution=None, cpu=None, coalesce=False, lanes=None,
+                 queue_limit=QUEUE_LIMIT, capture=None):
+        transports = transport_flags(transport)
         try:
-            self.s.bind((host, port))
+            self.core = HubCore(host, port, n_clients, neighbor_distance, pose_resolution or 0, transports,
+                                multicast_group)
         except OSError as e:
-            print("ERROR: Trying to create a CommHub on a busy address")
+            if e.errno != EINVAL:
+                print("ERROR: Trying to create a CommHub on a busy address")
             raise e
-        self.s.listen(n_clients)
+        if coalesce:
+            self.core.set_coalescing(True)
+        if lanes is not None:
+            self.core.set_lanes(*lane_table(lanes))
+        if queue_limit:
+            self.core.set_high_water(queue_limit)
+        if capture is not None:
+            self.core.set_capture(capture)
+        self.n_clients = n_clients
         self.neighbor_distance = neighbor_distance
-        
-        t = Thread(target=self.connect_clients, args=(n_clients,), name="Acceptor. CommHub")
-        t.start()
+        self.auto_forward = forward_freq is not None
+        self.clients_connected = Event()  # Also set when the hub dies, to release the waiting threads
 
-        if forward_freq is not None:
-            if forward_freq:
-                period = 1/forward_freq
-            else:
-                period = 0
-            t = Thread(target=self.auto_forward, args=(period,), name="Auto Forwarder")
-            t.start()
-
-    '''
-    PRIVATE
-    New blocking thread that accepts clients created during construction of BuzzVM
-    :param n_clients: int. number of clients expected
-    '''
-    def connect_clients(self, n_clients):
-        for i in range(n_clients):
-            if n_clients - i == 1:
-                clients = "client"
-            else:
-                clients = "clients"
-            print("CommHub: Waiting for {} {} before forwarding packets...".format(n_clients-i, clients))
-            conn, addr = self.s.accept()
-            conn.settimeout(CommHub.TIMEOUT)
-            c = Client(conn)
-            while c.comm_id is None:
-                time.sleep(0.05)
-            self.clients[c.comm_id] = c
-            print("CommHub: Client {} connected on {}".format(c.comm_id, addr))
-        print("CommHub: All clients connected! call update_position for each robot before forwarding packets")
-        self.clients_connected = True
+        if forward_freq is None:
+            period = -1
+        elif forward_freq:
+            period = 1/forward_freq
+        else:
+            period = 0
+        self.core.start(period, -1 if cpu is None else cpu)
 
-    '''
-    PRIVATE
-    Send packets to a destination
-    :param destination: the id of the robot to send the packages to
-    :param packets: a list of Packet objects, or just a single Packet
-    '''
-    def send_to(self, destination, packets):
-        try:
-            packets[0]
-        except (AttributeError, TypeError):
-            self.clients[destination].conn.sendall(packets.byte_string())
-            return
-        m = bytes()
-        for p in packets:
-            m += p.byte_string()
-        self.clients[destination].conn.sendall(m)
+        t = Thread(target=self.report_events, name="Events. CommHub", daemon=True)
+        t.start()
 
     '''
     PRIVATE
-    Automatically call CommHub.forward_packets at a certain frequency
-    :param period: float. Time between calls to CommHub.forward_packets in seconds
+    New thread that prints the connections and disconnections of the clients as the hub reports them
     '''
-    def auto_forward(self, period):
-        while (not self.clients_connected) and self.alive:
-            time.sleep(0.05)
-        print("CommHub: Automatically facilitating information transfer")
-        while self.alive:
-            self.forward_packets()
-            time.sleep(period)
+    def report_events(self):
+        connected = set()
+        remaining = self.n_clients
+        while True:
+            if not self.clients_connected.is_set():
+                clients = "client" if remaining == 1 else "clients"
+                print("CommHub: Waiting for {} {} before forwarding packets...".format(remaining, clients))
+            event = self.core.next_event()
+            if event is None:
+                break
+            kind, robot_id, address = event
+            if kind == COMMHUB_EVENT_CONNECTED:
+                connected.add(robot_id)
+                remaining = self.n_clients - len(connected)
+                print("CommHub: Client {} connected on {}".format(robot_id, address))
+            elif kind == COMMHUB_EVENT_DISCONNECTED:
+                print("CommHub: Robot {} disconnected".format(robot_id))
+            elif kind == COMMHUB_EVENT_ALL_CONNECTED:
+                print("CommHub: All clients connected! call update_position for each robot before forwarding packets")
+                if self.auto_forward:
+                    print("CommHub: Automatically facilitating information transfer")
+                self.clients_connected.set()
+            elif kind == COMMHUB_EVENT_OVERRUN:
+                stats = self.core.tick_stats()
+                print("CommHub: Warning: Forwarding is falling behind. {} of {} ticks ran past their deadline, "
+                      "{} were skipped".format(stats['split'], stats['ticks'], stats['missed']))
+            elif kind == COMMHUB_EVENT_STOPPED:
+                break
+        self.clients_connected.set()
 
     '''
     Keep the communication flowing between robots.
     All information shared between robots, and any updates to positions are not sent unless this function is called.
     '''
     def forward_packets(self):
-        if (not self.clients_connected) or (len(self.clients) != len(self.locs)):
-            return
-        found_someone_listening = False
-        for i1, c1 in self.clients.items():
-            if not c1.is_alive:
-                continue
-            c1.packets_lock.acquire()
-            packets = list(c1.packets)
-            c1.packets = []
-            c1.packets_lock.release()
-            if len(packets) == 0:
-                packets = Packet(self.locs[i1][0], self.locs[i1][1], self.locs[i1][2], i1)
-            for i2, c2 in self.clients.items():
-                if not c2.is_alive:
-                    continue
-                try:
-                    if i1 == i2:
-                        self.send_to(i2, Packet(self.locs[i1][0], self.locs[i1][1], self.locs[i1][2], i1))
-                    elif np.linalg.norm(self.locs[i2] - self.locs[i1]) < self.neighbor_distance:
-                        self.send_to(i2, packets)
-                    found_someone_listening = True
-                except socket.error as e:
-                    print("CommHub: Error sending packets to Robot {}".format(i2))
-                    c2.destroy()
-        if not found_someone_listening:
-            self.destroy()
+        self.core.forward()
 
     '''
     Update the position of the specified robot.
@@ -511,39 +2119,414 @@ class CommHub:
     :return: bool. True if update was successful
     '''
     def update_position(self, robot_id, loc):
-        if not self.alive:
+        if not self.clients_connected.is_set() and self.core.is_alive():
+            print("CommHub: Waiting for clients before updating position of Robot {}".format(robot_id))
+            self.clients_connected.wait()
+        if not self.core.is_alive():
             print("CommHub: Warning: Cannot update Robot {}'s position. Communication Hub died".format(robot_id))
             return False
-        if not self.clients_connected:
-            print("CommHub: Waiting for clients before updating position of Robot {}".format(robot_id))
-            while (not self.clients_connected) and self.alive:
-                time.sleep(0.05)
-        try:
-            self.clients[robot_id]
-            self.locs[robot_id] = np.array(loc)
+        if self.core.update_position(robot_id, loc[0], loc[1], loc[2]):
             return True
-        except KeyError:
-            print("CommHub: Error: Cannot update Robot {}'s position. Not connected to Communication Hub".format(robot_id))
-            self.destroy()
-            return False
+        print("CommHub: Error: Cannot update Robot {}'s position. Not connected to Communication Hub".format(robot_id))
+        self.destroy()
+        return False
+
+    '''
+    Update the pose of the specified robot from a motion capture frame, such as the rigid bodies of
+    OptiTrack. Never waits, so it can be called right from the thread that receives the frames
+    :param robot_id: int. the id of the robot whose pose is to be updated
+    :param position: list, tuple, or numpy.array. The new position of the robot
+    :param rotation: list, tuple, or numpy.array. The orientation of the robot, as a quaternion (x, y, z, w)
+    :return: bool. False if the robot did not connect yet, and the frame was dropped
+    '''
+    def update_pose(self, robot_id, position, rotation):
+        return self.core.update_pose(robot_id, position, rotation)
+
+    '''
+    Timing of the automatic forwards
+    :return: dict. 'ticks' served, 'split' ticks that ran past the next deadline and were finished just before
+        it, 'missed' deadlines skipped because the CommHub was late by whole periods, the duration of the
+        'last_us' tick and the longest one 'max_us' in microseconds, and 'max_late_us', the most a tick
+        started after its deadline
+    '''
+    def tick_stats(self):
+        return self.core.tick_stats()
+
+    '''
+    Counters of the CommHub since it was created. Read without stopping the CommHub
+    :return: dict. 'frames_in' with messages from the robots, 'messages_in' and their 'bytes_in', 'bytes_out'
+        sent to the robots, 'datagrams_dropped' by a full socket buffer, 'records_dropped' because they do not
+        fit in a datagram, 'disconnects' of robots, 'messages_coalesced' because a later message superseded them,
+        'messages_deferred' to the next tick by the budget of their lane, 'messages_shed' by a lane holding back
+        too much already, 'frames_shed' from the queues of slow robots, the 'slow_clients' with bytes waiting
+        at the end of the last tick, the 'capture_records' written to the log of capture and the
+        'capture_dropped' because the disk fell behind, and the summaries of the 'forward_delay_us' from the first
+        frame of a robot to the tick forwarding it, of the duration 'tick_us' of the ticks, and of the
+        'tick_bytes' and 'tick_messages' forwarded per tick, with the 'count', 'mean', 'p50', 'p90', 'p99',
+        'p999' and 'max' of each
+    '''
+    def stats(self):
+        return self.core.stats()
+
+    '''
+    Queue of the frames waiting for a slow robot, over "tcp" or "shm"
+    :param robot_id: int. the id of the robot
+    :return: dict. The 'queued_bytes' waiting now and the most ever, 'max_queued_bytes', the 'frames_queued'
+        because the robot did not take them right away, and the 'frames_shed' and 'bytes_shed' past the
+        queue_limit. None if the robot did not connect
+    '''
+    def queue_stats(self, robot_id):
+        return self.core.queue_stats(robot_id)
+
+    '''
+    Consistent snapshot of the last pose of the specified robot
+    :param robot_id: int. the id of the robot
+    :return: tuple (x, y, z, yaw), with the yaw about z in radians, 0 if only update_position was called.
+        None if the robot has no position yet
+    '''
+    def pose(self, robot_id):
+        return self.core.get_pose(robot_id)
 
     '''
     Determine if the CommHub is still alive
     '''
     def is_alive(self):
-        return self.alive
+        return self.core.is_alive()
 
     '''
     Destroy the Communication Hub, and all its clients
-    Called when CommHub.forward_packets encounters an error
+    Called automatically when CommHub.forward_packets finds no client listening anymore
     '''
     def destroy(self):
-        if self.alive:  # Must check here because might have been closed automatically in CommHub.auto_forward
-            self.alive = False
-            for i, c in self.clients.items():
-                if c.is_alive:
-                    c.destroy()
-            self.s.close()
+        self.core.stop()
+
+
+cdef class CaptureLog:
+    '''
+    Log written by a CommHub with a capture, read in place from a memory mapping (see capture_utility.h).
+    Iterating over it gives its records from the current one on:
+        ("tick", seconds, tick, ids, positions): a tick started, with the ids of the robots and their (n, 3)
+            positions
+        ("frame", seconds, robot_id, frame): the bytes sent to a robot, CAPTURE_MULTICAST for the multicast group
+        ("pose", seconds, robot_id, pose): a pose update (x, y, z, yaw), with the yaw None for
+            CommHub.update_position
+    with the seconds since the start of the capture
+    :param filename: string. The log
+    '''
+    cdef capture_reader_t reader
+    cdef bint is_open
+
+    def __cinit__(self, filename):
+        if capture_reader_open(&self.reader, os.fsencode(filename)):
+            raise OSError(errno, os.strerror(errno), filename)
+        self.is_open = True
+
+    def __dealloc__(self):
+        if self.is_open:
+            capture_reader_close(&self.reader)
+
+    '''
+    :return: int. Number of ticks of the log
+    '''
+    def ticks(self):
+        return self.reader.n_ticks if self.is_open else 0
+
+    '''
+    Go to a tick, with the per-tick index of the log
+    :param tick: int. The first tick numbered tick or later is the next record
+    :return: bool. False if there is no such tick
+    '''
+    def seek(self, uint64_t tick):
+        return self.is_open and capture_reader_seek(&self.reader, tick) == 0
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef capture_record_t rec
+        cdef const capture_tick_t* t
+        cdef const capture_position_t* p
+        cdef const capture_pose_t* pose
+        cdef uint32_t robot_id
+        cdef float[:, ::1] xyz
+        cdef uint32_t[::1] ids_view
+        cdef size_t i
+        if not self.is_open or not capture_reader_next(&self.reader, &rec):
+            raise StopIteration
+        seconds = (rec.time_ns - self.reader.file.start_ns) * 1e-9
+        if rec.type == CAPTURE_FRAME and rec.size >= sizeof(uint32_t):
+            memcpy(&robot_id, rec.payload, sizeof(uint32_t))
+            return "frame", seconds, robot_id, rec.payload[sizeof(uint32_t):rec.size]
+        if rec.type == CAPTURE_TICK and rec.size >= sizeof(capture_tick_t):
+            t = <const capture_tick_t*>rec.payload
+            if rec.size < sizeof(capture_tick_t) + t.n * sizeof(capture_position_t):
+                raise ValueError("Corrupted tick in the log")
+            p = <const capture_position_t*>(rec.payload + sizeof(capture_tick_t))
+            ids = np.empty(t.n, dtype=np.uint32)
+            positions = np.empty((t.n, 3), dtype=np.float32)
+            ids_view = ids
+            xyz = positions
+            for i in range(t.n):
+                ids_view[i] = p[i].robot_id
+                xyz[i, 0] = p[i].xyz[0]
+                xyz[i, 1] = p[i].xyz[1]
+                xyz[i, 2] = p[i].xyz[2]
+            return "tick", seconds, t.tick, ids, positions
+        if rec.type == CAPTURE_POSE and rec.size == sizeof(capture_pose_t):
+            pose = <const capture_pose_t*>rec.payload
+            return "pose", seconds, pose.robot_id, (pose.pose[0], pose.pose[1], pose.pose[2],
+                                                    pose.pose[3] if pose.has_yaw else None)
+        raise ValueError("Unknown record in the log")
+
+    '''
+    Release the mapping of the log
+    '''
+    def close(self):
+        if self.is_open:
+            capture_reader_close(&self.reader)
+            self.is_open = False
+
+
+class Replay:
+    '''
+    Play a log of a CommHub back into BuzzVM objects, in place of the CommHub. Each BuzzVM gets the frames the
+    CommHub sent its robot, in the same order, so its script hears the same neighbors at the same positions.
+    What the BuzzVM objects send is read and left out. Only for "tcp" BuzzVM objects
+    :param filename: string. Log written by CommHub(capture=filename)
+    :param speed: float. Pace of the replay, relative to the capture: 1 for the original pace, 2 for twice as
+        fast. If left None, as fast as the BuzzVM objects take the frames
+    :param host: string. The host the BuzzVM objects connect to, as for a CommHub
+    :param port: int. The port the BuzzVM objects connect to, as for a CommHub
+    :param start_tick: int. First tick played. A robot only knows its own position again from the next keyframe
+        of its position, at most 64 ticks later
+    :param on_pose: function(robot_id, pose), called with each pose update of the log, pose being (x, y, z, yaw)
+        as in CaptureLog. If left None, the pose updates are skipped
+    '''
+    def __init__(self, filename, speed=1.0, host=HOST, port=PORT, start_tick=0, on_pose=None):
+        self.log = CaptureLog(filename)
+        if not self.log.seek(start_tick):
+            self.log.close()
+            raise ValueError("No tick {} or later in {}".format(start_tick, filename))
+        self.first = next(self.log)  # The tick, with the robots of the log
+        self.robots = set(int(robot_id) for robot_id in self.first[3])
+        self.speed = speed
+        self.on_pose = on_pose
+        self.clients = {}
+        self.sel = selectors.DefaultSelector()
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        try:
+            self.listener.bind((host, port))
+            self.listener.listen(len(self.robots))
+        except socket.error:
+            self.close()
+            print("ERROR: Trying to create a Replay on a busy address")
+            raise
+        self.sel.register(self.listener, selectors.EVENT_READ)
+
+    '''
+    PRIVATE
+    Take a connection and its handshake. Connections of other robots than the ones of the log are closed
+    '''
+    def accept(self):
+        s, address = self.listener.accept()
+        s.settimeout(1)
+        try:
+            data = s.recv(5, socket.MSG_WAITALL)
+        except socket.error:
+            data = b''
+        if len(data) == 5:
+            robot_id, version = struct.unpack('<IB', data)
+            if version == WIRE_VERSION and robot_id in self.robots and robot_id not in self.clients:
+                s.settimeout(None)
+                self.clients[robot_id] = s
+                self.sel.register(s, selectors.EVENT_READ, robot_id)
+                print("Replay: Client {} connected on {}".format(robot_id, address[0]))
+                return
+        s.close()
+
+    '''
+    PRIVATE
+    Wait for the connections and the frames of the BuzzVM objects, reading and leaving out their frames
+    :param timeout: float. Seconds to wait at most, None for until something comes
+    '''
+    def serve(self, timeout):
+        for key, _ in self.sel.select(timeout):
+            if key.data is None:
+                self.accept()
+                continue
+            try:
+                data = key.fileobj.recv(1 << 16)
+            except socket.error:
+                data = b''
+            if not data:
+                self.sel.unregister(key.fileobj)
+                key.fileobj.close()
+                del self.clients[key.data]
+                print("Replay: Robot {} disconnected".format(key.data))
+
+    '''
+    PRIVATE
+    Send a frame of the log to a robot, or to all of them for the multicast group
+    '''
+    def send(self, robot_id, frame):
+        targets = self.clients.items() if robot_id == CAPTURE_MULTICAST else [(robot_id, self.clients.get(robot_id))]
+        for target, s in list(targets):
+            if s is None:
+                continue
+            try:
+                s.sendall(frame)
+            except socket.error:
+                self.sel.unregister(s)
+                s.close()
+                del self.clients[target]
+
+    '''
+    Wait for the robots of the log to connect, then play the log until its end. The connections stay open after
+    :param timeout: float. Seconds to wait for the robots. If left None, forever
+    :return: dict. The 'ticks', 'frames' and 'poses' played, and the 'seconds' they took. None if some robots
+        did not connect in time
+    '''
+    def run(self, timeout=None):
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while len(self.clients) < len(self.robots):
+            left = None if deadline is None else deadline - time.monotonic()
+            if left is not None and left <= 0:
+                return None
+            self.serve(left)
+        print("Replay: All clients connected! Playing the log")
+        played = {'ticks': 0, 'frames': 0, 'poses': 0}
+        start = time.monotonic()
+        first = self.first[1]
+        record = self.first
+        while record is not None:
+            kind, seconds, robot_id, value = record[:4]
+            wait = start + (seconds - first) / self.speed - time.monotonic() if self.speed else 0
+            if wait > 0 or kind == "tick":
+                self.serve(max(wait, 0))
+            if kind == "frame":
+                self.send(robot_id, value)
+                played['frames'] += 1
+            elif kind == "tick":
+                played['ticks'] += 1
+            elif self.on_pose is not None:
+                self.on_pose(robot_id, value)
+                played['poses'] += 1
+            record = next(self.log, None)
+        played['seconds'] = time.monotonic() - start
+        return played
+
+    '''
+    Close the connections of the BuzzVM objects, and release the log
+    '''
+    def close(self):
+        for s in self.clients.values():
+            s.close()
+        self.clients = {}
+        self.sel.close()
+        self.listener.close()
+        self.log.close()
+
+
+'''
+PRIVATE
+Lines of a summary returned by the stats methods, as a Prometheus summary
+:param name: string. Name of the metric
+:param labels: string. Labels of the metric, as 'key="value"' pairs separated by commas, or ''
+:param s: dict. summary
+:param scale: float. Factor from the unit of the summary to the unit of the metric
+'''
+def prometheus_summary(name, labels, s, scale=1):
+    if not s:
+        return []
+    sep = "," if labels else ""
+    lines = ['{}{{{}{}quantile="{}"}} {}'.format(name, labels, sep, q, s[key] * scale)
+             for q, key in (("0.5", 'p50'), ("0.9", 'p90'), ("0.99", 'p99'), ("0.999", 'p999'))]
+    labels = "{" + labels + "}" if labels else ""
+    lines.append("{}_sum{} {}".format(name, labels, s['mean'] * s['count'] * scale))
+    lines.append("{}_count{} {}".format(name, labels, s['count']))
+    return lines
+
+
+'''
+Counters of a CommHub, of BuzzVM objects and of the buzzhooks, in the text format of Prometheus.
+Durations are in seconds
+:param hub: CommHub object, or None
+:param vms: list of BuzzVM objects. All the BuzzVM objects of this process if left None
+:return: string
+'''
+def prometheus_text(hub=None, vms=None):
+    lines = []
+    if hub is not None:
+        stats = hub.stats()
+        for key in ('frames_in', 'messages_in', 'bytes_in', 'bytes_out', 'datagrams_dropped', 'records_dropped',
+                    'disconnects', 'messages_coalesced', 'messages_deferred', 'messages_shed', 'frames_shed',
+                    'capture_records', 'capture_dropped'):
+            lines.append("# TYPE pybuzz_commhub_{}_total counter".format(key))
+            lines.append("pybuzz_commhub_{}_total {}".format(key, stats[key]))
+        lines.append("# TYPE pybuzz_commhub_slow_clients gauge")
+        lines.append("pybuzz_commhub_slow_clients {}".format(stats['slow_clients']))
+        for key, name, scale in (('forward_delay_us', 'forward_delay_seconds', 1e-6),
+                                 ('tick_us', 'tick_seconds', 1e-6),
+                                 ('tick_bytes', 'tick_bytes', 1), ('tick_messages', 'tick_messages', 1)):
+            lines.append("# TYPE pybuzz_commhub_{} summary".format(name))
+            lines += prometheus_summary("pybuzz_commhub_" + name, "", stats[key], scale)
+    if vms is None:
+        vms = [] if BuzzVM.destroyed else list(BuzzVM.instances)
+    robots = [(bvm.comm_id, bvm.stats()) for bvm in vms]
+    if robots:
+        for key, name in (('step_us', 'step_seconds'), ('receive_delay_us', 'receive_delay_seconds')):
+            lines.append("# TYPE pybuzz_robot_{} summary".format(name))
+            for robot_id, stats in robots:
+                lines += prometheus_summary("pybuzz_robot_" + name, 'robot="{}"'.format(robot_id), stats[key], 1e-6)
+        for key in ('inbox_dropped', 'frames_lost', 'frames_unplaced'):
+            lines.append("# TYPE pybuzz_robot_{}_total counter".format(key))
+            lines += ['pybuzz_robot_{}_total{{robot="{}"}} {}'.format(key, robot_id, stats[key])
+                      for robot_id, stats in robots]
+    hooks = BuzzVM.hook_stats()
+    if hooks:
+        lines.append("# TYPE pybuzz_hook_seconds summary")
+        for name, s in hooks.items():
+            lines += prometheus_summary("pybuzz_hook_seconds", 'hook="{}"'.format(name), s, 1e-6)
+    return "\n".join(lines) + "\n"
+
+
+'''
+Serve prometheus_text over HTTP on a daemon thread, for Prometheus to scrape
+:param port: int. Port of the endpoint. Any path is answered
+:param hub: CommHub object, or None
+:param host: string. Address to listen on. All of them if left ''
+:return: http.server.ThreadingHTTPServer. Call its shutdown method to stop serving
+'''
+def serve_prometheus(port, hub=None, host=''):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            body = prometheus_text(hub).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain; version=0.0.4")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, *args):
+            pass
+
+    server = http.server.ThreadingHTTPServer((host, port), Handler)
+    server.daemon_threads = True
+    t = Thread(target=server.serve_forever, name="Prometheus endpoint", daemon=True)
+    t.start()
+    return server
+
+
+'''
+Make a C function available to the Buzz scripts under the given name, without any Python layer.
+The function is bound in the BuzzVM objects constructed with its name in native_hooks.
+:param name: string. Name of the function in Buzz
+:param capsule: PyCapsule named "pybuzz.native_hook" holding a pointer to an int (*)(buzzvm_t) function
+'''
+def native_hook(name, capsule):
+    cdef buzzvm_funp fun = <buzzvm_funp> PyCapsule_GetPointer(capsule, "pybuzz.native_hook")
+    add_native_hook(name.encode(), fun)
 
 
 '''
@@ -552,13 +2535,24 @@ Buzz hooks must be defined before the construction of any BuzzVM objects.
 Buzz hooks can take any number of int, float, and str arguments, and return
     up to one int, float, or str object to the Buzz script.
 
+With batched=True, calls from all the robots are queued during the step, and the python
+    function is called once per BuzzVM.flush_hooks with two numpy arrays: the ids of the
+    calling robots, and one row of float arguments per call (str arguments become nan).
+    It returns one number per call (nan for nil). In Buzz, a batched hook returns the value
+    computed for this robot at the last delivery, or nil before the first one.
+
 Example usage:
     @buzzhook
     def my_func(*args): ...
+
+    @buzzhook(batched=True)
+    def my_sensor(robot_ids, args): ...
 In Buzz:
     foo = my_func(1, 2.0, "three")
 '''
-def buzzhook(hook):
+def buzzhook(hook=None, batched=False):
+    if hook is None:
+        return lambda h: buzzhook(h, batched)
     module_name = hook.__module__
     if module_name == '__main__':
         module_name = sys.argv[0].split('.')[0].split('/')[-1]
@@ -567,6 +2561,9 @@ def buzzhook(hook):
     if hook.__name__ not in BuzzVM.hooks[module_name]:
         BuzzVM.hooks[module_name].append(hook.__name__)
         print("From '{}' import '{}' to Buzz".format(module_name, hook.__name__))
+    if batched:
+        BuzzVM.batched_hooks[(module_name, hook.__name__)] = hook  # The main script is not in sys.modules under module_name
+        return hook
     def func(*args):
         new_args = ()
         for arg in args:
@@ -0,0 +1,72 @@
+#include "stats_utility.h"
+
+#include <time.h>
+
+/****************************************/
+/****************************************/
+
+static int hist_bucket(uint64_t value) {
+   if(value < HIST_SUB) return (int)value;
+   int e = 63 - __builtin_clzll(value);  // value is in [2^e, 2^(e+1))
+   int index = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+   return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Middle of a bucket */
+static uint64_t hist_value(int index) {
+   if(index < HIST_SUB) return (uint64_t)index;
+   int e = index / HIST_SUB + HIST_SUB_BITS - 1;
+   uint64_t width = (uint64_t)1 << (e - HIST_SUB_BITS);
+   return ((uint64_t)(HIST_SUB + index % HIST_SUB) << (e - HIST_SUB_BITS)) + width / 2;
+}
+
+static uint64_t load(const atomic_uint_fast64_t* v) {
+   return atomic_load_explicit((atomic_uint_fast64_t*)v, memory_order_relaxed);
+}
+
+void counter_add(atomic_uint_fast64_t* counter, uint64_t n) {
+   atomic_store_explicit(counter, load(counter) + n, memory_order_relaxed);
+}
+
+void hist_record(hist_t* h, uint64_t value) {
+   counter_add(&h->count[hist_bucket(value)], 1);
+   counter_add(&h->sum, value);
+   if(value > load(&h->max)) atomic_store_explicit(&h->max, value, memory_order_relaxed);
+   /* Last, so that a reader never sees more values in total than in the buckets */
+   atomic_store_explicit(&h->total, load(&h->total) + 1, memory_order_release);
+}
+
+void hist_summarize(const hist_t* h, hist_summary_t* s) {
+   static const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+   uint64_t* out[4] = { &s->p50, &s->p90, &s->p99, &s->p999 };
+   uint64_t counts[HIST_BUCKETS];
+   int i, q = 0;
+   s->count = atomic_load_explicit((atomic_uint_fast64_t*)&h->total, memory_order_acquire);
+   s->sum = load(&h->sum);
+   s->max = load(&h->max);
+   uint64_t total = 0;
+   for(i = 0; i < HIST_BUCKETS; ++i)
+      total += counts[i] = load(&h->count[i]);
+   /* Buckets written after total was read count too: the percentiles are of what the buckets hold */
+   uint64_t seen = 0;
+   for(i = 0; i < HIST_BUCKETS && q < 4; ++i) {
+      seen += counts[i];
+      while(q < 4 && seen && (double)seen >= quantiles[q] * (double)total) {
+         uint64_t v = hist_value(i);
+         *out[q++] = v < s->max ? v : s->max;
+      }
+   }
+   for(; q < 4; ++q) *out[q] = 0;
+}
+
+uint64_t stats_now_ns(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+uint64_t stats_realtime_us(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
@@ -0,0 +1,51 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifndef STATS_UTILITY_H
+#define STATS_UTILITY_H
+
+/*
+Histogram with buckets in the manner of HdrHistogram: one bucket per value
+below HIST_SUB, then HIST_SUB buckets per power of two, so that a value is
+known within 1 / HIST_SUB of itself. The values larger than the last bucket,
+about 1.7e10 (17 s in nanoseconds), land in it.
+A histogram is written by one thread at a time, without locks or atomic
+read-modify-writes, and read by any thread while it is written.
+*/
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  256
+
+typedef struct hist_s {
+   atomic_uint_fast64_t count[HIST_BUCKETS];
+   atomic_uint_fast64_t total;
+   atomic_uint_fast64_t sum;
+   atomic_uint_fast64_t max;
+} hist_t;
+
+typedef struct hist_summary_s {
+   uint64_t count;
+   uint64_t sum;
+   uint64_t max;
+   uint64_t p50;
+   uint64_t p90;
+   uint64_t p99;
+   uint64_t p999;
+} hist_summary_t;
+
+/* Add a value. Only one thread may add to a histogram at a time */
+extern void hist_record(hist_t* h, uint64_t value);
+
+/* Count and percentiles of the values added so far. The percentiles are the middle of their bucket */
+extern void hist_summarize(const hist_t* h, hist_summary_t* s);
+
+/* Add n to a counter with a single writer */
+extern void counter_add(atomic_uint_fast64_t* counter, uint64_t n);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+extern uint64_t stats_now_ns(void);
+
+/* CLOCK_REALTIME in microseconds, the clock of the timestamps of the frames */
+extern uint64_t stats_realtime_us(void);
+
+#endif
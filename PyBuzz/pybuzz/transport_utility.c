@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "transport_utility.h"
+#include "packet_utility.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/****************************************/
+/****************************************/
+
+size_t shm_ring_write(shm_ring_t* ring, const void* data, size_t len) {
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+   size_t room = ring->capacity - (size_t)(head - tail);
+   size_t n = len < room ? len : room;
+   size_t at = head & (ring->capacity - 1);
+   size_t first = n < ring->capacity - at ? n : ring->capacity - at;
+   memcpy(ring->data + at, data, first);
+   memcpy(ring->data, (const uint8_t*)data + first, n - first);
+   atomic_store_explicit(&ring->head, head + n, memory_order_release);
+   return n;
+}
+
+size_t shm_ring_read(shm_ring_t* ring, void* buf, size_t cap) {
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+   size_t available = (size_t)(head - tail);
+   size_t n = cap < available ? cap : available;
+   size_t at = tail & (ring->capacity - 1);
+   size_t first = n < ring->capacity - at ? n : ring->capacity - at;
+   memcpy(buf, ring->data + at, first);
+   memcpy((uint8_t*)buf + first, ring->data, n - first);
+   atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+#define SHM_RING_BYTES (sizeof(shm_ring_t) + SHM_RING_CAPACITY)
+
+/* Point the rings of a channel to its mapping */
+static void channel_rings(shm_channel_t* ch) {
+   ch->to_hub = (shm_ring_t*)ch->map;
+   ch->to_vm = (shm_ring_t*)(ch->map + SHM_RING_BYTES);
+}
+
+int shm_channel_create(shm_channel_t* ch) {
+   memset(ch, 0, sizeof(*ch));
+   ch->hub_fd = ch->vm_fd = -1;
+   ch->map_size = 2 * SHM_RING_BYTES;
+   ch->mem_fd = memfd_create("pybuzz", MFD_CLOEXEC);
+   if(ch->mem_fd < 0) return -1;
+   if(ftruncate(ch->mem_fd, ch->map_size)) goto error;
+   ch->map = (uint8_t*)mmap(NULL, ch->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->mem_fd, 0);
+   if(ch->map == MAP_FAILED) {
+      ch->map = NULL;
+      goto error;
+   }
+   channel_rings(ch);
+   ch->to_hub->capacity = SHM_RING_CAPACITY;
+   ch->to_vm->capacity = SHM_RING_CAPACITY;
+   ch->hub_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   ch->vm_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(ch->hub_fd < 0 || ch->vm_fd < 0) goto error;
+   return 0;
+ error:;
+   int error = errno;
+   shm_channel_destroy(ch);
+   errno = error;
+   return -1;
+}
+
+int shm_channel_send(int sock, const shm_channel_t* ch) {
+   int fds[3] = { ch->mem_fd, ch->hub_fd, ch->vm_fd };
+   char control[CMSG_SPACE(sizeof(fds))];
+   char byte = 0;
+   struct iovec iov = { &byte, 1 };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   memset(control, 0, sizeof(control));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+   return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+void shm_channel_destroy(shm_channel_t* ch) {
+   if(ch->map) munmap(ch->map, ch->map_size);
+   if(ch->mem_fd >= 0) close(ch->mem_fd);
+   if(ch->hub_fd >= 0) close(ch->hub_fd);
+   if(ch->vm_fd >= 0) close(ch->vm_fd);
+   ch->map = NULL;
+   ch->mem_fd = ch->hub_fd = ch->vm_fd = -1;
+}
+
+socklen_t shm_socket_address(int port, void* addr) {
+   struct sockaddr_un* un = (struct sockaddr_un*)addr;
+   memset(un, 0, sizeof(*un));
+   un->sun_family = AF_UNIX;
+   /* Abstract name, gone with the socket */
+   int n = snprintf(un->sun_path + 1, sizeof(un->sun_path) - 1, "pybuzz.%d", port);
+   return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + n);
+}
+
+/****************************************/
+/****************************************/
+
+struct shm_link_s {
+   int           sock;
+   shm_channel_t ch;
+};
+
+/* Take the fds sent by shm_channel_send */
+static int link_receive_fds(shm_link_t link) {
+   int fds[3];
+   char control[CMSG_SPACE(sizeof(fds))];
+   char byte;
+   struct iovec iov = { &byte, 1 };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   ssize_t n;
+   do {
+      n = recvmsg(link->sock, &msg, MSG_CMSG_CLOEXEC);
+   } while(n < 0 && errno == EINTR);
+   if(n <= 0) {
+      if(n == 0) errno = ECONNREFUSED;  // The CommHub turned this robot down
+      return -1;
+   }
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+      errno = EPROTO;
+      return -1;
+   }
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+   link->ch.mem_fd = fds[0];
+   link->ch.hub_fd = fds[1];
+   link->ch.vm_fd = fds[2];
+   struct stat st;
+   if(fstat(link->ch.mem_fd, &st)) return -1;
+   link->ch.map_size = st.st_size;
+   if(link->ch.map_size != 2 * SHM_RING_BYTES) {
+      errno = EPROTO;
+      return -1;
+   }
+   link->ch.map = (uint8_t*)mmap(NULL, link->ch.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, link->ch.mem_fd, 0);
+   if(link->ch.map == MAP_FAILED) {
+      link->ch.map = NULL;
+      return -1;
+   }
+   channel_rings(&link->ch);
+   return 0;
+}
+
+shm_link_t shm_link_connect(int port, uint32_t robot_id) {
+   shm_link_t link = (shm_link_t)calloc(1, sizeof(struct shm_link_s));
+   if(!link) return NULL;
+   link->ch.mem_fd = link->ch.hub_fd = link->ch.vm_fd = -1;
+   struct sockaddr_un addr;
+   socklen_t addr_len = shm_socket_address(port, &addr);
+   uint8_t handshake[HANDSHAKE_SIZE];
+   handshake_put(handshake, robot_id);
+   link->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if(link->sock < 0 ||
+      connect(link->sock, (struct sockaddr*)&addr, addr_len) ||
+      send(link->sock, handshake, sizeof(handshake), MSG_NOSIGNAL) != sizeof(handshake) ||
+      link_receive_fds(link)) {
+      int error = errno;
+      shm_link_close(link);
+      errno = error;
+      return NULL;
+   }
+   return link;
+}
+
+/* The CommHub is gone when its end of the unix socket is closed */
+static int link_hub_gone(shm_link_t link) {
+   struct pollfd p = { link->sock, POLLIN, 0 };
+   return poll(&p, 1, 0) > 0 && (p.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+int shm_link_send(shm_link_t link, const void* data, size_t len) {
+   uint64_t one = 1;
+   while(len) {
+      size_t n = shm_ring_write(link->ch.to_hub, data, len);
+      if(n) {
+         data = (const uint8_t*)data + n;
+         len -= n;
+         if(write(link->ch.hub_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) return -1;
+      }
+      else {
+         /* The ring is full. The CommHub empties it as soon as it is signaled */
+         if(link_hub_gone(link)) return -1;
+         usleep(50);
+      }
+   }
+   return 0;
+}
+
+ssize_t shm_link_recv(shm_link_t link, void* buf, size_t cap, int timeout_ms) {
+   uint64_t value;
+   while(1) {
+      size_t n = shm_ring_read(link->ch.to_vm, buf, cap);
+      if(n) return (ssize_t)n;
+      struct pollfd p[2] = { { link->ch.vm_fd, POLLIN, 0 }, { link->sock, POLLIN, 0 } };
+      int status = poll(p, 2, timeout_ms);
+      if(status < 0) {
+         if(errno == EINTR) continue;
+         return -1;
+      }
+      if(status == 0) return 0;
+      if(p[1].revents) return -1;
+      /* Reset the counter before looking at the ring, so no signal is missed */
+      if(read(link->ch.vm_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) return -1;
+   }
+}
+
+void shm_link_shutdown(shm_link_t link) {
+   shutdown(link->sock, SHUT_RDWR);
+}
+
+void shm_link_close(shm_link_t link) {
+   if(!link) return;
+   if(link->sock >= 0) close(link->sock);
+   shm_channel_destroy(&link->ch);
+   free(link);
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t udp_send_datagram(int fd,
+                          const void* addr,
+                          socklen_t addr_len,
+                          const struct iovec* iov,
+                          int count) {
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_name = (void*)addr;
+   msg.msg_namelen = addr_len;
+   msg.msg_iov = (struct iovec*)iov;
+   msg.msg_iovlen = count;
+   ssize_t n;
+   do {
+      n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+   } while(n < 0 && errno == EINTR);
+   /* A datagram the socket cannot take now is lost, like on the network */
+   if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED)) n = 0;
+   return n;
+}
@@ -0,0 +1,116 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef TRANSPORT_UTILITY_H
+#define TRANSPORT_UTILITY_H
+
+/*
+Transports between the BuzzVMs and the CommHub, besides the TCP stream.
+
+shm: for the BuzzVMs on the same host as the CommHub. The BuzzVM connects to
+a unix socket named after the port of the CommHub and sends its handshake,
+like over TCP. The CommHub answers with a shared memory segment holding one byte ring
+per direction, and one eventfd per direction to signal new bytes. The bytes in
+the rings are frames, as over TCP. The unix socket only tells when the other
+side is gone.
+
+udp: for the robots on the same LAN. Each datagram holds one frame. A BuzzVM
+registers by sending its handshake alone in a datagram, until the CommHub
+answers. With a multicast group, and when every robot is in range of every
+other, the CommHub sends the frame of each robot once to the group, on the
+port after its own.
+*/
+#define TRANSPORT_TCP 1
+#define TRANSPORT_SHM 2
+#define TRANSPORT_UDP 4
+
+#define SHM_RING_CAPACITY (1 << 18)   // Bytes of each ring, a power of two
+#define UDP_MAX_DATAGRAM  65507       // Largest UDP payload over IPv4
+
+/****************************************/
+/****************************************/
+
+/*
+Single producer single consumer byte ring, in memory shared by two processes.
+head and tail count the bytes written and read since the start.
+*/
+typedef struct shm_ring_s {
+   atomic_uint_fast64_t head;   // Only written by the producer
+   char                 pad1[64 - sizeof(atomic_uint_fast64_t)];
+   atomic_uint_fast64_t tail;   // Only written by the consumer
+   char                 pad2[64 - sizeof(atomic_uint_fast64_t)];
+   uint64_t             capacity;
+   char                 pad3[64 - sizeof(uint64_t)];
+   uint8_t              data[];
+} shm_ring_t;
+
+/* Write up to len bytes. Return the number of bytes written */
+extern size_t shm_ring_write(shm_ring_t* ring, const void* data, size_t len);
+
+/* Read up to cap bytes. Return the number of bytes read */
+extern size_t shm_ring_read(shm_ring_t* ring, void* buf, size_t cap);
+
+typedef struct shm_channel_s {
+   uint8_t*    map;
+   size_t      map_size;
+   shm_ring_t* to_hub;
+   shm_ring_t* to_vm;
+   int         mem_fd;
+   int         hub_fd;   // eventfd, written after bytes are put in to_hub
+   int         vm_fd;    // eventfd, written after bytes are put in to_vm
+} shm_channel_t;
+
+/* Create the segment and the eventfds of a new BuzzVM. Return 0, or -1 and set errno */
+extern int shm_channel_create(shm_channel_t* ch);
+
+/* Send the fds of a channel over a unix socket. Return 0, or -1 and set errno */
+extern int shm_channel_send(int sock, const shm_channel_t* ch);
+
+extern void shm_channel_destroy(shm_channel_t* ch);
+
+/* Fill addr with the name of the unix socket of the CommHub on this port */
+extern socklen_t shm_socket_address(int port, void* addr);
+
+/*
+BuzzVM side of the shm transport
+*/
+typedef struct shm_link_s* shm_link_t;
+
+/* Connect to the CommHub on this port of the host. Return NULL and set errno on error */
+extern shm_link_t shm_link_connect(int port, uint32_t robot_id);
+
+/* Write all the bytes, waiting for room if needed. Return 0, or -1 if the CommHub is gone */
+extern int shm_link_send(shm_link_t link, const void* data, size_t len);
+
+/*
+Wait up to timeout_ms for bytes from the CommHub.
+Return the number of bytes read, 0 on timeout, or -1 if the CommHub is gone.
+*/
+extern ssize_t shm_link_recv(shm_link_t link, void* buf, size_t cap, int timeout_ms);
+
+/*
+Tell the CommHub this robot is gone, from any thread. The calls waiting on the
+link return, and the next ones fail, until shm_link_close.
+*/
+extern void shm_link_shutdown(shm_link_t link);
+
+extern void shm_link_close(shm_link_t link);
+
+/****************************************/
+/****************************************/
+
+/*
+Send the buffers as one datagram. Return its size, 0 if it was lost, or -1
+and set errno on error.
+*/
+extern ssize_t udp_send_datagram(int fd,
+                                 const void* addr,
+                                 socklen_t addr_len,
+                                 const struct iovec* iov,
+                                 int count);
+
+#endif
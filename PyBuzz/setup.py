@@ -1,4 +1,10 @@
-from setuptools import setup, Extension
+import os
+import platform
+import shlex
+import subprocess
+import sys
+
+from setuptools import setup, Extension, Command
 from Cython.Distutils import build_ext
 
 NAME = "pybuzz"
@@ -12,12 +18,64 @@ SRC_DIR = "pybuzz"
 PACKAGES = [SRC_DIR]
 
 ext_1 = Extension(NAME,
-                  [SRC_DIR + "/buzz_utility.c", SRC_DIR + "/pybuzz.pyx"],
-                  libraries=['buzz', 'buzzdbg'])
+                  [SRC_DIR + "/buzz_utility.c", SRC_DIR + "/commhub_utility.c", SRC_DIR + "/packet_utility.c",
+                   SRC_DIR + "/transport_utility.c", SRC_DIR + "/inbox_utility.c", SRC_DIR + "/stats_utility.c",
+                   SRC_DIR + "/geometry_utility.c", SRC_DIR + "/capture_utility.c", SRC_DIR + "/pybuzz.pyx"],
+                  libraries=['buzz', 'buzzdbg', 'pthread', 'm'],
+                  # 32-bit ARM boards only get the NEON kernels with -mfpu=neon. 64-bit ARM always has NEON
+                  extra_compile_args=['-O3'] + (['-mfpu=neon'] if platform.machine().startswith('armv7') else []))
 
 EXTENSIONS = [ext_1]
 
 
+class Bench(Command):
+    '''
+    python setup.py bench [--options="..."]
+    Build the extension in place, and run benchmark.py with the options given
+    '''
+    description = "build the extension in place and run the benchmarks"
+    user_options = [("options=", None, "options of benchmark.py. Default: --output bench.json")]
+
+    def initialize_options(self):
+        self.options = "--output bench.json"
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        build = self.reinitialize_command("build_ext")
+        build.inplace = 1
+        self.run_command("build_ext")
+        here = os.path.dirname(os.path.abspath(__file__))
+        subprocess.check_call([sys.executable, "benchmark.py"] + shlex.split(self.options), cwd=here)
+
+
+class Test(Command):
+    '''
+    python setup.py test
+    Build and run the tests of the C code that needs neither Buzz nor Python, from tests/
+    '''
+    description = "build and run the C tests"
+    user_options = []
+    TESTS = {"test_packet": [SRC_DIR + "/packet_utility.c"]}
+
+    def initialize_options(self):
+        pass
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        here = os.path.dirname(os.path.abspath(__file__))
+        cc = shlex.split(os.environ.get("CC", "cc"))
+        os.makedirs(os.path.join(here, "build"), exist_ok=True)
+        for name, sources in Test.TESTS.items():
+            binary = os.path.join("build", name)
+            subprocess.check_call(cc + ["-std=gnu11", "-O2", "-Wall", "-I" + SRC_DIR, "tests/" + name + ".c"] +
+                                  sources + ["-lm", "-o", binary], cwd=here)
+            subprocess.check_call([os.path.join(here, binary)], cwd=here)
+
+
 if __name__ == "__main__":
     setup(install_requires=REQUIRES,
           packages=PACKAGES,
@@ -27,6 +85,6 @@ if __name__ == "__main__":
           description=DESCR,
           author=AUTHOR,
           author_email=EMAIL,
-          cmdclass={"build_ext": build_ext},
+          cmdclass={"build_ext": build_ext, "bench": Bench, "test": Test},
           ext_modules=EXTENSIONS
           )
@@ -0,0 +1,204 @@
+/*
+Round trips and truncated inputs of the wire format of packet_utility.h.
+No Buzz and no Python: build and run it with
+   python setup.py test
+*/
+#include "packet_utility.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                  \
+   do {                                                              \
+      if(!(cond)) {                                                  \
+         fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+         failures++;                                                 \
+      }                                                              \
+   } while(0)
+
+/****************************************/
+/****************************************/
+
+static void test_varint(void) {
+   static const uint64_t values[] = {
+      0, 1, 0x7f, 0x80, 0x3fff, 0x4000, UINT32_MAX, (uint64_t)1 << 63, UINT64_MAX
+   };
+   static const size_t sizes[] = { 1, 1, 1, 2, 2, 3, 5, 10, 10 };
+   uint8_t buf[VARINT_MAX_SIZE];
+   size_t i, n, cut;
+   for(i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+      n = varint_put(buf, values[i]);
+      CHECK(n == sizes[i]);
+      const uint8_t* p = buf;
+      uint64_t v = 0;
+      CHECK(varint_get(&p, buf + n, &v) == 0 && v == values[i] && p == buf + n);
+      /* Cut anywhere before its last byte: nothing is read */
+      for(cut = 0; cut < n; ++cut) {
+         p = buf;
+         CHECK(varint_get(&p, buf + cut, &v) == -1 && p == buf);
+      }
+   }
+   /* Eleven continuation bytes are not a varint, whatever the end */
+   memset(buf, 0x80, sizeof(buf));
+   const uint8_t* p = buf;
+   uint64_t v;
+   CHECK(varint_get(&p, buf + sizeof(buf), &v) == -1);
+}
+
+static void test_frame_scan(void) {
+   uint8_t buf[64];
+   size_t length = 0;
+   size_t n = frame_put_prefix(buf, 200);
+   CHECK(n == 3);
+   memset(buf + n, 0, 200 > sizeof(buf) - n ? sizeof(buf) - n : 200);
+   CHECK(frame_scan(buf, 0, &length) == 0);
+   CHECK(frame_scan(buf, 2, &length) == 0);            // Size cut at the end of the bytes
+   CHECK(frame_scan(buf, sizeof(buf), &length) == 0);  // Body not there yet
+   buf[0] = WIRE_VERSION + 1;
+   CHECK(frame_scan(buf, sizeof(buf), &length) == -1);
+   /* A size that never ends is not a frame */
+   buf[0] = WIRE_VERSION;
+   memset(buf + 1, 0xff, VARINT_MAX_SIZE + 1);
+   CHECK(frame_scan(buf, 1 + VARINT_MAX_SIZE + 1, &length) == -1);
+   n = frame_put_prefix(buf, 4);
+   memset(buf + n, 0, 4);
+   CHECK(frame_scan(buf, sizeof(buf), &length) == 1 && length == n + 4);
+}
+
+/****************************************/
+/****************************************/
+
+/* Frame from the CommHub with one record and its messages. Return its length */
+static size_t put_frame(uint8_t* out, uint64_t seq, pose_codec_t* own, const float* origin,
+                        uint32_t robot_id, const float* position, const char* msg) {
+   uint8_t body[256];
+   float coded[4];
+   size_t n = frame_put_header(body, seq, 1000 + seq, own, origin, 0.001f, 1, coded);
+   n += frame_put_record(body + n, robot_id, position, coded, coded[3]);
+   if(msg) {
+      n += varint_put(body + n, strlen(msg));
+      memcpy(body + n, msg, strlen(msg));
+      n += strlen(msg);
+   }
+   body[n++] = 0;
+   size_t prefix = frame_put_prefix(out, n);
+   memcpy(out + prefix, body, n);
+   return prefix + n;
+}
+
+static int near(float a, float b) {
+   return fabsf(a - b) <= 0.001f;
+}
+
+static void test_poses(void) {
+   pose_codec_t hub, robot;
+   frame_view_t v;
+   record_view_t r;
+   uint8_t frame[512];
+   float origin[3] = { 1.5f, -2.0f, 0.25f };
+   float position[3] = { 3.0f, -4.0f, 0.5f };
+   int k;
+   memset(&hub, 0, sizeof(hub));
+   memset(&robot, 0, sizeof(robot));
+
+   /* The first frame is a keyframe */
+   size_t n = put_frame(frame, 1, &hub, origin, 7, position, "hello");
+   CHECK(frame_open(frame, n, &robot, &v) == 0);
+   CHECK(v.flags == (FRAME_OWN | FRAME_KEY) && v.seq == 1 && v.timestamp == 1001 && v.has_origin);
+   for(k = 0; k < 3; ++k) CHECK(v.origin[k] == origin[k]);
+   CHECK(frame_next_record(&v, &r) == 1 && r.sender == 7 && r.num_msgs == 1);
+   for(k = 0; k < 3; ++k) CHECK(near(r.position[k], position[k]));
+   const uint8_t* p = r.msgs;
+   const uint8_t* msg;
+   size_t size;
+   CHECK(message_next(&p, &msg, &size) == 1 && size == 5 && !memcmp(msg, "hello", 5));
+   CHECK(message_next(&p, &msg, &size) == 0);
+   CHECK(frame_next_record(&v, &r) == 0);
+
+   /* Then deltas against it */
+   origin[0] += 0.5f;
+   n = put_frame(frame, 2, &hub, origin, 7, position, NULL);
+   CHECK(frame_open(frame, n, &robot, &v) == 0);
+   CHECK(v.flags == FRAME_OWN && v.has_origin);
+   for(k = 0; k < 3; ++k) CHECK(near(v.origin[k], origin[k]));
+   CHECK(frame_next_record(&v, &r) == 1 && r.num_msgs == 0);
+   for(k = 0; k < 3; ++k) CHECK(near(r.position[k], position[k]));
+
+   /* A delta after a missed keyframe has no origin, and its records no position */
+   pose_codec_t late;
+   memset(&late, 0, sizeof(late));
+   CHECK(frame_open(frame, n, &late, &v) == 0 && !v.has_origin);
+   CHECK(frame_next_record(&v, &r) == 1 && isnan(r.position[0]));
+   /* Nor does one against an older keyframe than the receiver has */
+   robot.key_seq = 0;
+   CHECK(frame_open(frame, n, &robot, &v) == 0 && !v.has_origin);
+
+   /* A jump too large for a delta gets a keyframe again */
+   origin[0] += 2 * POSE_MAX_STEPS * 0.001f;
+   n = put_frame(frame, 3, &hub, origin, 7, position, NULL);
+   CHECK(frame_open(frame, n, &late, &v) == 0 && (v.flags & FRAME_KEY) && v.has_origin);
+
+   /* Positions far from the origin round trip through the largest zigzags */
+   float far[3] = { 1e15f, -1e15f, 0 };
+   n = put_frame(frame, 4, NULL, origin, UINT32_MAX, far, NULL);
+   CHECK(frame_open(frame, n, NULL, &v) == 0 && v.flags == FRAME_KEY);
+   CHECK(frame_next_record(&v, &r) == 1 && r.sender == UINT32_MAX);
+   CHECK(fabsf(r.position[0] - far[0]) <= 1e15f * 1e-6f && fabsf(r.position[1] - far[1]) <= 1e15f * 1e-6f);
+}
+
+static void test_truncated(void) {
+   pose_codec_t hub, robot;
+   frame_view_t v;
+   record_view_t r;
+   uint8_t frame[512];
+   float origin[3] = { 0, 0, 0 };
+   float position[3] = { 1, 2, 3 };
+   size_t n, cut;
+   memset(&hub, 0, sizeof(hub));
+   n = put_frame(frame, 1, &hub, origin, 300, position, "message");
+   CHECK(n - 2 < 0x80 && frame[1] == n - 2);
+   /* Whatever the cut, decoding fails cleanly instead of reading past the end */
+   for(cut = 1; cut < n; ++cut) {
+      memset(&robot, 0, sizeof(robot));
+      uint8_t copy[512];
+      memcpy(copy, frame, cut);
+      size_t body = cut > 2 ? cut - 2 : 0;
+      copy[1] = (uint8_t)body;   // The body fits in one byte of size
+      int status = frame_open(copy, cut, &robot, &v);
+      if(status == 0) status = frame_next_record(&v, &r) == 1 ? 0 : -1;
+      CHECK(status == -1);
+   }
+
+   /* messages_scan rejects a length cut at the end, and message_next stops at it */
+   uint8_t msgs[VARINT_MAX_SIZE];
+   size_t size;
+   int num;
+   memset(msgs, 0x80, sizeof(msgs));
+   CHECK(messages_scan(msgs, msgs + 3, &size, &num) == -1);
+   const uint8_t* p = msgs;
+   const uint8_t* msg;
+   CHECK(message_next(&p, &msg, &size) == 0);
+   /* A message longer than what is left */
+   n = varint_put(msgs, 100);
+   msgs[n] = 'x';
+   CHECK(messages_scan(msgs, msgs + n + 1, &size, &num) == -1);
+}
+
+/****************************************/
+/****************************************/
+
+int main() {
+   test_varint();
+   test_frame_scan();
+   test_poses();
+   test_truncated();
+   if(failures) {
+      fprintf(stderr, "%d checks failed\n", failures);
+      return 1;
+   }
+   printf("packet_utility: all checks passed\n");
+   return 0;
+}